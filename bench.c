@@ -0,0 +1,110 @@
+/******************************************************************************
+ * Copyright (c) 2017 Linaro Limited
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *****************************************************************************/
+
+/* Benchmark blocks. risugen --bench emits, for each pattern group,
+ * a straight-line block of test insns between an OP_BENCHSTART and
+ * an OP_BENCHLOOP, with no checkpoints in between. We save the state
+ * at the start of the block and restore it at the end, so every
+ * iteration runs the same insns on the same values, and the state at
+ * the final OP_TESTEND can still be compared as usual.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "risu.h"
+
+#define MAX_BENCH_BLOCKS 256
+
+struct bench_block {
+    uintptr_t pc;           /* image offset of the OP_BENCHSTART */
+    uint64_t insns;         /* per iteration */
+    uint64_t iterations;
+    uint64_t ns;
+};
+
+static __thread struct bench_block blocks[MAX_BENCH_BLOCKS];
+static __thread int nblocks;
+static __thread int dropped_blocks;
+
+/* The block we are in */
+static __thread struct reginfo start_ri;
+static __thread uint64_t iterations, iterations_left;
+static __thread uint64_t start_ns;
+
+static uint64_t bench_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void bench_op(int op, struct reginfo *ri, void *uc)
+{
+    uint64_t now = bench_time();
+    struct bench_block *b;
+
+    if (op == OP_BENCHSTART) {
+        start_ri = *ri;
+        /* the count is set with a 32 bit move on some targets */
+        iterations = (uint32_t) get_reginfo_paramreg(ri);
+        if (iterations == 0) {
+            iterations = 1;
+        }
+        iterations_left = iterations - 1;
+        start_ns = now;
+        return;
+    }
+
+    if (iterations_left) {
+        /* back to the OP_BENCHSTART, which the caller steps over */
+        iterations_left--;
+        set_ucontext_reginfo(uc, &start_ri);
+        return;
+    }
+
+    if (nblocks == MAX_BENCH_BLOCKS) {
+        dropped_blocks++;
+        return;
+    }
+    b = &blocks[nblocks++];
+    b->pc = get_pc(&start_ri);
+    b->insns = (uint32_t) get_reginfo_paramreg(ri);
+    b->iterations = iterations;
+    b->ns = now - start_ns;
+}
+
+void report_bench(void)
+{
+    int i;
+
+    for (i = 0; i < nblocks; i++) {
+        struct bench_block *b = &blocks[i];
+        uint64_t total = b->insns * b->iterations;
+        double secs = b->ns / 1e9;
+        /* a block's group is the insn name its patterns share */
+        const char *pattern = image_pattern_after(&image_meta, b->pc);
+
+        if (pattern) {
+            fprintf(stderr, "bench %.*s: ", (int)strcspn(pattern, " "),
+                    pattern);
+        } else {
+            fprintf(stderr, "bench block at image offset 0x%" PRIxPTR ": ",
+                    b->pc);
+        }
+        fprintf(stderr, "%" PRIu64 " insns x %" PRIu64 " in %.3fs, "
+                "%.2f Minsn/s\n", b->insns, b->iterations, secs,
+                b->ns ? total / secs / 1e6 : 0.0);
+    }
+    if (dropped_blocks) {
+        fprintf(stderr, "(%d more bench blocks not timed)\n",
+                dropped_blocks);
+    }
+}
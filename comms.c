@@ -15,13 +15,63 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netdb.h>
 
 #include "risu.h"
 
+/* With a watchdog running, a session doesn't block in the socket
+ * calls but waits in watchdog_wait() when they would block, so the
+ * watchdog can stop it.
+ */
+static int sock_flags(void)
+{
+    return watchdog_running() ? MSG_DONTWAIT : 0;
+}
+
+/* After a socket call fails: should we try again? */
+static int sock_retry(int sock, int events)
+{
+    if (errno == EINTR) {
+        return 1;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return watchdog_wait(sock, events) == 0;
+    }
+    return 0;
+}
+
+/* Wait for a non-blocking connect() to finish */
+static int wait_connected(int sock)
+{
+    struct pollfd pfd;
+    socklen_t len = sizeof(int);
+    int err;
+
+    if (watchdog_wait(sock, POLLOUT) < 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    pfd.fd = sock;
+    pfd.events = POLLOUT;
+    while (poll(&pfd, 1, -1) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+        return -1;
+    }
+    errno = err;
+    return err ? -1 : 0;
+}
+
 int apprentice_connect(const char *hostname, int port)
 {
     /* We are the client end of the TCP connection */
@@ -30,7 +80,7 @@ int apprentice_connect(const char *hostname, int port)
     sock = socket(PF_INET, SOCK_STREAM, 0);
     if (sock < 0) {
         perror("socket");
-        exit(1);
+        return -1;
     }
     struct hostent *hostinfo;
     sa.sin_family = AF_INET;
@@ -38,30 +88,36 @@ int apprentice_connect(const char *hostname, int port)
     hostinfo = gethostbyname(hostname);
     if (!hostinfo) {
         fprintf(stderr, "Unknown host %s\n", hostname);
-        exit(1);
+        close(sock);
+        return -1;
     }
     sa.sin_addr = *(struct in_addr *) hostinfo->h_addr;
-    if (connect(sock, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+    if (connect(sock, (struct sockaddr *) &sa, sizeof(sa)) < 0
+        && (errno != EINPROGRESS || wait_connected(sock) != 0)) {
         perror("connect");
-        exit(1);
+        close(sock);
+        return -1;
     }
+    fcntl(sock, F_SETFL, 0);
     return sock;
 }
 
-int master_connect(int port)
+int master_listen(int port, int backlog)
 {
     int sock;
     struct sockaddr_in sa;
     sock = socket(PF_INET, SOCK_STREAM, 0);
     if (sock < 0) {
         perror("socket");
-        exit(1);
+        return -1;
     }
     int sora = 1;
     if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &sora, sizeof(sora)) !=
         0) {
         perror("setsockopt(SO_REUSEADDR)");
-        exit(1);
+        close(sock);
+        return -1;
     }
 
     sa.sin_family = AF_INET;
@@ -69,48 +125,140 @@ int master_connect(int port)
     sa.sin_addr.s_addr = htonl(INADDR_ANY);
     if (bind(sock, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
         perror("bind");
-        exit(1);
+        close(sock);
+        return -1;
     }
-    if (listen(sock, 1) < 0) {
+    if (listen(sock, backlog) < 0) {
         perror("listen");
-        exit(1);
+        close(sock);
+        return -1;
     }
-    /* Just block until we get a connection */
-    fprintf(stderr, "master: waiting for connection on port %d...\n",
-            port);
+    return sock;
+}
+
+int master_accept(int sock)
+{
     struct sockaddr_in csa;
     socklen_t csasz = sizeof(csa);
-    int nsock = accept(sock, (struct sockaddr *) &csa, &csasz);
+    int nsock;
+
+    if (watchdog_wait(sock, POLLIN) < 0) {
+        return -1;
+    }
+    nsock = accept(sock, (struct sockaddr *) &csa, &csasz);
     if (nsock < 0) {
         perror("accept");
-        exit(1);
     }
+    return nsock;
+}
+
+int master_connect(int port)
+{
+    int sock = master_listen(port, 1);
+    if (sock < 0) {
+        return -1;
+    }
+
+    /* Just block until we get a connection */
+    fprintf(stderr, "master: waiting for connection on port %d...\n",
+            port);
+    int nsock = master_accept(sock);
     /* We're done with the server socket now */
     close(sock);
     return nsock;
 }
 
+/* At the start of a session the apprentice sends a hello describing
+ * the image it is going to run, so a daemon master knows which image
+ * to load and either side can check they agree. The master answers
+ * with a HELLO_* response byte. If the apprentice asked for it
+ * (HELLO_WANT_CPU), a master which said HELLO_OK then sends its CPU
+ * identity as one packet, for the apprentice's trace cache.
+ */
+#define HELLO_MAGIC 0x52495356 /* "RISV" */
+
+#define HELLO_CAN_SEND 1
+#define HELLO_FINGERPRINT 2
+#define HELLO_KEEP_GOING 4
+#define HELLO_WANT_CPU 8
+
+struct hello {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t size_hi, size_lo;
+    uint8_t hash[HASH_LEN];
+    uint32_t file_size_hi, file_size_lo;
+    uint8_t file_hash[HASH_LEN];
+    char image[HELLO_IMAGE_LEN];
+};
+
+int send_hello(int sock, struct session_info *si)
+{
+    struct hello hello;
+
+    memset(&hello, 0, sizeof(hello));
+    hello.magic = htonl(HELLO_MAGIC);
+    hello.flags = htonl((si->can_send ? HELLO_CAN_SEND : 0)
+                        | (si->fingerprint ? HELLO_FINGERPRINT : 0)
+                        | (si->keep_going ? HELLO_KEEP_GOING : 0)
+                        | (si->want_cpu ? HELLO_WANT_CPU : 0));
+    hello.size_hi = htonl(si->size >> 32);
+    hello.size_lo = htonl(si->size);
+    memcpy(hello.hash, si->hash, HASH_LEN);
+    hello.file_size_hi = htonl(si->file_size >> 32);
+    hello.file_size_lo = htonl(si->file_size);
+    memcpy(hello.file_hash, si->file_hash, HASH_LEN);
+    snprintf(hello.image, sizeof(hello.image), "%s", si->image);
+    return send_data_pkt(sock, &hello, sizeof(hello));
+}
+
+int recv_hello(int sock, struct session_info *si)
+{
+    struct hello hello;
+
+    if (recv_data_pkt(sock, &hello, sizeof(hello)) != 0
+        || ntohl(hello.magic) != HELLO_MAGIC) {
+        return 1;
+    }
+    si->can_send = (ntohl(hello.flags) & HELLO_CAN_SEND) != 0;
+    si->fingerprint = (ntohl(hello.flags) & HELLO_FINGERPRINT) != 0;
+    si->keep_going = (ntohl(hello.flags) & HELLO_KEEP_GOING) != 0;
+    si->want_cpu = (ntohl(hello.flags) & HELLO_WANT_CPU) != 0;
+    si->size = ((uint64_t)ntohl(hello.size_hi) << 32) | ntohl(hello.size_lo);
+    memcpy(si->hash, hello.hash, HASH_LEN);
+    si->file_size = ((uint64_t)ntohl(hello.file_size_hi) << 32)
+                    | ntohl(hello.file_size_lo);
+    memcpy(si->file_hash, hello.file_hash, HASH_LEN);
+    memcpy(si->image, hello.image, HELLO_IMAGE_LEN);
+    si->image[HELLO_IMAGE_LEN - 1] = 0;
+    return 0;
+}
+
 /* Utility functions which are just wrappers around read and writev
- * to catch errors and retry on short reads/writes.
+ * to catch errors and retry on short reads/writes. They return -1
+ * if the connection fails, so only that session has to end.
  */
-static void recv_bytes(int sock, void *pkt, int pktlen)
+static int recv_bytes(int sock, void *pkt, int pktlen)
 {
     char *p = pkt;
     while (pktlen) {
-        int i = read(sock, p, pktlen);
+        int i = recv(sock, p, pktlen, sock_flags());
+        if (i < 0 && sock_retry(sock, POLLIN)) {
+            continue;
+        }
         if (i <= 0) {
-            if (errno == EINTR) {
-                continue;
+            if (i < 0 && !watchdog_timed_out()) {
+                perror("read failed");
             }
-            perror("read failed");
-            exit(1);
+            return -1;
         }
         pktlen -= i;
         p += i;
     }
+    return 0;
 }
 
-static void recv_and_discard_bytes(int sock, int pktlen)
+static int recv_and_discard_bytes(int sock, int pktlen)
 {
     /* Read and discard bytes */
     char dumpbuf[64];
@@ -120,27 +268,39 @@ static void recv_and_discard_bytes(int sock, int pktlen)
         if (len > pktlen) {
             len = pktlen;
         }
-        i = read(sock, dumpbuf, len);
+        i = recv(sock, dumpbuf, len, sock_flags());
+        if (i < 0 && sock_retry(sock, POLLIN)) {
+            continue;
+        }
         if (i <= 0) {
-            if (errno == EINTR) {
-                continue;
+            if (i < 0 && !watchdog_timed_out()) {
+                perror("read failed");
             }
-            perror("read failed");
-            exit(1);
+            return -1;
         }
         pktlen -= i;
     }
+    return 0;
 }
 
 ssize_t safe_writev(int fd, struct iovec *iov_in, int iovcnt)
 {
-    /* writev, retrying for EINTR and short writes */
+    /* writev (as sendmsg, for sock_flags()), retrying for EINTR and
+     * short writes
+     */
     int r = 0;
     struct iovec *iov = iov_in;
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
     for (;;) {
-        ssize_t i = writev(fd, iov, iovcnt);
+        ssize_t i;
+
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        i = sendmsg(fd, &msg, sock_flags());
         if (i == -1) {
-            if (errno == EINTR) {
+            if (sock_retry(fd, POLLOUT)) {
                 continue;
             }
             return -1;
@@ -165,10 +325,12 @@ ssize_t safe_writev(int fd, struct iovec *iov_in, int iovcnt)
  * recv_data_pkt receives a block of data.
  * send_response_byte sends the response code.
  * Note that both ends must agree on the length of the
- * block of data.
+ * block of data. All of them return -1 if the connection fails.
  */
 int send_data_pkt(int sock, void *pkt, int pktlen)
 {
+    struct session_stats *stats = session_stats;
+    uint64_t start = stats ? stats_now() : 0;
     unsigned char resp;
     /* First we send the packet length as a network-order 32 bit value.
      * This avoids silent deadlocks if the two sides disagree over
@@ -184,13 +346,19 @@ int send_data_pkt(int sock, void *pkt, int pktlen)
     iov[1].iov_len = pktlen;
 
     if (safe_writev(sock, iov, 2) == -1) {
-        perror("writev failed");
-        exit(1);
+        if (!watchdog_timed_out()) {
+            perror("writev failed");
+        }
+        return -1;
     }
 
-    if (read(sock, &resp, 1) != 1) {
-        perror("read failed");
-        exit(1);
+    if (recv_bytes(sock, &resp, 1) != 0) {
+        return -1;
+    }
+    if (stats) {
+        stats_add(&stats->bytes_sent, sizeof(net_pktlen) + pktlen);
+        stats_add(&stats->bytes_received, 1);
+        stats_add(&stats->send_wait_ns, stats_now() - start);
     }
     return resp;
 }
@@ -198,24 +366,42 @@ int send_data_pkt(int sock, void *pkt, int pktlen)
 int recv_data_pkt(int sock, void *pkt, int pktlen)
 {
     uint32_t net_pktlen;
-    recv_bytes(sock, &net_pktlen, sizeof(net_pktlen));
+    if (recv_bytes(sock, &net_pktlen, sizeof(net_pktlen)) != 0) {
+        return -1;
+    }
     net_pktlen = ntohl(net_pktlen);
     if (pktlen != net_pktlen) {
         /* Mismatch. Read the data anyway so we can send
          * a response back.
          */
-        recv_and_discard_bytes(sock, net_pktlen);
-        return 1;
+        return recv_and_discard_bytes(sock, net_pktlen) ? -1 : 1;
+    }
+    if (recv_bytes(sock, pkt, pktlen) != 0) {
+        return -1;
+    }
+    if (session_stats) {
+        stats_add(&session_stats->bytes_received,
+                  sizeof(net_pktlen) + pktlen);
     }
-    recv_bytes(sock, pkt, pktlen);
     return 0;
 }
 
-void send_response_byte(int sock, int resp)
+int send_response_byte(int sock, int resp)
 {
     unsigned char r = resp;
-    if (write(sock, &r, 1) != 1) {
-        perror("write failed");
-        exit(1);
+    ssize_t i;
+
+    do {
+        i = send(sock, &r, 1, sock_flags());
+    } while (i < 0 && sock_retry(sock, POLLOUT));
+    if (i != 1) {
+        if (!watchdog_timed_out()) {
+            perror("write failed");
+        }
+        return -1;
     }
+    if (session_stats) {
+        stats_add(&session_stats->bytes_sent, 1);
+    }
+    return 0;
 }
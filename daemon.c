@@ -0,0 +1,149 @@
+/*******************************************************************************
+ * Copyright (c) 2017 Linaro Limited
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ ******************************************************************************/
+
+/* Daemon mode for the master: keep listening, and fork a worker for
+ * each apprentice that connects, so one master process can serve many
+ * sessions (and many images) in parallel.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+
+#include "risu.h"
+
+static void watch_fd(int epfd, int op, int fd, uint32_t events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, op, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+/* Reap finished workers, returning how many there were */
+static int reap_sessions(void)
+{
+    int status, n = 0;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            fprintf(stderr, "master: session %d: match\n", pid);
+        } else if (WIFEXITED(status)
+                   && WEXITSTATUS(status) == EXIT_TIMEOUT) {
+            fprintf(stderr, "master: session %d: timed out\n", pid);
+        } else if (WIFEXITED(status)) {
+            fprintf(stderr, "master: session %d: mismatch or error "
+                    "(exit status %d)\n", pid, WEXITSTATUS(status));
+        } else {
+            fprintf(stderr, "master: session %d: killed by signal %d\n",
+                    pid, WTERMSIG(status));
+        }
+        n++;
+    }
+    return n;
+}
+
+int master_daemon(int port, int max_sessions)
+{
+    sigset_t chld, oldmask;
+    int lsock, sfd, epfd;
+    int sessions = 0;
+
+    /* SIGCHLD is delivered through the signalfd, not a handler */
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &chld, &oldmask) < 0) {
+        perror("sigprocmask");
+        exit(1);
+    }
+    sfd = signalfd(-1, &chld, SFD_CLOEXEC);
+    if (sfd < 0) {
+        perror("signalfd");
+        exit(1);
+    }
+
+    lsock = master_listen(port, max_sessions * 2);
+    if (lsock < 0) {
+        exit(1);
+    }
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    watch_fd(epfd, EPOLL_CTL_ADD, lsock, EPOLLIN);
+    watch_fd(epfd, EPOLL_CTL_ADD, sfd, EPOLLIN);
+
+    fprintf(stderr, "master: daemon waiting for connections on port %d "
+            "(at most %d sessions)...\n", port, max_sessions);
+
+    for (;;) {
+        struct epoll_event events[2];
+        int i, n = epoll_wait(epfd, events, 2, -1);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        for (i = 0; i < n; i++) {
+            if (events[i].data.fd == sfd) {
+                struct signalfd_siginfo si;
+                int was_full = sessions >= max_sessions;
+
+                while (read(sfd, &si, sizeof(si)) < 0 && errno == EINTR) {
+                    continue;
+                }
+                sessions -= reap_sessions();
+                if (was_full && sessions < max_sessions) {
+                    watch_fd(epfd, EPOLL_CTL_MOD, lsock, EPOLLIN);
+                }
+            } else {
+                int sock = master_accept(lsock);
+                pid_t pid;
+
+                if (sock < 0) {
+                    continue;
+                }
+                pid = fork();
+                if (pid < 0) {
+                    perror("fork");
+                    close(sock);
+                    continue;
+                }
+                if (pid == 0) {
+                    close(epfd);
+                    close(sfd);
+                    close(lsock);
+                    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+                    exit(master_session(sock));
+                }
+                close(sock);
+                /* At the limit, leave new connections in the listen
+                 * backlog until a worker finishes.
+                 */
+                if (++sessions >= max_sessions) {
+                    watch_fd(epfd, EPOLL_CTL_MOD, lsock, 0);
+                }
+            }
+        }
+    }
+}
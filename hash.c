@@ -0,0 +1,103 @@
+/*******************************************************************************
+ * Copyright (c) 2017 Linaro Limited
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ ******************************************************************************/
+
+/* 128 bit content hash for test images: MurmurHash3 x64_128
+ * (originally by Austin Appleby, placed in the public domain).
+ * This isn't cryptographic; it just has to tell images apart.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "risu_trace.h"
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/* Load a little-endian 64 bit value, whatever the host */
+static inline uint64_t load64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+void hash_buffer(const void *data, size_t len, uint8_t hash[HASH_LEN])
+{
+    const uint8_t *p = data;
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = 0, h2 = 0, k1, k2;
+    size_t i, nblocks = len / 16;
+    const uint8_t *tail;
+    int j;
+
+    for (i = 0; i < nblocks; i++) {
+        k1 = load64(p + i * 16);
+        k2 = load64(p + i * 16 + 8);
+
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    tail = p + nblocks * 16;
+    k1 = k2 = 0;
+    for (j = (len & 15) - 1; j >= 8; j--) {
+        k2 = (k2 << 8) | tail[j];
+    }
+    for (; j >= 0; j--) {
+        k1 = (k1 << 8) | tail[j];
+    }
+    if (len & 15) {
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= len;
+    h2 ^= len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+
+    for (j = 0; j < 8; j++) {
+        hash[j] = h1 >> (8 * j);
+        hash[j + 8] = h2 >> (8 * j);
+    }
+}
+
+void hash_to_str(const uint8_t hash[HASH_LEN],
+                 char buf[HASH_STR_LEN])
+{
+    int i;
+
+    for (i = 0; i < HASH_LEN; i++) {
+        sprintf(buf + i * 2, "%02x", hash[i]);
+    }
+}
@@ -0,0 +1,191 @@
+/*******************************************************************************
+ * Copyright (c) 2017 Linaro Limited
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ ******************************************************************************/
+
+/* Flight recorder (--history): a ring of the last few checkpoints of
+ * a session. The SIGILL handler only copies the state into the next
+ * slot; the ring is allocated up front, and only looked at again if
+ * there is a mismatch to report.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "risu.h"
+
+int history_len;
+
+struct history_entry {
+    uintptr_t pc;
+    int op;
+    int have_theirs;
+    struct reginfo ours, theirs;
+};
+
+static __thread struct history_entry *ring;
+static __thread size_t next, count;
+
+void history_start(void)
+{
+    if (!ring && history_len > 0) {
+        ring = calloc(history_len, sizeof(*ring));
+    }
+    next = count = 0;
+}
+
+void history_stop(void)
+{
+    free(ring);
+    ring = NULL;
+}
+
+void history_add(int op, struct reginfo *ri)
+{
+    struct history_entry *e;
+
+    if (!ring) {
+        return;
+    }
+    e = &ring[next];
+    e->pc = get_pc(ri);
+    e->op = op;
+    e->have_theirs = 0;
+    e->ours = *ri;
+    next = (next + 1) % history_len;
+    count++;
+}
+
+void history_theirs(struct reginfo *ri)
+{
+    struct history_entry *e;
+
+    if (!ring || !count) {
+        return;
+    }
+    e = &ring[(next + history_len - 1) % history_len];
+    e->theirs = *ri;
+    e->have_theirs = 1;
+}
+
+static const char *op_name(int op)
+{
+    switch (op) {
+    case OP_COMPARE:
+        return "compare";
+    case OP_TESTEND:
+        return "testend";
+    case OP_SETMEMBLOCK:
+        return "setmemblock";
+    case OP_GETMEMBLOCK:
+        return "getmemblock";
+    case OP_COMPAREMEM:
+        return "comparemem";
+    case OP_BENCHSTART:
+        return "benchstart";
+    case OP_BENCHLOOP:
+        return "benchloop";
+    case OP_LOADSTATE:
+        return "loadstate";
+    default:
+        return "undef";
+    }
+}
+
+static void print_value(const uint8_t *p, size_t size)
+{
+    uint64_t v = 0;
+    int i;
+
+    switch (size) {
+    case 1:
+        v = *p;
+        break;
+    case 2:
+        v = *(const uint16_t *)p;
+        break;
+    case 4:
+        v = *(const uint32_t *)p;
+        break;
+    case 8:
+        v = *(const uint64_t *)p;
+        break;
+    default:
+        /* as one big number, in the host's byte order */
+        for (i = 0; i < size; i++) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            fprintf(stderr, "%02x", p[i]);
+#else
+            fprintf(stderr, "%02x", p[size - 1 - i]);
+#endif
+        }
+        return;
+    }
+    fprintf(stderr, "%0*" PRIx64, (int)size * 2, v);
+}
+
+/* Print each register which differs between a and b */
+static void print_changes(struct reginfo *a, struct reginfo *b)
+{
+    const struct reginfo_field *f;
+    int i;
+
+    for (f = reginfo_fields; f->name; f++) {
+        for (i = 0; i < f->count; i++) {
+            size_t off = f->offset + i * f->size;
+            const uint8_t *pa = (const uint8_t *)a + off;
+            const uint8_t *pb = (const uint8_t *)b + off;
+            char name[32];
+
+            if (memcmp(pa, pb, f->size) == 0) {
+                continue;
+            }
+            if (f->count > 1) {
+                snprintf(name, sizeof(name), "%s%d", f->name, i);
+            } else {
+                snprintf(name, sizeof(name), "%s", f->name);
+            }
+            fprintf(stderr, "  %-6s: ", name);
+            print_value(pa, f->size);
+            fprintf(stderr, " -> ");
+            print_value(pb, f->size);
+            fprintf(stderr, "\n");
+        }
+    }
+}
+
+void history_report(const char *ours, const char *theirs)
+{
+    size_t n = count < history_len ? count : history_len;
+    size_t i;
+
+    if (!ring || !n) {
+        return;
+    }
+    fprintf(stderr, "last %zd checkpoints (%s), oldest first:\n", n, ours);
+    for (i = 0; i < n; i++) {
+        struct history_entry *e = &ring[(next + history_len - n + i)
+                                        % history_len];
+
+        fprintf(stderr, "[%ld] image offset 0x%" PRIxPTR " (%s)",
+                (long)(i + 1) - (long)n, e->pc, op_name(e->op));
+        if (i == 0) {
+            fprintf(stderr, ":\n");
+            reginfo_dump(&e->ours, stderr);
+        } else {
+            fprintf(stderr, ", changed:\n");
+            print_changes(&ring[(next + history_len - n + i - 1)
+                                % history_len].ours, &e->ours);
+        }
+        /* the last is the mismatch, which is reported in full */
+        if (e->have_theirs && i != n - 1
+            && !reginfo_is_eq(&e->ours, &e->theirs)) {
+            fprintf(stderr, "  %s differed:\n", theirs);
+            print_changes(&e->ours, &e->theirs);
+        }
+    }
+}
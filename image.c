@@ -0,0 +1,228 @@
+/*******************************************************************************
+ * Copyright (c) 2017 Linaro Limited
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ ******************************************************************************/
+
+/* Loading test images: plain binaries, or containers which also say
+ * how the image was made and which pattern each test instruction came
+ * from (see struct image_header).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "risu.h"
+
+static void *read_section(int fd, uint64_t offset, uint64_t size,
+                          uint64_t file_size)
+{
+    char *buf;
+
+    if (offset > file_size || size > file_size - offset) {
+        return NULL;
+    }
+    /* one spare byte, so text sections are always terminated */
+    buf = calloc(1, size + 1);
+    if (buf && pread(fd, buf, size, offset) != size) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+static void free_meta(struct image_meta *meta)
+{
+    if (meta->names) {
+        free(meta->names[0]);
+    }
+    free(meta->names);
+    free(meta->units);
+    free(meta->info);
+    free(meta->slots);
+    memset(meta, 0, sizeof(*meta));
+}
+
+int image_read_meta(int fd, struct image_meta *meta)
+{
+    struct image_header *h = &meta->h;
+    struct stat st;
+    char *names, *p;
+    uint32_t i;
+
+    memset(meta, 0, sizeof(*meta));
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    if (pread(fd, h, sizeof(*h), 0) != sizeof(*h)
+        || memcmp(h->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0) {
+        memset(h, 0, sizeof(*h));
+        return 1;
+    }
+    if (h->version != IMAGE_VERSION
+        || h->code_offset % IMAGE_ALIGN
+        || h->code_offset > st.st_size
+        || h->code_size > st.st_size - h->code_offset) {
+        goto bad;
+    }
+    h->arch[sizeof(h->arch) - 1] = 0;
+
+    meta->units = read_section(fd, h->units_offset,
+                               (uint64_t) h->nunits * sizeof(*meta->units),
+                               st.st_size);
+    names = read_section(fd, h->names_offset, h->names_size, st.st_size);
+    meta->names = calloc(h->npatterns + 1, sizeof(char *));
+    meta->info = read_section(fd, h->info_offset, h->info_size, st.st_size);
+    if (!meta->names) {
+        free(names);
+        goto bad;
+    }
+    /* the names all point into one block, which names[0] owns */
+    meta->names[0] = names;
+    if (!meta->units || !names || !meta->info) {
+        goto bad;
+    }
+    for (i = 0, p = names; i < h->npatterns; i++) {
+        if (p >= names + h->names_size) {
+            goto bad;
+        }
+        meta->names[i] = p;
+        p += strlen(p) + 1;
+    }
+    for (i = 0; i < h->nunits; i++) {
+        if (meta->units[i].pattern >= h->npatterns) {
+            goto bad;
+        }
+    }
+    return 0;
+
+ bad:
+    free_meta(meta);
+    return -1;
+}
+
+/* Read the slot table at the end of the code, if there is one */
+static void read_slots(const uint8_t *code, size_t size,
+                       struct image_meta *meta)
+{
+    size_t table;
+    uint32_t n, i;
+
+    if (size < 12 || memcmp(code + size - 8, "RISUSLOT", 8) != 0) {
+        return;
+    }
+    memcpy(&n, code + size - 12, sizeof(n));
+    if (n > (size - 12) / sizeof(n)) {
+        return;
+    }
+    table = size - 12 - n * sizeof(n);
+    meta->slots = malloc(n * sizeof(n));
+    for (i = 0; i < n; i++) {
+        memcpy(&meta->slots[i], code + table + i * sizeof(n), sizeof(n));
+        if (meta->slots[i] >= table
+            || (i && meta->slots[i] <= meta->slots[i - 1])) {
+            /* not a table risugen wrote, so no slots */
+            free(meta->slots);
+            meta->slots = NULL;
+            return;
+        }
+    }
+    meta->nslots = n;
+}
+
+void *image_map(int fd, int prot, size_t *size, struct image_meta *meta)
+{
+    struct image_meta m;
+    struct stat st;
+    off_t offset = 0;
+    void *addr;
+
+    switch (image_read_meta(fd, &m)) {
+    case 0:
+        offset = m.h.code_offset;
+        *size = m.h.code_size;
+        break;
+    case 1:
+        if (fstat(fd, &st) != 0) {
+            return MAP_FAILED;
+        }
+        *size = st.st_size;
+        break;
+    default:
+        return MAP_FAILED;
+    }
+
+    /* the code is page aligned in the file, so no copy needed */
+    addr = mmap(0, *size, prot, MAP_PRIVATE, fd, offset);
+    if (addr == MAP_FAILED || !meta) {
+        free_meta(&m);
+    } else {
+        read_slots(addr, *size, &m);
+        *meta = m;
+    }
+    return addr;
+}
+
+size_t image_slots_between(const struct image_meta *meta, uintptr_t start,
+                           uintptr_t end, const uint32_t **first)
+{
+    size_t lo = 0, hi = meta->nslots, i;
+
+    /* the first slot at or after start */
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+
+        if (meta->slots[mid] < start) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (i = lo; i < meta->nslots && meta->slots[i] < end; i++) {
+        continue;
+    }
+    *first = meta->slots + lo;
+    return i - lo;
+}
+
+const char *image_pattern_at(const struct image_meta *meta, uintptr_t pc)
+{
+    size_t lo = 0, hi = meta->h.nunits;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        const struct image_unit *u = &meta->units[mid];
+
+        if (u->start + u->len < pc) {
+            lo = mid + 1;
+        } else if (u->start + u->len > pc) {
+            hi = mid;
+        } else {
+            return meta->names[u->pattern];
+        }
+    }
+    return NULL;
+}
+
+const char *image_pattern_after(const struct image_meta *meta, uintptr_t pc)
+{
+    size_t lo = 0, hi = meta->h.nunits;
+
+    /* the first unit starting after pc */
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+
+        if (meta->units[mid].start <= pc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < meta->h.nunits ? meta->names[meta->units[lo].pattern] : NULL;
+}
@@ -10,82 +10,480 @@
  *****************************************************************************/
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "risu.h"
 
-struct reginfo master_ri, apprentice_ri;
+__thread struct reginfo master_ri, apprentice_ri;
 
-uint8_t apprentice_memblock[MEMBLOCKLEN];
+__thread uint8_t apprentice_memblock[MEMBLOCKLEN];
 
-static int mem_used;
-static int packet_mismatch;
+/* The packed form of the reginfo we are sending or comparing, and of
+ * the one we received
+ */
+static __thread uint8_t packed[REGINFO_MAX_PACKED];
+static __thread uint8_t recv_packed[REGINFO_MAX_PACKED];
+
+static __thread int mem_used;
+static __thread int packet_mismatch;
+static __thread int op_mismatch;
+static __thread int fingerprint_mismatch;
+
+__thread int fingerprint_mode;
+
+/* Our fingerprint for the current checkpoint, the other side's, and
+ * the running hash chain for FINGERPRINT_CHAIN.
+ */
+static __thread uint8_t master_fp[HASH_LEN], apprentice_fp[HASH_LEN];
+static __thread uint8_t chain[HASH_LEN];
+
+/* recv_fingerprint() results */
+#define FP_MATCH 0
+#define FP_NEED_FULL 1
+#define FP_MISMATCH 2
+
+/* The last checkpoint which compared equal. If a sparse checkpoint
+ * (risugen --compare-every) fails we go back to it, so with a live
+ * peer and an image with slots we keep its state too.
+ */
+static __thread uintptr_t good_pc;
+static __thread struct reginfo good_ri;
+static __thread uint8_t good_memblock[MEMBLOCKLEN];
+static __thread int have_good_ri;
+
+/* The master has decided to re-run a sparse region (RESP_RERUN) */
+static __thread int rerun_pending;
+
+write_fn record_fn;
+int record_timestamps;
+
+int keep_going;
+
+/* The last checkpoint, for resync_after_mismatch(): its op, the
+ * length of its packed registers, and on the sending side our state.
+ */
+static __thread int last_op;
+static __thread size_t last_len;
+static __thread struct reginfo *sent_ri;
+
+/* The mismatches we carried on past (--keep-going), allocated at the
+ * first and grown as needed; the state at the first few is kept for
+ * the report (master's, then apprentice's).
+ */
+#define MAX_DIVERGENCE_DETAILS 16
+
+struct divergence {
+    uintptr_t pc;
+    int op;
+};
+static __thread struct divergence *divergences;
+static __thread struct reginfo (*divergence_ri)[2];
+static __thread size_t ndivergences, divergences_size;
+
+/* The timestamp for a checkpoint header. clock_gettime() is
+ * async-signal-safe, and under an emulator it is the host's clock,
+ * which is what we want to measure the emulator by.
+ */
+static uint64_t checkpoint_time(void)
+{
+    struct timespec ts;
+
+    if (!record_timestamps) {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void save_good_state(struct reginfo *ri)
+{
+    good_pc = get_pc(ri);
+    have_good_ri = 1;
+    if (!live_peer || !image_meta.nslots) {
+        return;
+    }
+    good_ri = *ri;
+    if (memblock) {
+        memcpy(good_memblock, memblock, MEMBLOCKLEN);
+    }
+}
+
+/* Write our own state at a checkpoint to the --record trace; the
+ * registers are already packed, len bytes of them.
+ */
+static void record_state(trace_header_t *header, size_t len)
+{
+    trace_header_t le = *header;
+
+    if (!record_fn) {
+        return;
+    }
+    trace_header_le(&le);
+    record_fn(&le, sizeof(le));
+    switch (header->risu_op) {
+    case OP_SETMEMBLOCK:
+    case OP_GETMEMBLOCK:
+        break;
+    case OP_COMPAREMEM:
+        record_fn(memblock, MEMBLOCKLEN);
+        break;
+    default:
+        record_fn(packed, len);
+        break;
+    }
+}
+
+/* Pack the registers into packed[] if this op sends them, returning
+ * the length
+ */
+static size_t pack_regs(int op, struct reginfo *ri)
+{
+    switch (op) {
+    case OP_SETMEMBLOCK:
+    case OP_GETMEMBLOCK:
+    case OP_COMPAREMEM:
+        return 0;
+    default:
+        return reginfo_pack(ri, packed);
+    }
+}
+
+/* The fingerprint of the state compared at a checkpoint. The
+ * registers are hashed in packed form, so this only costs as much as
+ * the state that is actually there.
+ */
+static void state_fingerprint(int op, struct reginfo *ri,
+                              uint8_t fp[HASH_LEN])
+{
+    static __thread struct reginfo canon;
+    static __thread uint8_t canon_packed[REGINFO_MAX_PACKED];
+
+    switch (op) {
+    case OP_SETMEMBLOCK:
+    case OP_GETMEMBLOCK:
+        memset(fp, 0, HASH_LEN);
+        break;
+    case OP_COMPAREMEM:
+        hash_buffer(memblock, MEMBLOCKLEN, fp);
+        break;
+    default:
+        canon = *ri;
+        reginfo_canonicalise(&canon);
+        hash_buffer(canon_packed, reginfo_pack(&canon, canon_packed), fp);
+        break;
+    }
+}
+
+/* Fold a checkpoint into the hash chain */
+static void chain_add(trace_header_t *header, const uint8_t fp[HASH_LEN])
+{
+    struct {
+        uint8_t chain[HASH_LEN];
+        uint8_t fp[HASH_LEN];
+        uint64_t pc;
+        uint32_t op;
+        uint32_t pad;
+    } link;
+
+    memset(&link, 0, sizeof(link));
+    memcpy(link.chain, chain, HASH_LEN);
+    memcpy(link.fp, fp, HASH_LEN);
+    link.pc = htole64(header->pc);
+    link.op = htole32(header->risu_op);
+    hash_buffer(&link, sizeof(link), chain);
+}
+
+/* The ops which don't compare anything, just tell us about memory */
+static void memblock_op(int op, struct reginfo *ri, void *uc)
+{
+    if (op == OP_SETMEMBLOCK) {
+        memblock = (void *)(uintptr_t)get_reginfo_paramreg(ri);
+    } else {
+        set_ucontext_paramreg(uc,
+                              get_reginfo_paramreg(ri) + (uintptr_t)memblock);
+    }
+}
+
+/* OP_LOADSTATE: install the register values in a table risugen put
+ * in the image, rather than have the image load them one at a time.
+ * The table is a series of entries, each a struct loadstate_entry
+ * naming an element of reginfo_fields[], then the values of count
+ * elements from first, padded to 4 bytes; it ends with a zero byte.
+ * Everything is in the target's byte order, and all of it has to be
+ * inside the image.
+ */
+struct loadstate_entry {
+    char name[8];
+    uint8_t first, count;
+    uint16_t size;          /* of an element, as a check */
+};
+
+static int loadstate_op(struct reginfo *ri, void *uc)
+{
+    static __thread struct reginfo new_ri;
+    uintptr_t p = get_reginfo_paramreg(ri);
+    uintptr_t end = image_start_address + image_size;
+    const struct reginfo_field *f;
+    struct loadstate_entry e;
+    size_t len;
+
+    new_ri = *ri;
+    for (;;) {
+        if (p < image_start_address || p >= end) {
+            fprintf(stderr, "register table for OP_LOADSTATE at image "
+                    "offset 0x%" PRIxPTR " runs outside the image\n",
+                    get_pc(ri));
+            return BAD_IMAGE;
+        }
+        if (*(const uint8_t *)p == 0) {
+            break;
+        }
+        if (end - p < sizeof(e)) {
+            fprintf(stderr, "register table for OP_LOADSTATE at image "
+                    "offset 0x%" PRIxPTR " runs outside the image\n",
+                    get_pc(ri));
+            return BAD_IMAGE;
+        }
+        memcpy(&e, (const void *)p, sizeof(e));
+        p += sizeof(e);
+        for (f = reginfo_fields; f->name; f++) {
+            if (strncmp(f->name, e.name, sizeof(e.name)) == 0) {
+                break;
+            }
+        }
+        len = e.count * e.size;
+        if (!f->name || f->size != e.size || e.first + e.count > f->count
+            || end - p < len) {
+            fprintf(stderr, "bad register table for OP_LOADSTATE at image "
+                    "offset 0x%" PRIxPTR " (%.8s)\n", get_pc(ri), e.name);
+            return BAD_IMAGE;
+        }
+        memcpy((uint8_t *)&new_ri + f->offset + e.first * f->size,
+               (const void *)p, len);
+        p += (len + 3) & ~3;
+    }
+    set_ucontext_reginfo(uc, &new_ri);
+    return 0;
+}
+
+/* Send the state for a checkpoint. In fingerprint mode we send just
+ * the fingerprint, and then the full state if the master asks.
+ */
+static int send_state(write_fn write_fn, void *state, size_t len,
+                      uint8_t fp[HASH_LEN])
+{
+    int resp;
+
+    if (!fingerprint_mode) {
+        resp = write_fn(state, len);
+    } else {
+        resp = write_fn(fp, HASH_LEN);
+        if (resp == RESP_SEND_FULL) {
+            resp = write_fn(state, len);
+        }
+    }
+    if (resp == RESP_RERUN) {
+        /* a mismatch, but see rerun_sparse_region() */
+        rerun_pending = 1;
+        resp = 2;
+    }
+    return resp;
+}
 
 int send_register_info(write_fn write_fn, void *uc)
 {
-    struct reginfo ri;
+    static __thread struct reginfo ri;
     trace_header_t header;
-    int op;
+    uint8_t fp[HASH_LEN];
+    int op, resp = 0;
+    size_t len;
+    uint64_t now = checkpoint_time();
 
     reginfo_init(&ri, uc);
     op = get_risuop(&ri);
+    if (op == OP_BENCHSTART || op == OP_BENCHLOOP) {
+        /* nothing to send: both sides run the block the same way */
+        watchdog_kick(get_pc(&ri));
+        bench_op(op, &ri, uc);
+        return 0;
+    }
+    if (op == OP_LOADSTATE) {
+        /* likewise both sides load the same table */
+        watchdog_kick(get_pc(&ri));
+        return loadstate_op(&ri, uc);
+    }
+    len = pack_regs(op, &ri);
+    last_op = op;
+    last_len = len;
+    sent_ri = &ri;
 
     /* Write a header with PC/op to keep in sync */
+    memset(&header, 0, sizeof(header));
     header.pc = get_pc(&ri);
     header.risu_op = op;
-    if (write_fn(&header, sizeof(header)) != 0) {
+    header.timestamp = now;
+    record_state(&header, len);
+    stats_checkpoint(header.pc);
+    watchdog_kick(header.pc);
+    history_add(op, &ri);
+
+    if (fingerprint_mode) {
+        state_fingerprint(op, &ri, fp);
+    }
+    if (fingerprint_mode == FINGERPRINT_CHAIN) {
+        /* only the end of the chain is sent */
+        chain_add(&header, fp);
+        if (op != OP_TESTEND) {
+            if (op == OP_SETMEMBLOCK || op == OP_GETMEMBLOCK) {
+                memblock_op(op, &ri, uc);
+            }
+            return 0;
+        }
+        memcpy(fp, chain, HASH_LEN);
+    }
+
+    /* written little-endian, like the rest of the stream */
+    trace_header_le(&header);
+    resp = write_fn(&header, sizeof(header));
+    trace_header_le(&header);
+    if (resp != 0) {
         return -1;
     }
 
     switch (op) {
     case OP_TESTEND:
-        write_fn(&ri, sizeof(ri));
         /* if we are tracing write_fn will return 0 unlike a remote
-           end, hence we force return of 1 here */
+           end, hence we force return of 1 here unless the remote
+           end told us about a mismatch */
+        if (send_state(write_fn, packed, len, fp) == 2) {
+            return 2;
+        }
         return 1;
     case OP_SETMEMBLOCK:
-        memblock = (void *)(uintptr_t)get_reginfo_paramreg(&ri);
-        break;
     case OP_GETMEMBLOCK:
-        set_ucontext_paramreg(uc,
-                              get_reginfo_paramreg(&ri) + (uintptr_t)memblock);
+        memblock_op(op, &ri, uc);
         break;
     case OP_COMPAREMEM:
-        return write_fn(memblock, MEMBLOCKLEN);
+        resp = send_state(write_fn, memblock, MEMBLOCKLEN, fp);
         break;
     case OP_COMPARE:
     default:
         /* Do a simple register compare on (a) explicit request
          * (b) end of test (c) a non-risuop UNDEF
          */
-        return write_fn(&ri, sizeof(ri));
+        resp = send_state(write_fn, packed, len, fp);
+        break;
     }
-    return 0;
+    if (resp == 0 && (op == OP_COMPARE || op == OP_COMPAREMEM)) {
+        save_good_state(&ri);
+    }
+    return resp;
+}
+
+/* In fingerprint mode, read the apprentice's fingerprint and check it
+ * against ours. If they differ a live apprentice is asked for the full
+ * state, which the caller then reads as usual; from a trace there is
+ * nothing more to be had.
+ */
+static int recv_fingerprint(read_fn read_fn, respond_fn resp_fn)
+{
+    if (read_fn(apprentice_fp, HASH_LEN)) {
+        packet_mismatch = 1;
+        return FP_MISMATCH;
+    }
+    if (memcmp(master_fp, apprentice_fp, HASH_LEN) == 0) {
+        return FP_MATCH;
+    }
+    if (!live_peer) {
+        fingerprint_mismatch = 1;
+        return FP_MISMATCH;
+    }
+    resp_fn(RESP_SEND_FULL);
+    return FP_NEED_FULL;
+}
+
+/* The response to a live apprentice for a mismatch at this checkpoint:
+ * RESP_RERUN if there are checkpoint slots to fill in since the last
+ * good one, for rerun_sparse_region() on both sides. The slot at the
+ * good checkpoint itself has been filled already.
+ */
+static int mismatch_resp(void)
+{
+    const uint32_t *slot;
+
+    if (!live_peer || !have_good_ri || op_mismatch || packet_mismatch
+        || !image_slots_between(&image_meta, good_pc + 1,
+                                get_pc(&master_ri), &slot)) {
+        return 2;
+    }
+    rerun_pending = 1;
+    return RESP_RERUN;
 }
 
 /* Read register info from the socket and compare it with that from the
  * ucontext. Return 0 for match, 1 for end-of-test, 2 for mismatch.
  * NB: called from a signal handler.
  *
- * We don't have any kind of identifying info in the incoming data
- * that says whether it is register or memory data, so if the two
- * sides get out of sync then we will fail obscurely.
+ * A memory block has no identifying info, so if the two sides get
+ * out of sync on one we will fail obscurely; register records at
+ * least have to unpack cleanly.
  */
 int recv_and_compare_register_info(read_fn read_fn,
                                    respond_fn resp_fn, void *uc)
 {
-    int resp = 0, op;
+    int resp = 0, op, fp = FP_NEED_FULL;
     trace_header_t header;
+    size_t len;
+    uint64_t now = checkpoint_time();
 
     reginfo_init(&master_ri, uc);
     op = get_risuop(&master_ri);
+    if (op == OP_BENCHSTART || op == OP_BENCHLOOP) {
+        watchdog_kick(get_pc(&master_ri));
+        bench_op(op, &master_ri, uc);
+        return 0;
+    }
+    if (op == OP_LOADSTATE) {
+        watchdog_kick(get_pc(&master_ri));
+        return loadstate_op(&master_ri, uc);
+    }
+    len = pack_regs(op, &master_ri);
+    last_op = op;
+    last_len = len;
+
+    memset(&header, 0, sizeof(header));
+    header.pc = get_pc(&master_ri);
+    header.risu_op = op;
+    header.timestamp = now;
+    record_state(&header, len);
+    stats_checkpoint(header.pc);
+    watchdog_kick(header.pc);
+    history_add(op, &master_ri);
+
+    if (fingerprint_mode) {
+        state_fingerprint(op, &master_ri, master_fp);
+    }
+    if (fingerprint_mode == FINGERPRINT_CHAIN) {
+        chain_add(&header, master_fp);
+        if (op != OP_TESTEND) {
+            if (op == OP_SETMEMBLOCK || op == OP_GETMEMBLOCK) {
+                memblock_op(op, &master_ri, uc);
+            }
+            return 0;
+        }
+        memcpy(master_fp, chain, HASH_LEN);
+    }
 
     if (read_fn(&header, sizeof(header)) != 0) {
         return -1;
     }
+    trace_header_le(&header);
 
     if (header.risu_op != op) {
         /* We are out of sync */
+        op_mismatch = 1;
         resp = 2;
         resp_fn(resp);
         return resp;
@@ -101,40 +499,289 @@ int recv_and_compare_register_info(read_fn read_fn,
         /* Do a simple register compare on (a) explicit request
          * (b) end of test (c) a non-risuop UNDEF
          */
-        if (read_fn(&apprentice_ri, sizeof(apprentice_ri))) {
-            packet_mismatch = 1;
+        if (fingerprint_mode) {
+            fp = recv_fingerprint(read_fn, resp_fn);
+        }
+        if (fp == FP_MISMATCH) {
             resp = 2;
-        } else if (!reginfo_is_eq(&master_ri, &apprentice_ri)) {
-            /* register mismatch */
+        } else if (fp == FP_MATCH) {
+            if (op == OP_TESTEND) {
+                /* for report_match_status() */
+                apprentice_ri = master_ri;
+                resp = 1;
+            }
+        } else if (read_fn(recv_packed, len)
+                   || reginfo_unpack(&apprentice_ri, recv_packed, len)) {
+            /* A different length or layout: the other side has
+             * different registers (eg a different SVE vector length)
+             * or we are out of sync.
+             */
+            packet_mismatch = 1;
             resp = 2;
-        } else if (op == OP_TESTEND) {
-            resp = 1;
+        } else {
+            history_theirs(&apprentice_ri);
+            if (!reginfo_is_eq(&master_ri, &apprentice_ri)) {
+                /* register mismatch */
+                resp = 2;
+            } else if (op == OP_TESTEND) {
+                resp = 1;
+            }
         }
-        resp_fn(resp);
+        resp_fn(resp == 2 ? mismatch_resp() : resp);
         break;
     case OP_SETMEMBLOCK:
-        memblock = (void *)(uintptr_t)get_reginfo_paramreg(&master_ri);
-        break;
     case OP_GETMEMBLOCK:
-        set_ucontext_paramreg(uc, get_reginfo_paramreg(&master_ri) +
-                              (uintptr_t)memblock);
+        memblock_op(op, &master_ri, uc);
         break;
     case OP_COMPAREMEM:
-        mem_used = 1;
-        if (read_fn(apprentice_memblock, MEMBLOCKLEN)) {
-            packet_mismatch = 1;
-            resp = 2;
-        } else if (memcmp(memblock, apprentice_memblock, MEMBLOCKLEN) != 0) {
-            /* memory mismatch */
+        if (fingerprint_mode) {
+            fp = recv_fingerprint(read_fn, resp_fn);
+        }
+        if (fp == FP_MISMATCH) {
             resp = 2;
+        } else if (fp == FP_NEED_FULL) {
+            mem_used = 1;
+            if (read_fn(apprentice_memblock, MEMBLOCKLEN)) {
+                packet_mismatch = 1;
+                resp = 2;
+            } else if (memcmp(memblock, apprentice_memblock,
+                              MEMBLOCKLEN) != 0) {
+                /* memory mismatch */
+                resp = 2;
+            }
         }
-        resp_fn(resp);
+        resp_fn(resp == 2 ? mismatch_resp() : resp);
         break;
     }
 
+    if (resp == 0 && (op == OP_COMPARE || op == OP_COMPAREMEM)) {
+        save_good_state(&master_ri);
+    }
     return resp;
 }
 
+/* Called on both sides after a checkpoint mismatch. If the master
+ * decided to re-run the region since the last good checkpoint (sending
+ * RESP_RERUN), turn the checkpoint slots in it into compares and
+ * rewind the ucontext (and memory block) to that checkpoint so the
+ * region is re-run at full density. Returns 1 if we rewound.
+ * NB: called from a signal handler.
+ *
+ * Once a region has been re-run it has no slots left, so a mismatch
+ * inside it is reported normally rather than looping.
+ */
+int rerun_sparse_region(void *uc)
+{
+    struct reginfo ri;
+    const uint32_t *slot;
+    uintptr_t pc;
+    size_t i, n;
+
+    if (!rerun_pending) {
+        return 0;
+    }
+    rerun_pending = 0;
+
+    reginfo_init(&ri, uc);
+    pc = get_pc(&ri);
+    n = image_slots_between(&image_meta, good_pc + 1, pc, &slot);
+    for (i = 0; i < n; i++) {
+        fill_checkpoint_slot(uc, image_start_address + slot[i]);
+    }
+    __builtin___clear_cache((char *) image_start_address + good_pc,
+                            (char *) image_start_address + pc);
+
+    set_ucontext_reginfo(uc, &good_ri);
+    if (memblock) {
+        memcpy(memblock, good_memblock, MEMBLOCKLEN);
+    }
+    /* and step over the good checkpoint itself */
+    advance_pc(uc);
+    return 1;
+}
+
+static void log_divergence(uintptr_t pc, struct reginfo *m,
+                           struct reginfo *a)
+{
+    size_t n = ndivergences++;
+
+    /* SIGILL only comes from the test code, and SIGALRM is blocked
+     * here (see set_sigill_handler()), so nothing can siglongjmp() out
+     * of malloc; we can allocate
+     */
+    if (!divergence_ri) {
+        divergence_ri = calloc(MAX_DIVERGENCE_DETAILS,
+                               sizeof(*divergence_ri));
+    }
+    if (n >= divergences_size) {
+        size_t size = divergences_size ? divergences_size * 2 : 256;
+        struct divergence *d = realloc(divergences, size * sizeof(*d));
+
+        if (d) {
+            divergences = d;
+            divergences_size = size;
+        }
+    }
+    if (n < divergences_size) {
+        divergences[n].pc = pc;
+        divergences[n].op = last_op;
+    }
+    if (n < MAX_DIVERGENCE_DETAILS && m && divergence_ri) {
+        divergence_ri[n][0] = *m;
+        divergence_ri[n][1] = *a;
+    }
+}
+
+int resync_after_mismatch(read_fn read_fn, write_fn write_fn, void *uc)
+{
+    static __thread struct reginfo ri;
+
+    if (!keep_going || last_op == OP_TESTEND) {
+        return 0;
+    }
+
+    if (read_fn) {
+        /* A live apprentice: the master sends us its state, or
+         * nothing if we can't carry on.
+         */
+        if (last_op == OP_COMPAREMEM) {
+            if (read_fn(memblock, MEMBLOCKLEN)) {
+                return 0;
+            }
+            log_divergence(get_pc(sent_ri), NULL, NULL);
+            save_good_state(sent_ri);
+        } else {
+            if (read_fn(recv_packed, last_len)
+                || reginfo_unpack(&ri, recv_packed, last_len)) {
+                return 0;
+            }
+            log_divergence(get_pc(sent_ri), &ri, sent_ri);
+            set_ucontext_reginfo(uc, &ri);
+            save_good_state(&ri);
+        }
+        return 1;
+    }
+
+    if (op_mismatch || packet_mismatch || fingerprint_mismatch) {
+        /* out of sync, or nothing to resync with */
+        if (write_fn) {
+            write_fn(NULL, 0);
+        }
+        return 0;
+    }
+
+    if (write_fn) {
+        /* A live master: we have the right state, so send it */
+        log_divergence(get_pc(&master_ri), &master_ri, &apprentice_ri);
+        if (last_op == OP_COMPAREMEM) {
+            write_fn(memblock, MEMBLOCKLEN);
+            memcpy(apprentice_memblock, memblock, MEMBLOCKLEN);
+        } else {
+            write_fn(packed, last_len);
+            apprentice_ri = master_ri;
+        }
+        save_good_state(&master_ri);
+    } else {
+        /* Replaying a trace, which has the right state */
+        log_divergence(get_pc(&master_ri), &apprentice_ri, &master_ri);
+        if (last_op == OP_COMPAREMEM) {
+            memcpy(memblock, apprentice_memblock, MEMBLOCKLEN);
+        } else {
+            set_ucontext_reginfo(uc, &apprentice_ri);
+            master_ri = apprentice_ri;
+        }
+        save_good_state(&master_ri);
+    }
+    return 1;
+}
+
+int reached_test_end(void)
+{
+    return last_op == OP_TESTEND;
+}
+
+int report_divergences(void)
+{
+    size_t i;
+
+    if (!ndivergences) {
+        return 0;
+    }
+    fprintf(stderr, "carried on past %zd mismatches:\n", ndivergences);
+    for (i = 0; i < ndivergences && i < divergences_size; i++) {
+        const char *pattern = image_pattern_at(&image_meta,
+                                               divergences[i].pc);
+
+        fprintf(stderr, "  image offset 0x%" PRIxPTR ": %s%s%s\n",
+                divergences[i].pc,
+                divergences[i].op == OP_COMPAREMEM ? "memory" : "registers",
+                pattern ? ", pattern " : "", pattern ? pattern : "");
+    }
+    if (i < ndivergences) {
+        fprintf(stderr, "  (and %zd more)\n", ndivergences - i);
+    }
+    for (i = 0; i < ndivergences && i < divergences_size
+             && i < MAX_DIVERGENCE_DETAILS && divergence_ri; i++) {
+        if (divergences[i].op == OP_COMPAREMEM) {
+            continue;
+        }
+        fprintf(stderr, "at image offset 0x%" PRIxPTR ":\n",
+                divergences[i].pc);
+        reginfo_dump_mismatch(&divergence_ri[i][0], &divergence_ri[i][1],
+                              stderr);
+    }
+    return ndivergences;
+}
+
+void forget_divergences(void)
+{
+    free(divergences);
+    free(divergence_ri);
+    divergences = NULL;
+    divergence_ri = NULL;
+    ndivergences = divergences_size = 0;
+}
+
+/* Say which pattern the failing test insn came from, if the image
+ * knows.
+ */
+static void report_mismatch_pc(uintptr_t pc)
+{
+    const char *pattern = image_pattern_at(&image_meta, pc);
+
+    /* risu-minimise looks for this line */
+    fprintf(stderr, "mismatch at image offset 0x%" PRIxPTR "\n", pc);
+    if (pattern) {
+        fprintf(stderr, "mismatch after test insn of pattern %s\n",
+                pattern);
+    }
+}
+
+/* The checkpoints which led up to a mismatch, with --history */
+static void report_history(int trace)
+{
+    history_report(trace ? "this" : "master",
+                   trace ? "trace" : "apprentice");
+}
+
+/* A mismatch after checkpoint slots which weren't re-run (replaying a
+ * trace, or in fingerprint chain mode) only gives the region: say so.
+ * The image start stands in for a good checkpoint, as the register
+ * setup before any slots always ends with a compare.
+ */
+static void report_sparse_region(uintptr_t pc)
+{
+    uintptr_t start = have_good_ri ? good_pc : 0;
+    const uint32_t *slot;
+
+    if (image_slots_between(&image_meta, start + 1, pc, &slot)) {
+        fprintf(stderr, "divergence somewhere in image offsets [0x%" PRIxPTR
+                ", 0x%" PRIxPTR "), which has checkpoint slots; re-run "
+                "with an image from risugen --compare-every 1 to find "
+                "the insn\n", start, pc);
+    }
+}
+
 /* Print a useful report on the status of the last comparison
  * done in recv_and_compare_register_info(). This is called on
  * exit, so need not restrict itself to signal-safe functions.
@@ -143,14 +790,42 @@ int recv_and_compare_register_info(read_fn read_fn,
  */
 int report_match_status(int trace)
 {
-    int resp = 0;
+    int resp = 0, diverged;
     fprintf(stderr, "match status...\n");
+    diverged = report_divergences();
+    if (fingerprint_mismatch) {
+        char ours[HASH_STR_LEN], theirs[HASH_STR_LEN];
+
+        hash_to_str(master_fp, ours);
+        hash_to_str(apprentice_fp, theirs);
+        if (fingerprint_mode == FINGERPRINT_CHAIN) {
+            fprintf(stderr, "mismatch on hash chain at end of test\n");
+        } else {
+            fprintf(stderr, "mismatch on %s fingerprint\n",
+                    get_risuop(&master_ri) == OP_COMPAREMEM
+                    ? "memory" : "register");
+        }
+        report_mismatch_pc(get_pc(&master_ri));
+        fprintf(stderr, "  this : %s\n  trace: %s\n", ours, theirs);
+        /* The trace only has hashes, so we can't say what differs */
+        fprintf(stderr, "re-record the trace without --fingerprint%s "
+                "for the details\n",
+                fingerprint_mode == FINGERPRINT_CHAIN
+                ? " (or with --fingerprint, to find the checkpoint)" : "");
+        report_history(trace);
+        fprintf(stderr, "this reginfo:\n");
+        reginfo_dump(&master_ri, stderr);
+        return 1;
+    }
     if (packet_mismatch) {
         fprintf(stderr, "packet mismatch (probably disagreement "
-                "about UNDEF on load/store)\n");
+                "about UNDEF on load/store, or about which registers "
+                "there are)\n");
+        report_mismatch_pc(get_pc(&master_ri));
         /* We don't have valid reginfo from the apprentice side
          * so stop now rather than printing anything about it.
          */
+        report_history(trace);
         fprintf(stderr, "%s reginfo:\n", trace ? "this" : "master");
         reginfo_dump(&master_ri, stderr);
         return 1;
@@ -164,11 +839,23 @@ int report_match_status(int trace)
         fprintf(stderr, "mismatch on memory!\n");
         resp = 1;
     }
+    if (!resp && diverged) {
+        fprintf(stderr, "match at the end of the test\n");
+        return 1;
+    }
     if (!resp) {
         fprintf(stderr, "match!\n");
         return 0;
     }
 
+    report_mismatch_pc(get_pc(&master_ri));
+    if (have_good_ri) {
+        fprintf(stderr, "last good checkpoint at image offset 0x%"
+                PRIxPTR "\n", good_pc);
+    }
+    report_sparse_region(get_pc(&master_ri));
+    report_history(trace);
+
     fprintf(stderr, "%s reginfo:\n", trace ? "this" : "master");
     reginfo_dump(&master_ri, stderr);
     fprintf(stderr, "%s reginfo:\n", trace ? "trace" : "apprentice");
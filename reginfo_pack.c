@@ -0,0 +1,299 @@
+/******************************************************************************
+ * Copyright (c) 2017 Linaro Limited
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *****************************************************************************/
+
+/* Packing a struct reginfo into the tagged block format used on the
+ * wire and in traces, and back again. The arch code says which blocks
+ * there are with reginfo_parts(). Also the parts of reading and
+ * writing traces which depend on the arch: its schema (see
+ * risu_trace.h), and reading records as struct reginfo.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "risu.h"
+
+#define STR(X) STR2(X)
+#define STR2(X) #X
+
+static size_t pad8(size_t len)
+{
+    return (len + 7) & ~(size_t)7;
+}
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+/* Byte swap the registers of up to 8 bytes in a piece of a struct
+ * reginfo, len bytes from offset off, to or from little-endian
+ */
+static void swap_fields(uint8_t *piece, size_t off, size_t len)
+{
+    const struct reginfo_field *f;
+    int i;
+
+    for (f = reginfo_fields; f->name; f++) {
+        for (i = 0; i < f->count; i++) {
+            size_t at = f->offset + i * f->size;
+            uint8_t *p;
+
+            if (at < off || at + f->size > off + len) {
+                continue;
+            }
+            p = piece + (at - off);
+            switch (f->size) {
+            case 2:
+                *(uint16_t *)p = __builtin_bswap16(*(uint16_t *)p);
+                break;
+            case 4:
+                *(uint32_t *)p = __builtin_bswap32(*(uint32_t *)p);
+                break;
+            case 8:
+                *(uint64_t *)p = __builtin_bswap64(*(uint64_t *)p);
+                break;
+            }
+        }
+    }
+}
+#else
+static inline void swap_fields(uint8_t *piece, size_t off, size_t len)
+{
+}
+#endif
+
+size_t reginfo_pack(struct reginfo *ri, void *buf)
+{
+    struct reginfo_part parts[REGINFO_MAX_PARTS];
+    struct reginfo_block b;
+    uint8_t *p = buf;
+    int i, j, n;
+
+    n = reginfo_parts(ri, parts);
+    for (i = 0; i < n; i++) {
+        const uint8_t *data = parts[i].data;
+        size_t len = parts[i].size * parts[i].count;
+
+        b.tag = htole32(parts[i].tag);
+        b.len = htole32(len);
+        memcpy(p, &b, sizeof(b));
+        p += sizeof(b);
+        for (j = 0; j < parts[i].count; j++) {
+            size_t off = data + j * parts[i].stride - (uint8_t *) ri;
+
+            memcpy(p, data + j * parts[i].stride, parts[i].size);
+            swap_fields(p, off, parts[i].size);
+            p += parts[i].size;
+        }
+        memset(p, 0, pad8(len) - len);
+        p += pad8(len) - len;
+    }
+
+    b.tag = htole32(REGINFO_END);
+    b.len = 0;
+    memcpy(p, &b, sizeof(b));
+    p += sizeof(b);
+    return p - (uint8_t *) buf;
+}
+
+int reginfo_unpack(struct reginfo *ri, const void *buf, size_t len)
+{
+    struct reginfo_part parts[REGINFO_MAX_PARTS];
+    struct reginfo_block b;
+    const uint8_t *p = buf, *end = p + len;
+    uint32_t seen = 0;
+    int i, j, n = 0;
+
+    memset(ri, 0, sizeof(*ri));
+    for (;;) {
+        if (end - p < sizeof(b)) {
+            return 1;
+        }
+        memcpy(&b, p, sizeof(b));
+        b.tag = le32toh(b.tag);
+        b.len = le32toh(b.len);
+        p += sizeof(b);
+        if (b.tag == REGINFO_END) {
+            break;
+        }
+        if (!seen && b.tag != REGINFO_CORE) {
+            return 1;
+        }
+        if (end - p < pad8(b.len)) {
+            return 1;
+        }
+
+        /* The core says what else to expect, so look again each time */
+        n = reginfo_parts(ri, parts);
+        for (i = 0; i < n; i++) {
+            if (parts[i].tag == b.tag) {
+                break;
+            }
+        }
+        if (i == n || (seen & (1 << i))
+            || b.len != parts[i].size * parts[i].count) {
+            return 1;
+        }
+        for (j = 0; j < parts[i].count; j++) {
+            uint8_t *to = (uint8_t *) parts[i].data + j * parts[i].stride;
+            size_t off = to - (uint8_t *) ri;
+
+            memcpy(to, p, parts[i].size);
+            swap_fields(to, off, parts[i].size);
+            p += parts[i].size;
+        }
+        p += pad8(b.len) - b.len;
+        seen |= 1 << i;
+    }
+
+    /* everything the core promised, and nothing after the end */
+    n = reginfo_parts(ri, parts);
+    if (p != end || seen != (1u << n) - 1) {
+        return 1;
+    }
+    return 0;
+}
+
+size_t trace_payload_size(trace_file *t, int op)
+{
+    int fp = trace_fingerprint_mode(t);
+
+    switch (op) {
+    case OP_SETMEMBLOCK:
+    case OP_GETMEMBLOCK:
+        return 0;
+    case OP_COMPAREMEM:
+        return fp ? HASH_LEN : MEMBLOCKLEN;
+    case OP_COMPARE:
+    case OP_TESTEND:
+    default:
+        return fp ? HASH_LEN : sizeof(struct reginfo);
+    }
+}
+
+/* Read a packed reginfo a block at a time, since only the blocks say
+ * how long it is, and unpack it. Returns 0 for success, -1 if it is
+ * truncated or malformed.
+ */
+static int read_reginfo(trace_file *t, struct reginfo *ri)
+{
+    static __thread uint8_t buf[REGINFO_MAX_PACKED];
+    struct reginfo_block b;
+    size_t len = 0, data;
+
+    do {
+        if (len + sizeof(b) > sizeof(buf)
+            || trace_read(t, buf + len, sizeof(b)) != 0) {
+            return -1;
+        }
+        memcpy(&b, buf + len, sizeof(b));
+        b.tag = le32toh(b.tag);
+        b.len = le32toh(b.len);
+        len += sizeof(b);
+        data = pad8(b.len);
+        if (data > sizeof(buf) - len
+            || (data && trace_read(t, buf + len, data) != 0)) {
+            return -1;
+        }
+        len += data;
+    } while (b.tag != REGINFO_END);
+
+    return reginfo_unpack(ri, buf, len) ? -1 : 0;
+}
+
+int trace_read_record(trace_file *t, trace_header_t *header, void *payload)
+{
+    if (trace_read(t, header, sizeof(*header)) != 0) {
+        return 1;
+    }
+    trace_header_le(header);
+    switch (header->risu_op) {
+    case OP_SETMEMBLOCK:
+    case OP_GETMEMBLOCK:
+    case OP_COMPAREMEM:
+        break;
+    default:
+        if (!trace_fingerprint_mode(t)) {
+            return read_reginfo(t, payload);
+        }
+        break;
+    }
+    if (trace_read(t, payload, trace_payload_size(t, header->risu_op)) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+struct trace_file_header *trace_native_header(int fingerprint,
+                                              const uint8_t *image_hash)
+{
+    struct trace_file_header *h;
+    struct trace_schema_block *b;
+    struct trace_schema_field *f;
+    int nblocks = 0, nfields = 0, i;
+    size_t size;
+
+    while (reginfo_blocks[nblocks].tag != REGINFO_END) {
+        nblocks++;
+    }
+    while (reginfo_fields[nfields].name) {
+        nfields++;
+    }
+    size = sizeof(*h) + nblocks * sizeof(*b) + nfields * sizeof(*f);
+    h = calloc(1, size);
+    b = (struct trace_schema_block *)(h + 1);
+    f = (struct trace_schema_field *)(b + nblocks);
+
+    memcpy(h->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    h->version = htole32(TRACE_VERSION);
+    h->header_size = htole32(size);
+    strncpy(h->arch, STR(ARCH), sizeof(h->arch) - 1);
+    h->layout = htole32(REGINFO_LAYOUT);
+    h->reginfo_size = htole32(sizeof(struct reginfo));
+    h->memblock_len = htole32(MEMBLOCKLEN);
+    h->fingerprint = htole32(fingerprint);
+    h->nblocks = htole32(nblocks);
+    h->nfields = htole32(nfields);
+    if (image_hash) {
+        memcpy(h->image_hash, image_hash, HASH_LEN);
+    }
+    for (i = 0; i < nblocks; i++) {
+        b[i].tag = htole32(reginfo_blocks[i].tag);
+        b[i].offset = htole32(reginfo_blocks[i].offset);
+        b[i].count = htole32(reginfo_blocks[i].count);
+        b[i].stride = htole32(reginfo_blocks[i].stride);
+    }
+    for (i = 0; i < nfields; i++) {
+        strncpy(f[i].name, reginfo_fields[i].name, TRACE_FIELD_NAME_LEN - 1);
+        f[i].offset = htole32(reginfo_fields[i].offset);
+        f[i].size = htole32(reginfo_fields[i].size);
+        f[i].count = htole32(reginfo_fields[i].count);
+    }
+    return h;
+}
+
+int trace_is_native(trace_file *t, const char *name)
+{
+    const struct trace_file_header *h;
+    int r = trace_read_header(t, &h);
+
+    if (r != 0) {
+        trace_header_error(name, r);
+        return 0;
+    }
+    if (strncmp(h->arch, STR(ARCH), sizeof(h->arch)) != 0) {
+        fprintf(stderr, "%s: trace is from %.16s, not " STR(ARCH) "\n",
+                name, h->arch);
+        return 0;
+    }
+    if (le32toh(h->layout) != REGINFO_LAYOUT
+        || le32toh(h->reginfo_size) != sizeof(struct reginfo)
+        || le32toh(h->memblock_len) != MEMBLOCKLEN) {
+        fprintf(stderr, "%s: trace is from another version of risu "
+                "(register layout %u)\n", name, le32toh(h->layout));
+        return 0;
+    }
+    return 1;
+}
@@ -25,77 +25,144 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "config.h"
 
 #include "risu.h"
 
-void *memblock;
+__thread void *memblock;
 
-int apprentice_fd, master_fd;
-int trace;
-size_t signal_count;
+__thread int apprentice_fd, master_fd;
+__thread int trace;
+__thread size_t signal_count;
 
-#ifdef HAVE_ZLIB
-#include <zlib.h>
-gzFile gz_trace_file;
-#endif
+__thread trace_file *tracef;
 
-sigjmp_buf jmpbuf;
+/* Our own state stream, if asked to --record it */
+static __thread trace_file *record_file;
+
+__thread sigjmp_buf jmpbuf;
+
+/* How a session ends, by siglongjmp() out of the SIGILL handler */
+#define JMP_STOPPED 1       /* mismatch, or the master's end of test */
+#define JMP_TESTEND 2       /* the apprentice's end of test */
+#define JMP_FAILED 3        /* live apprentice mismatch: the master reports */
+#define JMP_TIMEOUT 4       /* the watchdog fired */
+#define JMP_BADIMAGE 5      /* the image is broken */
+#define JMP_COMMS 6         /* we lost the connection to our peer */
+
+/* Each thread's stack for the SIGILL handler */
+#define SIGNAL_STACK_SIZE (256 * 1024)
+static __thread void *signal_stack;
 
 /* Should we test for FP exception status bits? */
 int test_fp_exc;
 
+/* Are we talking to a live peer (rather than a trace)? */
+__thread int live_peer;
+
+/* Where a daemon master looks for the images apprentices ask for,
+ * and where it keeps the ones they send it (by hash).
+ */
+static const char *image_dir = ".";
+static const char *image_cache;
+
+/* Send our image to the master if it doesn't have it */
+static int send_image;
+
+/* Where live masters keep the traces of the runs they complete, and
+ * apprentices look for one to replay instead (--trace-cache). A
+ * master tees its state stream into cache_file, under a temporary
+ * name until the run has completed.
+ */
+static const char *trace_cache;
+static const char *master_cpu;
+static __thread trace_file *cache_file;
+static __thread char *cache_path, *cache_tmp;
+
+/* The socket functions below are only called from the SIGILL handler;
+ * if the connection fails, end just this session.
+ */
+static int check_comms(int r)
+{
+    if (r < 0) {
+        siglongjmp(jmpbuf, watchdog_timed_out() ? JMP_TIMEOUT : JMP_COMMS);
+    }
+    return r;
+}
+
 /* Master functions */
 
 int read_sock(void *ptr, size_t bytes)
 {
-    return recv_data_pkt(master_fd, ptr, bytes);
+    return check_comms(recv_data_pkt(master_fd, ptr, bytes));
 }
 
 int write_trace(void *ptr, size_t bytes)
 {
-    size_t res;
+    return trace_write(tracef, ptr, bytes);
+}
 
-#ifdef HAVE_ZLIB
-    if (master_fd == STDOUT_FILENO) {
-#endif
-        res = write(master_fd, ptr, bytes);
-#ifdef HAVE_ZLIB
-    } else {
-        res = gzwrite(gz_trace_file, ptr, bytes);
+int write_record(void *ptr, size_t bytes)
+{
+    int r = 0;
+
+    if (record_file) {
+        r = trace_write(record_file, ptr, bytes);
+    }
+    if (cache_file) {
+        r |= trace_write(cache_file, ptr, bytes);
+    }
+    return r;
+}
+
+/* Start a trace of ours with the file header for this image */
+static void write_header(trace_file *t, int fingerprint)
+{
+    struct trace_file_header *h = trace_native_header(fingerprint,
+                                                      image_hash);
+
+    trace_write_header(t, h);
+    free(h);
+}
+
+static void close_record(void)
+{
+    if (record_file) {
+        trace_close(record_file);
+        record_file = NULL;
     }
-#endif
-    return (res == bytes) ? 0 : 1;
 }
 
 void respond_sock(int r)
 {
-    send_response_byte(master_fd, r);
+    check_comms(send_response_byte(master_fd, r));
+}
+
+/* --keep-going: send the apprentice the state to carry on from */
+int write_resync(void *ptr, size_t bytes)
+{
+    return check_comms(send_data_pkt(master_fd, ptr, bytes));
 }
 
 /* Apprentice function */
 
 int write_sock(void *ptr, size_t bytes)
 {
-    return send_data_pkt(apprentice_fd, ptr, bytes);
+    return check_comms(send_data_pkt(apprentice_fd, ptr, bytes));
 }
 
 int read_trace(void *ptr, size_t bytes)
 {
-    size_t res;
-
-#ifdef HAVE_ZLIB
-    if (apprentice_fd == STDIN_FILENO) {
-#endif
-        res = read(apprentice_fd, ptr, bytes);
-#ifdef HAVE_ZLIB
-    } else {
-        res = gzread(gz_trace_file, ptr, bytes);
-    }
-#endif
+    return trace_read(tracef, ptr, bytes);
+}
 
-    return (res == bytes) ? 0 : 1;
+int read_resync(void *ptr, size_t bytes)
+{
+    int r = check_comms(recv_data_pkt(apprentice_fd, ptr, bytes));
+    check_comms(send_response_byte(apprentice_fd, r));
+    return r;
 }
 
 void respond_trace(int r)
@@ -129,9 +196,23 @@ void master_sigill(int sig, siginfo_t *si, void *uc)
         /* match OK */
         advance_pc(uc);
         return;
+    case BAD_IMAGE:
+        siglongjmp(jmpbuf, JMP_BADIMAGE);
+    case 2:
+        /* mismatch: if it was a sparse checkpoint, go back and
+         * re-run the region at full density to find the insn
+         */
+        if (rerun_sparse_region(uc)) {
+            return;
+        }
+        if (resync_after_mismatch(NULL, trace ? NULL : write_resync, uc)) {
+            advance_pc(uc);
+            return;
+        }
+        /* fall through */
     default:
         /* mismatch, or end of test */
-        siglongjmp(jmpbuf, 1);
+        siglongjmp(jmpbuf, JMP_STOPPED);
     }
 }
 
@@ -153,24 +234,66 @@ void apprentice_sigill(int sig, siginfo_t *si, void *uc)
         return;
     case 1:
         /* end of test */
-        exit(0);
+        siglongjmp(jmpbuf, JMP_TESTEND);
+    case BAD_IMAGE:
+        siglongjmp(jmpbuf, JMP_BADIMAGE);
     default:
         /* mismatch */
-        if (trace) {
-            siglongjmp(jmpbuf, 1);
+        if (r == 2 && rerun_sparse_region(uc)) {
+            /* the master told us to re-run the region with it */
+            return;
         }
-        exit(1);
+        if (r == 2 && resync_after_mismatch(trace ? NULL : read_resync,
+                                            NULL, uc)) {
+            advance_pc(uc);
+            return;
+        }
+        siglongjmp(jmpbuf, trace ? JMP_STOPPED : JMP_FAILED);
+    }
+}
+
+void watchdog_sigalrm(int sig, siginfo_t *si, void *uc)
+{
+    /* If we were waiting for our peer, the wait fails and the session
+     * ends from there; otherwise we have stopped the test code.
+     */
+    if (watchdog_expired(si) && !watchdog_waiting()) {
+        siglongjmp(jmpbuf, JMP_TIMEOUT);
     }
 }
 
 static void set_sigill_handler(void (*fn) (int, siginfo_t *, void *))
 {
     struct sigaction sa;
-    memset(&sa, 0, sizeof(struct sigaction));
+    stack_t ss;
 
+    /* SIGILL is synchronous, so the handler runs on the thread whose
+     * image hit the checkpoint; give it a stack of its own, whatever
+     * the test code has done to the stack pointer.
+     */
+    if (!signal_stack) {
+        signal_stack = malloc(SIGNAL_STACK_SIZE);
+        if (!signal_stack) {
+            perror("malloc");
+            exit(1);
+        }
+        memset(&ss, 0, sizeof(ss));
+        ss.ss_sp = signal_stack;
+        ss.ss_size = SIGNAL_STACK_SIZE;
+        if (sigaltstack(&ss, NULL) != 0) {
+            perror("sigaltstack");
+            exit(1);
+        }
+    }
+
+    memset(&sa, 0, sizeof(struct sigaction));
     sa.sa_sigaction = fn;
-    sa.sa_flags = SA_SIGINFO;
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    /* the handler allocates and uses stdio, so the watchdog must only
+     * get in while it waits for the peer (see watchdog.c)
+     */
     sigemptyset(&sa.sa_mask);
+    sigaddset(&sa.sa_mask, SIGALRM);
     if (sigaction(SIGILL, &sa, 0) != 0) {
         perror("sigaction");
         exit(1);
@@ -179,107 +302,831 @@ static void set_sigill_handler(void (*fn) (int, siginfo_t *, void *))
 
 typedef void entrypoint_fn(void);
 
-uintptr_t image_start_address;
-entrypoint_fn *image_start;
+__thread uintptr_t image_start_address;
+__thread entrypoint_fn *image_start;
+__thread size_t image_size;
+__thread uint8_t image_hash[HASH_LEN];
+__thread struct image_meta image_meta;
 
-void load_image(const char *imgfile)
+int load_image(const char *imgfile)
 {
     /* Load image file into memory as executable */
-    struct stat st;
     fprintf(stderr, "loading test image %s...\n", imgfile);
     int fd = open(imgfile, O_RDONLY);
     if (fd < 0) {
         fprintf(stderr, "failed to open image file %s\n", imgfile);
-        exit(1);
+        return 1;
     }
-    if (fstat(fd, &st) != 0) {
-        perror("fstat");
-        exit(1);
-    }
-    size_t len = st.st_size;
+    size_t len;
     void *addr;
 
     /* Map writable because we include the memory area for store
      * testing in the image.
      */
-    addr =
-        mmap(0, len, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE, fd,
-             0);
-    if (!addr) {
-        perror("mmap");
-        exit(1);
+    addr = image_map(fd, PROT_READ | PROT_WRITE | PROT_EXEC, &len,
+                     &image_meta);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "failed to map image file %s\n", imgfile);
+        close(fd);
+        return 1;
     }
     close(fd);
+    if (image_meta.h.version) {
+        fprintf(stderr, "image for %s, %u test insns from %u patterns\n",
+                image_meta.h.arch, image_meta.h.nunits,
+                image_meta.h.npatterns);
+    }
     image_start = addr;
     image_start_address = (uintptr_t) addr;
+    image_size = len;
+    hash_buffer(addr, len, image_hash);
+    return 0;
+}
+
+/* --trace-cache: start teeing our state stream into the cache, and
+ * tell the apprentice which CPU it is from if it wants to know.
+ */
+static int start_trace_cache(int sock, struct session_info *si)
+{
+    char cpu[CPU_ID_LEN];
+    char *dir;
+
+    cpu_identity(cpu);
+    if (si->want_cpu && send_data_pkt(sock, cpu, sizeof(cpu)) < 0) {
+        return 1;
+    }
+    if (!trace_cache) {
+        return 0;
+    }
+    fprintf(stderr, "master cpu %s\n", cpu);
+
+    cache_path = trace_cache_path(trace_cache, cpu, image_hash);
+    if (!cache_path || asprintf(&dir, "%s/%s", trace_cache, cpu) < 0) {
+        return 0;
+    }
+    mkdir(trace_cache, 0777);
+    mkdir(dir, 0777);
+    free(dir);
+    if (access(cache_path, F_OK) == 0
+        || asprintf(&cache_tmp, "%s.tmp.%d", cache_path, getpid()) < 0) {
+        /* already cached */
+        free(cache_path);
+        cache_path = NULL;
+        return 0;
+    }
+    cache_file = trace_open(cache_tmp, 1);
+    if (!cache_file) {
+        perror(cache_tmp);
+        return 0;
+    }
+    trace_start_writer(cache_file);
+    /* the full state is recorded, whatever the session sends */
+    write_header(cache_file, FINGERPRINT_OFF);
+    record_fn = write_record;
+    return 0;
+}
+
+/* Keep the trace if the run completed, and drop it if not */
+static void finish_trace_cache(int completed)
+{
+    if (!cache_file) {
+        return;
+    }
+    trace_close(cache_file);
+    cache_file = NULL;
+    if (completed && rename(cache_tmp, cache_path) == 0) {
+        fprintf(stderr, "trace cached as %s\n", cache_path);
+    } else {
+        unlink(cache_tmp);
+    }
+}
+
+/* --trace-cache: if we know the master's CPU and it has already run
+ * this image, replay its trace rather than connecting. Returns the
+ * path of the trace, or NULL.
+ */
+static char *find_cached_trace(const char *hostname, int port)
+{
+    char cpu[CPU_ID_LEN];
+    char *path;
+
+    if (master_cpu) {
+        if (strchr(master_cpu, '/')) {
+            return NULL;
+        }
+        snprintf(cpu, sizeof(cpu), "%s", master_cpu);
+    } else if (trace_cache_host_cpu(trace_cache, hostname, port, cpu)) {
+        return NULL;
+    }
+    path = trace_cache_path(trace_cache, cpu, image_hash);
+    if (path && access(path, R_OK) != 0) {
+        free(path);
+        path = NULL;
+    }
+    return path;
 }
 
 int master(void)
 {
-    if (sigsetjmp(jmpbuf, 1)) {
-#ifdef HAVE_ZLIB
-        if (trace && master_fd != STDOUT_FILENO) {
-            gzclose(gz_trace_file);
+    int how = sigsetjmp(jmpbuf, 1);
+
+    if (how) {
+        watchdog_stop();
+        close_record();
+        report_bench();
+        if (how == JMP_TIMEOUT || how == JMP_BADIMAGE
+            || how == JMP_COMMS) {
+            if (trace) {
+                trace_close(tracef);
+            } else {
+                close(master_fd);
+                finish_trace_cache(0);
+            }
+            if (how == JMP_COMMS) {
+                fprintf(stderr, "master: lost the connection to the "
+                        "apprentice after %zd checkpoints\n", signal_count);
+            }
+            if (how != JMP_TIMEOUT) {
+                return 1;
+            }
+            watchdog_report(watchdog_timed_out(), signal_count);
+            return EXIT_TIMEOUT;
         }
-#endif
-        close(master_fd);
         if (trace) {
+            trace_close(tracef);
             fprintf(stderr, "trace complete after %zd checkpoints\n",
                     signal_count);
             return 0;
         } else {
-            return report_match_status(0);
+            int r;
+
+            close(master_fd);
+            r = report_match_status(0);
+            finish_trace_cache(r == 0 && reached_test_end());
+            return r;
         }
     }
+    history_start();
     set_sigill_handler(&master_sigill);
     fprintf(stderr, "starting master image at 0x%"PRIxPTR"\n",
             image_start_address);
     fprintf(stderr, "starting image\n");
+    watchdog_run_image();
     image_start();
     fprintf(stderr, "image returned unexpectedly\n");
     exit(1);
 }
 
+/* Map the whole of an image file, container metadata and all, to send
+ * to a master; returns MAP_FAILED if we can't (or won't) send it
+ */
+static void *map_image_file(const char *imgfile, size_t *size)
+{
+    struct stat st;
+    void *addr = MAP_FAILED;
+    int fd = open(imgfile, O_RDONLY);
+
+    if (fd < 0) {
+        return MAP_FAILED;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size > 0
+        && st.st_size <= HELLO_MAX_IMAGE) {
+        *size = st.st_size;
+        addr = mmap(0, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    return addr;
+}
+
+/* Tell the master which image we are about to run, sending it a
+ * copy if it needs one. Returns nonzero if it won't run it.
+ */
+static int apprentice_hello(const char *imgfile, const char *hostname,
+                             int port)
+{
+    struct session_info si;
+    char cpu[CPU_ID_LEN];
+    const char *name = strrchr(imgfile, '/');
+    void *file = MAP_FAILED;
+    int r;
+
+    memset(&si, 0, sizeof(si));
+    snprintf(si.image, sizeof(si.image), "%s", name ? name + 1 : imgfile);
+    si.size = image_size;
+    memcpy(si.hash, image_hash, HASH_LEN);
+    if (send_image) {
+        size_t size;
+
+        file = map_image_file(imgfile, &size);
+        if (file != MAP_FAILED) {
+            si.can_send = 1;
+            si.file_size = size;
+            hash_buffer(file, size, si.file_hash);
+        }
+    }
+    si.fingerprint = fingerprint_mode != FINGERPRINT_OFF;
+    si.keep_going = keep_going;
+    si.want_cpu = trace_cache != NULL;
+
+    r = send_hello(apprentice_fd, &si);
+    if (r == HELLO_SEND_IMAGE) {
+        fprintf(stderr, "sending image to master...\n");
+        r = send_data_pkt(apprentice_fd, file, si.file_size);
+    }
+    if (file != MAP_FAILED) {
+        munmap(file, si.file_size);
+    }
+    if (r < 0) {
+        goto lost;
+    }
+    if (r != HELLO_OK) {
+        fprintf(stderr, "master can't run image %s%s\n", imgfile,
+                send_image ? "" : " (try --send-image?)");
+        return 1;
+    }
+    if (si.want_cpu) {
+        /* so next time we can tell if it has run this image before */
+        r = recv_data_pkt(apprentice_fd, cpu, sizeof(cpu));
+        if (r < 0 || send_response_byte(apprentice_fd, r) < 0) {
+            goto lost;
+        }
+        cpu[CPU_ID_LEN - 1] = 0;
+        if (r == 0 && cpu[0] && !strchr(cpu, '/')) {
+            trace_cache_set_host_cpu(trace_cache, hostname, port, cpu);
+        }
+    }
+    return 0;
+
+ lost:
+    /* the caller reports a timeout */
+    if (!watchdog_timed_out()) {
+        fprintf(stderr, "apprentice: lost the connection to the master\n");
+    }
+    return 1;
+}
+
 int apprentice(void)
 {
-    if (sigsetjmp(jmpbuf, 1)) {
-#ifdef HAVE_ZLIB
-        if (trace && apprentice_fd != STDIN_FILENO) {
-            gzclose(gz_trace_file);
+    int how = sigsetjmp(jmpbuf, 1);
+
+    if (how) {
+        watchdog_stop();
+        close_record();
+        if (trace) {
+            trace_close(tracef);
+        } else {
+            close(apprentice_fd);
+        }
+        switch (how) {
+        case JMP_TESTEND:
+            report_bench();
+            return report_divergences() ? 1 : 0;
+        case JMP_FAILED:
+            /* The master reports, but it only has our fingerprints */
+            if (fingerprint_mode) {
+                history_report("apprentice", NULL);
+            }
+            return 1;
+        case JMP_TIMEOUT:
+            watchdog_report(watchdog_timed_out(), signal_count);
+            return EXIT_TIMEOUT;
+        case JMP_BADIMAGE:
+            return 1;
+        case JMP_COMMS:
+            fprintf(stderr, "apprentice: lost the connection to the "
+                    "master after %zd checkpoints\n", signal_count);
+            return 1;
         }
-#endif
-        close(apprentice_fd);
         fprintf(stderr, "finished early after %zd checkpoints\n", signal_count);
+        report_bench();
         return report_match_status(1);
     }
+    history_start();
     set_sigill_handler(&apprentice_sigill);
     fprintf(stderr, "starting apprentice image at 0x%"PRIxPTR"\n",
             image_start_address);
     fprintf(stderr, "starting image\n");
+    watchdog_run_image();
     image_start();
     fprintf(stderr, "image returned unexpectedly\n");
     exit(1);
 }
 
 int ismaster;
+int daemon_mode;
+
+/* Does the file at path hold exactly the image described by si? */
+static int image_file_matches(const char *path, struct session_info *si)
+{
+    uint8_t hash[HASH_LEN];
+    size_t size;
+    void *addr;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return 0;
+    }
+    /* for a container, just the code is what the apprentice runs */
+    addr = image_map(fd, PROT_READ, &size, NULL);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return 0;
+    }
+    if (size != si->size) {
+        munmap(addr, size);
+        return 0;
+    }
+    hash_buffer(addr, size, hash);
+    munmap(addr, size);
+    return memcmp(hash, si->hash, HASH_LEN) == 0;
+}
+
+/* Find a local copy of the image an apprentice asked for: in the image
+ * cache by hash, or in image_dir by name. Returns a malloc'd path, or
+ * NULL if we don't have it.
+ */
+static char *find_image(struct session_info *si)
+{
+    char hashstr[HASH_STR_LEN];
+    char *path;
+
+    if (image_cache) {
+        hash_to_str(si->hash, hashstr);
+        if (asprintf(&path, "%s/%s", image_cache, hashstr) >= 0) {
+            if (image_file_matches(path, si)) {
+                return path;
+            }
+            free(path);
+        }
+    }
+    /* Only serve images from image_dir */
+    if (si->image[0] && !strchr(si->image, '/')
+        && strcmp(si->image, "..") != 0
+        && asprintf(&path, "%s/%s", image_dir, si->image) >= 0) {
+        if (image_file_matches(path, si)) {
+            return path;
+        }
+        free(path);
+    }
+    return NULL;
+}
+
+/* Receive the image file from the apprentice and store it in the image
+ * cache, named by the hash of its code as find_image() looks for it,
+ * or a temporary file if we don't have one (which the caller should
+ * remove once it is loaded). Returns a malloc'd path, or NULL.
+ */
+static char *receive_image(int sock, struct session_info *si, int *is_temp)
+{
+    char hashstr[HASH_STR_LEN];
+    uint8_t hash[HASH_LEN];
+    char *path = NULL, *tmp;
+    void *buf;
+    int fd;
+
+    if (si->file_size == 0 || si->file_size > HELLO_MAX_IMAGE
+        || !(buf = malloc(si->file_size))) {
+        return NULL;
+    }
+    if (recv_data_pkt(sock, buf, si->file_size) != 0) {
+        free(buf);
+        return NULL;
+    }
+    hash_buffer(buf, si->file_size, hash);
+    if (memcmp(hash, si->file_hash, HASH_LEN) != 0) {
+        fprintf(stderr, "master: image %s corrupted in transfer\n",
+                si->image);
+        free(buf);
+        return NULL;
+    }
+
+    /* Write to a temporary name and rename into place, so concurrent
+     * sessions never see a partial image.
+     */
+    hash_to_str(si->hash, hashstr);
+    if (image_cache) {
+        if (asprintf(&path, "%s/%s", image_cache, hashstr) < 0
+            || asprintf(&tmp, "%s.tmp.%d", path, getpid()) < 0) {
+            free(buf);
+            return NULL;
+        }
+        fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+        *is_temp = 0;
+    } else {
+        tmp = strdup("/tmp/risu-image-XXXXXX");
+        fd = mkstemp(tmp);
+        *is_temp = 1;
+    }
+    if (fd < 0 || write(fd, buf, si->file_size) != si->file_size
+        || close(fd) != 0) {
+        perror("master: saving image");
+        goto bad;
+    }
+    /* only the right code goes in the cache under its hash */
+    if (!image_file_matches(tmp, si)) {
+        fprintf(stderr, "master: image %s sent isn't the one "
+                "described\n", si->image);
+        goto bad;
+    }
+    if (path && rename(tmp, path) != 0) {
+        perror("master: saving image");
+        goto bad;
+    }
+    free(buf);
+    if (!path) {
+        return tmp;
+    }
+    free(tmp);
+    return path;
+
+ bad:
+    unlink(tmp);
+    free(tmp);
+    free(path);
+    free(buf);
+    return NULL;
+}
+
+/* End a session which failed before its image started, returning
+ * its exit status
+ */
+static int setup_failed(void)
+{
+    int which = watchdog_timed_out();
+
+    watchdog_stop();
+    if (which) {
+        watchdog_report(which, 0);
+        return EXIT_TIMEOUT;
+    }
+    return 1;
+}
+
+int master_session(int sock)
+{
+    struct session_info si;
+    char *imgfile;
+    int is_temp = 0, r;
+
+    /* Buffer our output so the report from each session comes out
+     * in one piece rather than interleaved with the others.
+     */
+    setvbuf(stderr, NULL, _IOFBF, 64 * 1024);
+    watchdog_start(&watchdog_sigalrm);
+
+    if (recv_hello(sock, &si) != 0) {
+        if (!watchdog_timed_out()) {
+            fprintf(stderr, "master: bad session start from apprentice\n");
+        }
+        send_response_byte(sock, HELLO_REFUSED);
+        return setup_failed();
+    }
+    imgfile = find_image(&si);
+    if (!imgfile) {
+        if (!si.can_send) {
+            fprintf(stderr, "master: no image %s in %s\n",
+                    si.image, image_dir);
+            send_response_byte(sock, HELLO_REFUSED);
+            return setup_failed();
+        }
+        if (si.file_size > HELLO_MAX_IMAGE) {
+            fprintf(stderr, "master: image %s is too big to be sent "
+                    "(%" PRIu64 " bytes)\n", si.image, si.file_size);
+            send_response_byte(sock, HELLO_REFUSED);
+            return setup_failed();
+        }
+        send_response_byte(sock, HELLO_SEND_IMAGE);
+        imgfile = receive_image(sock, &si, &is_temp);
+        if (!imgfile) {
+            send_response_byte(sock, HELLO_REFUSED);
+            return setup_failed();
+        }
+    }
+
+    r = load_image(imgfile);
+    if (is_temp) {
+        unlink(imgfile);
+    }
+    free(imgfile);
+    if (r) {
+        send_response_byte(sock, HELLO_REFUSED);
+        return setup_failed();
+    }
+    /* and check nothing changed under our feet */
+    if (memcmp(image_hash, si.hash, HASH_LEN) != 0) {
+        fprintf(stderr, "master: image %s changed while loading\n",
+                si.image);
+        send_response_byte(sock, HELLO_REFUSED);
+        return setup_failed();
+    }
+    if (send_response_byte(sock, HELLO_OK) < 0
+        || start_trace_cache(sock, &si) != 0) {
+        finish_trace_cache(0);
+        return setup_failed();
+    }
+
+    fingerprint_mode = si.fingerprint ? FINGERPRINT_EACH : FINGERPRINT_OFF;
+    keep_going = si.keep_going;
+    live_peer = 1;
+    master_fd = sock;
+    stats_start_session(si.image);
+    r = master();
+    history_stop();
+    forget_divergences();
+    stats_end_session(r);
+    return r;
+}
 
 void usage(void)
 {
     fprintf(stderr,
-            "Usage: risu [--master] [--host <ip>] [--port <port>] <image file>"
-            "\n\n");
+            "Usage: risu [--master] [--host <ip>] [--port <port>] "
+            "<image file>...\n");
+    fprintf(stderr,
+            "       risu --master --daemon [--port <port>] [--jobs <n>] "
+            "[--image-dir <dir>]\n"
+            "            [--image-cache <dir>]\n\n");
     fprintf(stderr,
             "Run through the pattern file verifying each instruction\n");
-    fprintf(stderr, "between master and apprentice risu processes.\n\n");
+    fprintf(stderr, "between master and apprentice risu processes.\n");
+    fprintf(stderr, "Several images run at once, each on its own thread.\n\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  --master          Be the master (server)\n");
-    fprintf(stderr, "  -t, --trace=FILE  Record/playback trace file\n");
+    fprintf(stderr, "  -t, --trace=FILE  Record/playback trace file (one "
+            "per image)\n");
+    fprintf(stderr,
+            "  --record=FILE     Also record our own state to trace FILE\n");
     fprintf(stderr,
             "  -h, --host=HOST   Specify master host machine (apprentice only)"
             "\n");
     fprintf(stderr,
             "  -p, --port=PORT   Specify the port to connect to/listen on "
             "(default 9191)\n");
+    fprintf(stderr,
+            "  --daemon          Keep serving apprentices, running each "
+            "session in\n"
+            "                    its own process (master only)\n");
+    fprintf(stderr,
+            "  --jobs=N          Run at most N sessions at once (daemon only, "
+            "default\n"
+            "                    is the number of online CPUs)\n");
+    fprintf(stderr,
+            "  --image-dir=DIR   Directory the images apprentices ask for "
+            "live in\n"
+            "                    (daemon only, default .)\n");
+    fprintf(stderr,
+            "  --image-cache=DIR Keep images sent by apprentices in DIR, "
+            "named by\n"
+            "                    their hash (daemon only)\n");
+    fprintf(stderr,
+            "  --send-image      Send the image to a master which doesn't "
+            "have it\n"
+            "                    (apprentice only)\n");
+    fprintf(stderr,
+            "  --fingerprint[=chain]\n"
+            "                    Exchange or record only a hash of the state "
+            "at each\n"
+            "                    checkpoint, or with chain a running hash "
+            "checked at\n"
+            "                    the end of the test (traces only). Set by "
+            "the\n"
+            "                    apprentice live, or the master when "
+            "recording\n");
+    fprintf(stderr,
+            "  --timestamps      Timestamp each checkpoint in the traces we "
+            "write,\n"
+            "                    for risu-stats --map to profile with\n");
+    fprintf(stderr,
+            "  --keep-going      After a mismatch, bring the apprentice's "
+            "state back\n"
+            "                    into line with the master's and carry on, "
+            "listing\n"
+            "                    every mismatch at the end. Set by the "
+            "apprentice\n");
+    fprintf(stderr,
+            "  --trace-cache=DIR Master: keep the trace of each live run "
+            "that completes\n"
+            "                    in DIR, by CPU and image hash. Apprentice: "
+            "replay it\n"
+            "                    instead of connecting, if the master has "
+            "already\n"
+            "                    run this image\n");
+    fprintf(stderr,
+            "  --master-cpu=ID   The master's CPU, as it prints it "
+            "(apprentice only,\n"
+            "                    default is what the master last told us)\n");
+    fprintf(stderr,
+            "  --stats=FILE      Publish live counters for risu-top in FILE "
+            "(eg under\n"
+            "                    /dev/shm)\n");
+    fprintf(stderr,
+            "  --timeout=SECS    Give up if a session goes SECS seconds "
+            "without a\n"
+            "                    checkpoint, exiting with status %d\n",
+            EXIT_TIMEOUT);
+    fprintf(stderr,
+            "  --session-timeout=SECS\n"
+            "                    Give up if a session runs for more than "
+            "SECS seconds\n");
+    fprintf(stderr,
+            "  --history=N       On a mismatch, show the last N checkpoints "
+            "which led up\n"
+            "                    to it (default none)\n");
+}
+
+/* Run one image, against a trace if trace_fn is set or else a live
+ * peer, returning the exit status. Errors end only this image's
+ * session, as others may be running on other threads.
+ */
+static int run_image(const char *imgfile, char *trace_fn,
+                     const char *hostname, uint16_t port)
+{
+    int r;
+
+    stats_start_session(imgfile);
+    watchdog_start(&watchdog_sigalrm);
+    if (load_image(imgfile) != 0) {
+        goto fail;
+    }
+    trace = trace_fn != NULL;
+    if (!ismaster && !trace && trace_cache) {
+        trace_fn = find_cached_trace(hostname, port);
+        if (trace_fn) {
+            fprintf(stderr, "replaying cached trace %s\n", trace_fn);
+            trace = 1;
+        }
+    }
+    live_peer = !trace;
+    if (record_file) {
+        if (session_stats) {
+            trace_set_counters(record_file, &session_stats->trace_bytes,
+                               &session_stats->trace_file_bytes);
+        }
+        write_header(record_file, FINGERPRINT_OFF);
+    }
+
+    if (ismaster) {
+        if (trace) {
+            tracef = trace_open(trace_fn, 1);
+            if (!tracef) {
+                perror(trace_fn);
+                goto fail;
+            }
+            if (session_stats) {
+                trace_set_counters(tracef, &session_stats->trace_bytes,
+                                   &session_stats->trace_file_bytes);
+            }
+            /* compress in the background, not in the SIGILL handler */
+            trace_start_writer(tracef);
+            write_header(tracef, fingerprint_mode);
+        } else {
+            fprintf(stderr, "master port %d\n", port);
+            master_fd = master_connect(port);
+            if (master_fd < 0) {
+                goto fail;
+            }
+            /* We already know our image; just check the apprentice
+             * is running the same one.
+             */
+            struct session_info si;
+            if (recv_hello(master_fd, &si) != 0) {
+                if (!watchdog_timed_out()) {
+                    fprintf(stderr, "master: bad session start from "
+                            "apprentice\n");
+                }
+                send_response_byte(master_fd, HELLO_REFUSED);
+                close(master_fd);
+                goto fail;
+            }
+            if (si.size != image_size
+                || memcmp(si.hash, image_hash, HASH_LEN) != 0) {
+                fprintf(stderr, "master: apprentice image %s is not the "
+                        "same as %s\n", si.image, imgfile);
+                send_response_byte(master_fd, HELLO_REFUSED);
+                close(master_fd);
+                goto fail;
+            }
+            if (send_response_byte(master_fd, HELLO_OK) < 0
+                || start_trace_cache(master_fd, &si) != 0) {
+                if (!watchdog_timed_out()) {
+                    fprintf(stderr, "master: lost the connection to the "
+                            "apprentice\n");
+                }
+                finish_trace_cache(0);
+                close(master_fd);
+                goto fail;
+            }
+            /* the apprentice decides */
+            fingerprint_mode = si.fingerprint ? FINGERPRINT_EACH
+                                              : FINGERPRINT_OFF;
+            keep_going = si.keep_going;
+        }
+        r = master();
+    } else {
+        if (trace) {
+            const struct trace_file_header *h;
+
+            tracef = trace_open(trace_fn, 0);
+            if (!tracef) {
+                perror(trace_fn);
+                goto fail;
+            }
+            if (!trace_is_native(tracef, trace_fn)) {
+                trace_close(tracef);
+                goto fail;
+            }
+            trace_read_header(tracef, &h);
+            if (memcmp(h->image_hash, image_hash, HASH_LEN) != 0) {
+                fprintf(stderr, "warning: %s was recorded from another "
+                        "image than %s\n", trace_fn, imgfile);
+            }
+            /* decompress ahead of the SIGILL handler */
+            trace_start_reader(tracef);
+            /* the trace says whether it holds fingerprints */
+            fingerprint_mode = trace_fingerprint_mode(tracef);
+        } else {
+            fprintf(stderr, "apprentice host %s port %d\n", hostname, port);
+            apprentice_fd = apprentice_connect(hostname, port);
+            if (apprentice_fd < 0) {
+                goto fail;
+            }
+            if (apprentice_hello(imgfile, hostname, port) != 0) {
+                close(apprentice_fd);
+                goto fail;
+            }
+        }
+        r = apprentice();
+    }
+    history_stop();
+    forget_divergences();
+    stats_end_session(r);
+    return r;
+
+ fail:
+    r = setup_failed();
+    stats_end_session(r);
+    return r;
+}
+
+/* Several images at once: each runs on its own thread, with its own
+ * session state (see risu.h).
+ */
+struct image_thread {
+    const char *imgfile;
+    char *trace_fn;
+    const char *hostname;
+    uint16_t port;
+    int fingerprint_mode;
+    pthread_t thread;
+    int status;
+};
+
+static void *image_thread(void *arg)
+{
+    struct image_thread *t = arg;
+
+    fingerprint_mode = t->fingerprint_mode;
+    t->status = run_image(t->imgfile, t->trace_fn, t->hostname, t->port);
+    return NULL;
+}
+
+static int run_images(int nimages, char **imgfiles, char **trace_fns,
+                      const char *hostname, uint16_t port)
+{
+    struct image_thread *threads = calloc(nimages, sizeof(*threads));
+    int i, failed = 0, timeouts = 0;
+
+    for (i = 0; i < nimages; i++) {
+        struct image_thread *t = &threads[i];
+
+        t->imgfile = imgfiles[i];
+        t->trace_fn = trace_fns ? trace_fns[i] : NULL;
+        t->hostname = hostname;
+        t->port = port;
+        t->fingerprint_mode = fingerprint_mode;
+        if (pthread_create(&t->thread, NULL, image_thread, t) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (i = 0; i < nimages; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    for (i = 0; i < nimages; i++) {
+        int status = threads[i].status;
+
+        fprintf(stderr, "image %s: %s\n", threads[i].imgfile,
+                status == EXIT_TIMEOUT ? "timed out"
+                : status ? "mismatch or error" : "match");
+        if (status == EXIT_TIMEOUT) {
+            timeouts++;
+        } else if (status) {
+            failed = 1;
+        }
+    }
+    free(threads);
+    /* a mismatch is the news, if there is one */
+    return failed ? 1 : timeouts ? EXIT_TIMEOUT : 0;
 }
 
 int main(int argc, char **argv)
@@ -287,8 +1134,11 @@ int main(int argc, char **argv)
     /* some handy defaults to make testing easier */
     uint16_t port = 9191;
     char *hostname = "localhost";
-    char *imgfile;
-    char *trace_fn = NULL;
+    char **trace_fns = NULL;
+    int ntraces = 0, nimages;
+    char *record_fn_name = NULL;
+    char *stats_fn = NULL;
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
 
     /* TODO clean this up later */
 
@@ -299,6 +1149,21 @@ int main(int argc, char **argv)
             {"host", required_argument, 0, 'h'},
             {"port", required_argument, 0, 'p'},
             {"test-fp-exc", no_argument, &test_fp_exc, 1},
+            {"daemon", no_argument, &daemon_mode, 1},
+            {"jobs", required_argument, 0, 'j'},
+            {"image-dir", required_argument, 0, 'd'},
+            {"image-cache", required_argument, 0, 'c'},
+            {"send-image", no_argument, &send_image, 1},
+            {"record", required_argument, 0, 'r'},
+            {"fingerprint", optional_argument, 0, 'f'},
+            {"timestamps", no_argument, &record_timestamps, 1},
+            {"keep-going", no_argument, &keep_going, 1},
+            {"trace-cache", required_argument, 0, 'C'},
+            {"master-cpu", required_argument, 0, 'M'},
+            {"stats", required_argument, 0, 'S'},
+            {"timeout", required_argument, 0, 'T'},
+            {"session-timeout", required_argument, 0, 'U'},
+            {"history", required_argument, 0, 'H'},
             {0, 0, 0, 0}
         };
         int optidx = 0;
@@ -315,7 +1180,9 @@ int main(int argc, char **argv)
         }
         case 't':
         {
-            trace_fn = optarg;
+            /* one for each image, in order */
+            trace_fns = realloc(trace_fns, (ntraces + 1) * sizeof(char *));
+            trace_fns[ntraces++] = optarg;
             trace = 1;
             break;
         }
@@ -330,6 +1197,70 @@ int main(int argc, char **argv)
             port = strtol(optarg, 0, 10);
             break;
         }
+        case 'j':
+        {
+            jobs = strtol(optarg, 0, 10);
+            break;
+        }
+        case 'd':
+        {
+            image_dir = optarg;
+            break;
+        }
+        case 'c':
+        {
+            image_cache = optarg;
+            break;
+        }
+        case 'C':
+        {
+            trace_cache = optarg;
+            break;
+        }
+        case 'M':
+        {
+            master_cpu = optarg;
+            break;
+        }
+        case 'S':
+        {
+            stats_fn = optarg;
+            break;
+        }
+        case 'T':
+        {
+            checkpoint_timeout = strtod(optarg, NULL);
+            break;
+        }
+        case 'U':
+        {
+            session_timeout = strtod(optarg, NULL);
+            break;
+        }
+        case 'H':
+        {
+            history_len = strtol(optarg, NULL, 10);
+            break;
+        }
+        case 'r':
+        {
+            record_fn_name = optarg;
+            break;
+        }
+        case 'f':
+        {
+            if (!optarg) {
+                fingerprint_mode = FINGERPRINT_EACH;
+            } else if (strcmp(optarg, "chain") == 0) {
+                fingerprint_mode = FINGERPRINT_CHAIN;
+            } else {
+                fprintf(stderr, "Error: unknown fingerprint mode %s\n\n",
+                        optarg);
+                usage();
+                exit(1);
+            }
+            break;
+        }
         case '?':
         {
             usage();
@@ -340,44 +1271,64 @@ int main(int argc, char **argv)
         }
     }
 
-    imgfile = argv[optind];
-    if (!imgfile) {
+    if (stats_fn && stats_open(stats_fn, daemon_mode ? "daemon"
+                               : ismaster ? "master" : "apprentice") != 0) {
+        perror(stats_fn);
+        exit(1);
+    }
+
+    /* A peer going away should end its session with an error from
+     * write(), not kill every session in the process.
+     */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (daemon_mode) {
+        if (!ismaster || trace) {
+            fprintf(stderr, "Error: --daemon is only for a live master\n\n");
+            usage();
+            exit(1);
+        }
+        return master_daemon(port, jobs > 0 ? jobs : 1);
+    }
+
+    nimages = argc - optind;
+    if (nimages == 0) {
         fprintf(stderr, "Error: must specify image file name\n\n");
         usage();
         exit(1);
     }
+    if (ntraces && ntraces != nimages) {
+        fprintf(stderr, "Error: need one trace for each image\n\n");
+        usage();
+        exit(1);
+    }
+    if (nimages > 1 && (record_fn_name || (ismaster && !trace))) {
+        fprintf(stderr, "Error: several images can only be run against "
+                "traces, or\nby an apprentice of a daemon master, and "
+                "without --record\n\n");
+        usage();
+        exit(1);
+    }
 
-    load_image(imgfile);
+    if (fingerprint_mode == FINGERPRINT_CHAIN && !trace) {
+        fprintf(stderr, "Error: --fingerprint=chain is only for traces\n\n");
+        usage();
+        exit(1);
+    }
 
-    if (ismaster) {
-        if (trace) {
-            if (strcmp(trace_fn, "-") == 0) {
-                master_fd = STDOUT_FILENO;
-            } else {
-                master_fd = open(trace_fn, O_WRONLY | O_CREAT, S_IRWXU);
-#ifdef HAVE_ZLIB
-                gz_trace_file = gzdopen(master_fd, "wb9");
-#endif
-            }
-        } else {
-            fprintf(stderr, "master port %d\n", port);
-            master_fd = master_connect(port);
-        }
-        return master();
-    } else {
-        if (trace) {
-            if (strcmp(trace_fn, "-") == 0) {
-                apprentice_fd = STDIN_FILENO;
-            } else {
-                apprentice_fd = open(trace_fn, O_RDONLY);
-#ifdef HAVE_ZLIB
-                gz_trace_file = gzdopen(apprentice_fd, "rb");
-#endif
-            }
-        } else {
-            fprintf(stderr, "apprentice host %s port %d\n", hostname, port);
-            apprentice_fd = apprentice_connect(hostname, port);
+    if (record_fn_name) {
+        record_file = trace_open(record_fn_name, 1);
+        if (!record_file) {
+            perror(record_fn_name);
+            exit(1);
         }
-        return apprentice();
+        trace_start_writer(record_file);
+        record_fn = write_record;
+    }
+
+    if (nimages > 1) {
+        return run_images(nimages, argv + optind, trace_fns, hostname, port);
     }
+    return run_image(argv[optind], trace_fns ? trace_fns[0] : NULL,
+                     hostname, port);
 }
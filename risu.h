@@ -14,8 +14,10 @@
 
 #include <inttypes.h>
 #include <stdint.h>
+#include <signal.h>
 #include <ucontext.h>
 #include <stdio.h>
+#include <endian.h>
 
 /* GCC computed include to pull in the correct risu_reginfo_*.h for
  * the architecture.
@@ -26,39 +28,362 @@
 
 #include REGINFO_HEADER(ARCH)
 
+#include "risu_trace.h"
+
 /* Socket related routines */
+int master_listen(int port, int backlog);
+int master_accept(int sock);
 int master_connect(int port);
 int apprentice_connect(const char *hostname, int port);
 int send_data_pkt(int sock, void *pkt, int pktlen);
 int recv_data_pkt(int sock, void *pkt, int pktlen);
-void send_response_byte(int sock, int resp);
+int send_response_byte(int sock, int resp);
+
+/* Image containers (risugen --container, image.c). A container starts
+ * with this header, in the target's byte order; the code follows at
+ * code_offset, which is aligned so it can be mapped straight from the
+ * file, and the metadata after that. A plain .bin image is all code.
+ */
+#define IMAGE_MAGIC "RISUIMG"
+#define IMAGE_VERSION 1
+#define IMAGE_ALIGN 65536   /* the largest page size we run on */
+
+struct image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t memblock_len;      /* 0 if there are no memory patterns */
+    char arch[16];              /* as in the .risu file, eg "arm.thumb" */
+    uint64_t seed;              /* risugen --seed */
+    uint64_t code_offset, code_size;
+    /* test units, sorted by start offset */
+    uint64_t units_offset;
+    uint32_t nunits, npatterns;
+    /* npatterns NUL-terminated pattern names */
+    uint64_t names_offset, names_size;
+    /* free-form text: how the image was generated */
+    uint64_t info_offset, info_size;
+};
+
+/* A test instruction and its setup code; the checkpoint (or
+ * checkpoint slot) for it is at start + len.
+ */
+struct image_unit {
+    uint32_t start, len;
+    uint32_t pattern;           /* index into the names */
+};
+
+struct image_meta {
+    struct image_header h;      /* all zero for a plain image */
+    struct image_unit *units;
+    char **names;
+    char *info;
+    /* The offsets of the checkpoint slots, in ascending order, from
+     * the table risugen --compare-every puts at the end of the code
+     * (of plain images too): nslots words, then nslots, then the
+     * magic "RISUSLOT", all in the target's byte order.
+     */
+    uint32_t *slots;
+    uint32_t nslots;
+};
+
+/* Map the code of an image file at fd, plain or container, with the
+ * given protection; returns MAP_FAILED if it can't be mapped, and
+ * otherwise sets *size. If meta is non-NULL it gets the metadata.
+ */
+void *image_map(int fd, int prot, size_t *size, struct image_meta *meta);
+
+/* Read just the metadata of an image file. Returns 0 for a container,
+ * 1 for a plain image (with meta zeroed) and -1 if it is corrupt.
+ */
+int image_read_meta(int fd, struct image_meta *meta);
+
+/* The pattern of the test unit whose checkpoint is at image offset
+ * pc, or NULL if there isn't one.
+ */
+const char *image_pattern_at(const struct image_meta *meta, uintptr_t pc);
+
+/* The pattern of the first test unit after image offset pc, or NULL */
+const char *image_pattern_after(const struct image_meta *meta, uintptr_t pc);
+
+/* The slots between image offsets start and end: returns how many,
+ * with *first the first of them
+ */
+size_t image_slots_between(const struct image_meta *meta, uintptr_t start,
+                           uintptr_t end, const uint32_t **first);
+
+/* The metadata of the image risu is running */
+extern __thread struct image_meta image_meta;
+
+/* Session start handshake: the apprentice names its image and gives
+ * the size and hash of its code, so the master can check it is running
+ * the same one (or ask for a copy of the file). The master replies
+ * with one of:
+ */
+#define HELLO_OK 0          /* go ahead */
+#define HELLO_REFUSED 1     /* can't run this image */
+#define HELLO_SEND_IMAGE 2  /* don't have it: send it as one packet */
+
+/* The largest image the master will take from an apprentice, since it
+ * holds the whole thing in memory before it can check the hash
+ */
+#define HELLO_MAX_IMAGE (128 * 1024 * 1024)
+
+/* Response from a master in fingerprint mode when the fingerprints
+ * differ: send the full state as well.
+ */
+#define RESP_SEND_FULL 3
+
+/* Response from a live master for a mismatch at a checkpoint after
+ * checkpoint slots (risugen --compare-every): both sides go back and
+ * re-run the region with the slots filled in.
+ */
+#define RESP_RERUN 4
+
+#define HELLO_IMAGE_LEN 256
+
+struct session_info {
+    char image[HELLO_IMAGE_LEN];    /* file name, without the path */
+    uint64_t size;                  /* of the code */
+    uint8_t hash[HASH_LEN];
+    int can_send;                   /* apprentice can send the image */
+    /* The whole file it would send, container metadata and all */
+    uint64_t file_size;
+    uint8_t file_hash[HASH_LEN];
+    int fingerprint;                /* apprentice sends fingerprints */
+    int keep_going;                 /* carry on after mismatches */
+    int want_cpu;                   /* send the master's CPU identity */
+};
+
+int send_hello(int sock, struct session_info *si);
+int recv_hello(int sock, struct session_info *si);
 
-extern uintptr_t image_start_address;
-extern void *memblock;
+/* Daemon mode master (daemon.c): serve sessions until killed,
+ * running at most max_sessions at once.
+ */
+int master_daemon(int port, int max_sessions);
+
+/* Run one session of a daemon master on a connected socket;
+ * returns the exit status for the worker.
+ */
+int master_session(int sock);
+
+/* Trace cache (trace_cache.c): traces recorded by live masters, kept
+ * under DIR/<cpu>/<image hash>.trace so that an apprentice can replay
+ * one rather than take up the master again.
+ */
+#define CPU_ID_LEN 64
+
+/* Identify this CPU: the architecture and a hash of what
+ * /proc/cpuinfo says about it.
+ */
+void cpu_identity(char buf[CPU_ID_LEN]);
+
+/* The malloc'd path of the cached trace of the image with this hash
+ * from a master with this CPU
+ */
+char *trace_cache_path(const char *dir, const char *cpu,
+                       const uint8_t hash[HASH_LEN]);
+
+/* Look up or remember the CPU of the master at host:port. Lookup
+ * returns 0 if we know it.
+ */
+int trace_cache_host_cpu(const char *dir, const char *host, int port,
+                         char cpu[CPU_ID_LEN]);
+void trace_cache_set_host_cpu(const char *dir, const char *host, int port,
+                              const char *cpu);
+
+/* Live counters (stats.c, and risu-top to watch them): with --stats
+ * each session publishes these in a page of a shared file mapping.
+ * Every field is written by one thread only, with relaxed atomics.
+ */
+#define STATS_MAGIC 0x52495354      /* "RIST" */
+#define STATS_VERSION 1
+#define STATS_MAX_SESSIONS 64
+
+#define STATS_FREE 0
+#define STATS_CLAIMED 1             /* being set up */
+#define STATS_RUNNING 2
+#define STATS_FINISHED 3
+
+struct session_stats {
+    uint32_t state;
+    int32_t status;                 /* exit status, once finished */
+    int32_t pid;
+    uint32_t reserved;
+    char image[64];
+    uint64_t start_ns, end_ns;      /* CLOCK_MONOTONIC */
+    uint64_t last_checkpoint_ns;
+    uint64_t checkpoints;
+    uint64_t pc;                    /* image offset of the last one */
+    uint64_t bytes_sent, bytes_received;
+    uint64_t send_wait_ns;          /* in send_data_pkt() */
+    uint64_t trace_bytes;           /* written to traces, uncompressed */
+    uint64_t trace_file_bytes;      /* and what they took on disk */
+};
+
+struct stats_page {
+    uint32_t magic;
+    uint32_t version;
+    int32_t pid;
+    char role[20];                  /* "master", "apprentice"... */
+    struct session_stats sessions[STATS_MAX_SESSIONS];
+};
+
+/* Create the stats page at path; 0 for success */
+int stats_open(const char *path, const char *role);
+/* Claim a slot for the calling thread's session, and give it up */
+void stats_start_session(const char *image);
+void stats_end_session(int status);
+/* This thread's slot, or NULL */
+extern __thread struct session_stats *session_stats;
+void stats_add(uint64_t *counter, uint64_t n);
+void stats_checkpoint(uintptr_t pc);
+uint64_t stats_now(void);
+
+/* Watchdog (watchdog.c): with --timeout or --session-timeout a session
+ * which goes too long without a checkpoint, or runs too long in all,
+ * is stopped with a SIGALRM to its thread, and exits EXIT_TIMEOUT.
+ */
+#define EXIT_TIMEOUT 124            /* as timeout(1) */
+
+#define WATCHDOG_CHECKPOINT 1
+#define WATCHDOG_SESSION 2
+
+extern double checkpoint_timeout, session_timeout;
+
+/* Arm this thread's timers, with fn as the SIGALRM handler, at the
+ * start of a session; SIGALRM stays blocked until watchdog_run_image()
+ */
+void watchdog_start(void (*fn)(int, siginfo_t *, void *));
+void watchdog_run_image(void);
+void watchdog_stop(void);
+/* Wait for poll() events on a socket, letting the watchdog in: returns
+ * -1 if it ran out meanwhile. Only if watchdog_running(): else it
+ * returns at once, for the caller to block as usual.
+ */
+int watchdog_wait(int fd, int events);
+int watchdog_running(void);
+/* Is this thread in watchdog_wait()? */
+int watchdog_waiting(void);
+/* Which timer ran out this session, or 0 */
+int watchdog_timed_out(void);
+/* A checkpoint at this image offset: push the deadline back */
+void watchdog_kick(uintptr_t pc);
+/* Which timer a SIGALRM is from, or 0 if it isn't ours */
+int watchdog_expired(siginfo_t *si);
+void watchdog_report(int which, size_t checkpoints);
+
+/* The state of a session (the image, the memory block, the traces
+ * and sockets, and what has been compared so far) is per thread, so
+ * that one process can run several images at once.
+ */
+extern __thread uintptr_t image_start_address;
+extern __thread size_t image_size;
+extern __thread uint8_t image_hash[HASH_LEN];
+extern __thread void *memblock;
 
 extern int test_fp_exc;
 
-/* Ops code under test can request from risu: */
-#define OP_COMPARE 0
-#define OP_TESTEND 1
-#define OP_SETMEMBLOCK 2
-#define OP_GETMEMBLOCK 3
-#define OP_COMPAREMEM 4
+/* Set if we are talking to a live peer, so that a failing sparse
+ * region can be re-run at full density, and a fingerprint mismatch
+ * followed up with the full state.
+ */
+extern __thread int live_peer;
 
 /* The memory block should be this long */
 #define MEMBLOCKLEN 8192
 
-/* This is the data structure we pass over the socket for OP_COMPARE
- * and OP_TESTEND. It is a simplified and reduced subset of what can
+/* This is the data structure we compare for OP_COMPARE and
+ * OP_TESTEND. It is a simplified and reduced subset of what can
  * be obtained with a ucontext_t*, and is architecture specific
  * (defined in risu_reginfo_*.h).
  */
 struct reginfo;
 
-typedef struct {
-   uintptr_t pc;
-   uint32_t risu_op;
-} trace_header_t;
+/* On the wire and in traces a reginfo is packed as a series of
+ * blocks (struct reginfo_block, in risu_trace.h), padded to a multiple
+ * of 8 bytes and ending with a REGINFO_END block. So only the state
+ * the CPU actually has (eg the SVE registers at the current vector
+ * length) is sent, and a reader can find the end of a record without
+ * knowing anything about the arch.
+ */
+
+/* A block of state within a struct reginfo: count pieces of size
+ * bytes, stride bytes apart, which are packed one after another.
+ */
+struct reginfo_part {
+    uint32_t tag;
+    void *data;
+    size_t size;
+    int count;
+    size_t stride;
+};
+
+#define REGINFO_MAX_PARTS 8
+
+/* Room for the largest packed reginfo */
+#define REGINFO_MAX_PACKED \
+    (sizeof(struct reginfo) \
+     + (REGINFO_MAX_PARTS + 1) * (sizeof(struct reginfo_block) + 7))
+
+/* Where each block the arch packs goes in its struct reginfo: what
+ * reginfo_parts() would say, whichever blocks are there. Ends with a
+ * REGINFO_END entry.
+ */
+struct reginfo_block_layout {
+    uint32_t tag;
+    size_t offset;
+    int count;
+    size_t stride;
+};
+
+/* Pack a reginfo into buf, returning the length (reginfo_pack.c).
+ * The block headers, and the registers reginfo_fields[] lists of up
+ * to 8 bytes, are little-endian.
+ */
+size_t reginfo_pack(struct reginfo *ri, void *buf);
+/* Unpack a record of len bytes into ri. Returns 0 for success, or 1
+ * if it is malformed or doesn't have the blocks the core of it says
+ * it should (eg from a CPU with a different vector length).
+ */
+int reginfo_unpack(struct reginfo *ri, const void *buf, size_t len);
+
+/* trace_header_t is little-endian in traces and on the wire: convert
+ * one to or from the host's order (which is its own inverse).
+ */
+static inline void trace_header_le(trace_header_t *h)
+{
+    h->pc = htole64(h->pc);
+    h->risu_op = htole32(h->risu_op);
+    h->timestamp = htole64(h->timestamp);
+}
+
+/* This arch's trace file header and schema, for writing to a trace
+ * (malloc'd, little-endian)
+ */
+struct trace_file_header *trace_native_header(int fingerprint,
+                                              const uint8_t *image_hash);
+/* Is a trace being read one we can read as struct reginfo? If not,
+ * say why on stderr.
+ */
+int trace_is_native(trace_file *t, const char *name);
+
+/* Fingerprint mode (FINGERPRINT_*, in risu_trace.h) */
+extern __thread int fingerprint_mode;
+
+/* Reading the records of a trace of this arch (reginfo_pack.c) */
+
+/* How much data trace_read_record() reads into the payload for this
+ * op. Full reginfo records vary in length, so for them this is the
+ * size of the unpacked struct reginfo.
+ */
+size_t trace_payload_size(trace_file *t, int op);
+
+/* Read a header and its payload into a buffer big enough for either
+ * a reginfo or a memory block. Returns 0 for success, 1 at the end of
+ * the trace and -1 if it is truncated.
+ */
+int trace_read_record(trace_file *t, trace_header_t *header, void *payload);
 
 /* Functions operating on reginfo */
 
@@ -72,6 +397,20 @@ typedef int (*write_fn) (void *ptr, size_t bytes);
 typedef int (*read_fn) (void *ptr, size_t bytes);
 typedef void (*respond_fn) (int response);
 
+/* If set, the local state at each checkpoint is also written here,
+ * in trace format (--record).
+ */
+extern write_fn record_fn;
+
+/* If set, timestamp each checkpoint header (--timestamps) */
+extern int record_timestamps;
+
+/* Returned by send_register_info() and recv_and_compare_register_info()
+ * when the image itself is broken at the checkpoint (eg a bad
+ * OP_LOADSTATE table), which they have reported.
+ */
+#define BAD_IMAGE 3
+
 /* Send the register information from the struct ucontext down the socket.
  * Return the response code from the master.
  * NB: called from a signal handler.
@@ -85,6 +424,26 @@ int send_register_info(write_fn write_fn, void *uc);
 int recv_and_compare_register_info(read_fn read_fn,
                                    respond_fn respond, void *uc);
 
+/* --keep-going: rather than stopping at a mismatch, log it, bring the
+ * apprentice's state back into line with the master's (or the
+ * trace's) and carry on; report_match_status() then lists them all.
+ */
+extern int keep_going;
+
+/* Called on both sides after a checkpoint mismatch which isn't being
+ * re-run. A live master sends its state with write_fn and a live
+ * apprentice reads it with read_fn; replaying a trace, we take it from
+ * the trace. Returns 1 if we can carry on from the next insn.
+ * NB: called from a signal handler.
+ */
+int resync_after_mismatch(read_fn read_fn, write_fn write_fn, void *uc);
+
+/* Print the mismatches we carried on past, returning how many */
+int report_divergences(void);
+
+/* Free them, at the end of a session */
+void forget_divergences(void);
+
 /* Print a useful report on the status of the last comparison
  * done in recv_and_compare_register_info(). This is called on
  * exit, so need not restrict itself to signal-safe functions.
@@ -93,8 +452,65 @@ int recv_and_compare_register_info(read_fn read_fn,
  */
 int report_match_status(int trace);
 
+/* Did the last checkpoint compared end the test? */
+int reached_test_end(void);
+
+/* Benchmark blocks (bench.c). bench_op() handles an OP_BENCHSTART or
+ * OP_BENCHLOOP, going back to the start of the block until it has
+ * run the requested number of times, and report_bench() prints how
+ * fast each block ran.
+ * NB: bench_op() is called from a signal handler.
+ */
+void bench_op(int op, struct reginfo *ri, void *uc);
+void report_bench(void);
+
+/* Flight recorder (history.c): each side keeps its state at the last
+ * history_len checkpoints (--history) in a ring allocated when the
+ * session starts, and the comparing side the other side's state too,
+ * so that a mismatch can be reported with what led up to it.
+ */
+extern int history_len;
+
+/* Allocate this thread's ring, or free it */
+void history_start(void);
+void history_stop(void);
+/* Note our state at a checkpoint, and then the other side's for it.
+ * NB: called from a signal handler, and only copy the state.
+ */
+void history_add(int op, struct reginfo *ri);
+void history_theirs(struct reginfo *ri);
+/* Print the ring, oldest first: the first state in full and then what
+ * changed at each checkpoint, and where the other side differed.
+ * ours and theirs name the sides.
+ */
+void history_report(const char *ours, const char *theirs);
+
+/* Called on both sides after a checkpoint mismatch. If the master
+ * answered it with RESP_RERUN, turn the checkpoint slots since the
+ * last good checkpoint into compares and rewind the ucontext (and
+ * memory block) to that checkpoint so the region is re-run at full
+ * density. Returns 1 if we rewound.
+ * NB: called from a signal handler.
+ */
+int rerun_sparse_region(void *uc);
+
+/* Description of the contents of struct reginfo, for tools which look
+ * at individual registers. Each entry covers count consecutive
+ * registers of size bytes, called name0, name1... (or just name if
+ * count is 1). The table ends with a NULL name.
+ */
+struct reginfo_field {
+    const char *name;
+    size_t offset;
+    size_t size;
+    int count;
+};
+
 /* Interface provided by CPU-specific code: */
 
+extern const struct reginfo_field reginfo_fields[];
+extern const struct reginfo_block_layout reginfo_blocks[];
+
 /* Move the PC past this faulting insn by adjusting ucontext
  */
 void advance_pc(void *uc);
@@ -116,9 +532,38 @@ int get_risuop(struct reginfo *ri);
 /* Return the PC from a reginfo */
 uintptr_t get_pc(struct reginfo *ri);
 
+/* Turn the checkpoint slot (the no-op placeholder risugen emits in
+ * --compare-every mode) at addr into an OP_COMPARE risuop. Only
+ * called for the offsets in the image's slot table; returns 0 if the
+ * slot isn't there after all. vuc is the ucontext_t* at the failing
+ * checkpoint, for targets which need to know the current instruction
+ * set.
+ */
+int fill_checkpoint_slot(void *vuc, uintptr_t addr);
+
+/* Clear or normalise everything in a reginfo that reginfo_is_eq()
+ * ignores, so that two reginfos which compare equal become identical
+ * byte for byte and so hash the same.
+ */
+void reginfo_canonicalise(struct reginfo *ri);
+
+/* Describe the blocks of state present in ri, returning how many
+ * (at most REGINFO_MAX_PARTS). The first is the REGINFO_CORE block,
+ * whose layout is fixed; the rest may depend on its contents, such as
+ * a vector length.
+ */
+int reginfo_parts(struct reginfo *ri, struct reginfo_part *parts);
+
 /* initialize structure from a ucontext */
 void reginfo_init(struct reginfo *ri, ucontext_t *uc);
 
+/* Set the registers in a ucontext_t from a reginfo (including the PC).
+ * This is the inverse of reginfo_init(); anything which reginfo_init()
+ * masks out or fakes (like the stack pointer) is left untouched.
+ * vuc is a ucontext_t* cast to void*.
+ */
+void set_ucontext_reginfo(void *vuc, struct reginfo *ri);
+
 /* return 1 if structs are equal, 0 otherwise. */
 int reginfo_is_eq(struct reginfo *r1, struct reginfo *r2);
 
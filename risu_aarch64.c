@@ -45,3 +45,14 @@ uintptr_t get_pc(struct reginfo *ri)
 {
    return ri->pc;
 }
+
+int fill_checkpoint_slot(void *vuc, uintptr_t addr)
+{
+    uint32_t *p = (uint32_t *) addr;
+
+    if (*p != 0xd503201f) {             /* NOP */
+        return 0;
+    }
+    *p = 0x00005af0 | OP_COMPARE;
+    return 1;
+}
@@ -73,3 +73,26 @@ uintptr_t get_pc(struct reginfo *ri)
 {
    return ri->gpreg[15];
 }
+
+int fill_checkpoint_slot(void *vuc, uintptr_t addr)
+{
+    ucontext_t *uc = vuc;
+
+    /* A sparse region is always in the instruction set of the test
+     * code, which is the one we are in at the failing checkpoint.
+     */
+    if (uc->uc_mcontext.arm_cpsr & 0x20) {
+        uint16_t *p = (uint16_t *) addr;
+        if (*p != 0xbf00) {             /* NOP */
+            return 0;
+        }
+        *p = 0xdee0 | OP_COMPARE;
+    } else {
+        uint32_t *p = (uint32_t *) addr;
+        if (*p != 0xe320f000) {         /* NOP */
+            return 0;
+        }
+        *p = 0xe7fe5af0 | OP_COMPARE;
+    }
+    return 1;
+}
@@ -0,0 +1,215 @@
+/*******************************************************************************
+ * Copyright (c) 2017 Linaro Limited
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ ******************************************************************************/
+
+/* risu-diff: compare two trace files checkpoint by checkpoint, eg
+ * ones recorded by two different QEMUs with --record. The traces are
+ * streamed, so memory use doesn't depend on their size.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "risu.h"
+
+/* Needed by the per-arch reginfo code we link against */
+__thread uintptr_t image_start_address;
+__thread void *memblock;
+int test_fp_exc;
+
+/* From --image, to name the pattern at each differing checkpoint */
+__thread struct image_meta image_meta;
+
+union payload {
+    struct reginfo ri;
+    uint8_t mem[MEMBLOCKLEN];
+};
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: risu-diff [options] <trace A> <trace B>\n\n");
+    fprintf(stderr, "Compare two risu traces checkpoint by checkpoint.\n\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr,
+            "  -n, --max-diffs=N Stop after N differing checkpoints "
+            "(default 10,\n"
+            "                    0 for no limit)\n");
+    fprintf(stderr,
+            "  --test-fp-exc     Compare FP exception status bits too\n");
+    fprintf(stderr,
+            "  --image=FILE      Image container (risugen --container) the "
+            "traces are of,\n"
+            "                    to say which pattern each difference is "
+            "in\n");
+}
+
+static void read_image(const char *name)
+{
+    int fd = open(name, O_RDONLY);
+
+    if (fd < 0) {
+        perror(name);
+        exit(2);
+    }
+    if (image_read_meta(fd, &image_meta) != 0) {
+        fprintf(stderr, "%s is not a valid image container\n", name);
+        exit(2);
+    }
+    close(fd);
+}
+
+static void report_pattern(uintptr_t pc)
+{
+    const char *pattern = image_pattern_at(&image_meta, pc);
+
+    if (pattern) {
+        fprintf(stderr, "  after test insn of pattern %s\n", pattern);
+    }
+}
+
+static trace_file *open_or_die(const char *name)
+{
+    trace_file *t = trace_open(name, 0);
+    if (!t) {
+        perror(name);
+        exit(2);
+    }
+    /* so the two traces are decompressed in parallel */
+    trace_start_reader(t);
+    if (!trace_is_native(t, name)) {
+        exit(2);
+    }
+    return t;
+}
+
+int main(int argc, char **argv)
+{
+    static union payload pa, pb;
+    trace_header_t ha, hb;
+    trace_file *ta, *tb;
+    size_t checkpoints = 0, diffs = 0, max_diffs = 10;
+    int ra, rb, ret = 0, fp;
+
+    for (;;) {
+        static struct option longopts[] = {
+            {"help", no_argument, 0, '?'},
+            {"max-diffs", required_argument, 0, 'n'},
+            {"test-fp-exc", no_argument, &test_fp_exc, 1},
+            {"image", required_argument, 0, 'i'},
+            {0, 0, 0, 0}
+        };
+        int optidx = 0;
+        int c = getopt_long(argc, argv, "n:", longopts, &optidx);
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 0:
+            break;
+        case 'n':
+            max_diffs = strtoul(optarg, 0, 10);
+            break;
+        case 'i':
+            read_image(optarg);
+            break;
+        case '?':
+            usage();
+            exit(2);
+        default:
+            abort();
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage();
+        exit(2);
+    }
+    ta = open_or_die(argv[optind]);
+    tb = open_or_die(argv[optind + 1]);
+    fp = trace_fingerprint_mode(ta);
+    if (trace_fingerprint_mode(tb) != fp) {
+        fprintf(stderr, "traces were recorded in different fingerprint "
+                "modes\n");
+        return 2;
+    }
+
+    for (;;) {
+        ra = trace_read_record(ta, &ha, &pa);
+        rb = trace_read_record(tb, &hb, &pb);
+        if (ra < 0 || rb < 0) {
+            fprintf(stderr, "trace %s is truncated\n",
+                    argv[optind + (ra < 0 ? 0 : 1)]);
+            ret = 2;
+            break;
+        }
+        if (ra || rb) {
+            if (!ra || !rb) {
+                fprintf(stderr, "trace %s ends after %zd checkpoints\n",
+                        argv[optind + (ra ? 0 : 1)], checkpoints);
+                ret = 1;
+            }
+            break;
+        }
+
+        if (ha.pc != hb.pc || ha.risu_op != hb.risu_op) {
+            fprintf(stderr, "checkpoint %zd: traces out of sync "
+                    "(A at 0x%" PRIx64 " op %d, B at 0x%" PRIx64
+                    " op %d)\n", checkpoints, ha.pc, (int32_t)ha.risu_op,
+                    hb.pc, (int32_t)hb.risu_op);
+            ret = 1;
+            break;
+        }
+
+        if (fp) {
+            /* fingerprint traces: all we can say is whether they match */
+            if (trace_payload_size(ta, ha.risu_op)
+                && memcmp(&pa, &pb, HASH_LEN) != 0) {
+                fprintf(stderr, "checkpoint %zd (image offset 0x%" PRIx64
+                        "): %s differ\n", checkpoints, ha.pc,
+                        fp == FINGERPRINT_CHAIN ? "hash chains"
+                                                : "fingerprints");
+                report_pattern(ha.pc);
+                diffs++;
+            }
+        } else if (ha.risu_op == OP_COMPAREMEM) {
+            if (memcmp(pa.mem, pb.mem, MEMBLOCKLEN) != 0) {
+                fprintf(stderr, "checkpoint %zd (image offset 0x%" PRIx64
+                        "): memory differs\n", checkpoints, ha.pc);
+                report_pattern(ha.pc);
+                diffs++;
+            }
+        } else if (trace_payload_size(ta, ha.risu_op)) {
+            if (!reginfo_is_eq(&pa.ri, &pb.ri)) {
+                fprintf(stderr, "checkpoint %zd (image offset 0x%" PRIx64
+                        "): registers differ\n", checkpoints, ha.pc);
+                report_pattern(ha.pc);
+                reginfo_dump_mismatch(&pa.ri, &pb.ri, stderr);
+                diffs++;
+            }
+        }
+        checkpoints++;
+
+        if (max_diffs && diffs >= max_diffs) {
+            fprintf(stderr, "stopping after %zd differences\n", diffs);
+            break;
+        }
+    }
+
+    fprintf(stderr, "%zd checkpoints compared, %zd differ\n",
+            checkpoints, diffs);
+    trace_close(ta);
+    trace_close(tb);
+    if (diffs && !ret) {
+        ret = 1;
+    }
+    return ret;
+}
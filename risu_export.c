@@ -0,0 +1,519 @@
+/*******************************************************************************
+ * Copyright (c) 2017 Linaro Limited
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ ******************************************************************************/
+
+/* risu-export: turn traces into columns, so that a question about one
+ * register only has to read that register. Each trace becomes a
+ * directory holding an index and a file per column: the checkpoint
+ * number, pc and op, a hash of the memory block at each COMPAREMEM,
+ * and one column per register (each element of each field in the
+ * trace's schema). Rows without registers (or memory) hold zeros
+ * there. Traces are read with the decoder, so they can be from any
+ * arch.
+ *
+ * The index is text:
+ *   RISU-COLUMNS 1
+ *   arch <arch>
+ *   rows <n>
+ *   column <name> <bytes per value>     (one line for each)
+ * A column file is COLUMN_MAGIC, then blocks of up to BLOCK_ROWS
+ * little-endian values: a struct column_block and the block's data
+ * (in host order). The data is
+ * the values byte-shuffled (the first byte of every value, then the
+ * second...), which makes registers whose high bytes rarely change
+ * compress much better, and then deflated if we have zlib.
+ *
+ * Traces are exported in parallel by a pool of worker threads, each
+ * streaming one trace at a time.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "config.h"
+
+#include "risu.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/* Needed by the per-arch reginfo code we link against */
+__thread uintptr_t image_start_address;
+__thread void *memblock;
+int test_fp_exc;
+
+#define COLUMNS_MAGIC "RISU-COLUMNS"
+#define COLUMNS_VERSION 1
+#define COLUMN_MAGIC "RISUCOL1"
+#define BLOCK_ROWS 4096
+
+#define CODEC_RAW 0
+#define CODEC_DEFLATE 1
+
+struct column_block {
+    uint32_t rows;
+    uint32_t codec;
+    uint32_t len;           /* of the data which follows */
+    uint32_t reserved;
+};
+
+/* The columns: the fixed ones, then the registers */
+enum { COL_CHECKPOINT, COL_PC, COL_OP, COL_MEM, NFIXED };
+
+struct column {
+    char name[32];
+    size_t offset, size;    /* of a register in the trace's reginfo */
+};
+
+static char **jobs;
+static int njobs;
+static int next_job;
+static const char *outdir;
+static int failed;
+
+/* One trace being exported */
+struct export {
+    struct column *columns;
+    int ncolumns;
+    FILE **files;
+    uint8_t **bufs;         /* this block's values, per column */
+    uint8_t *shuffled, *packed;
+    size_t packed_size;
+    uint32_t rows;          /* in this block */
+    uint64_t total;
+};
+
+static void add_column(struct export *e, const char *name, size_t offset,
+                       size_t size)
+{
+    struct column *c;
+
+    e->columns = realloc(e->columns, (e->ncolumns + 1) * sizeof(*c));
+    c = &e->columns[e->ncolumns++];
+    snprintf(c->name, sizeof(c->name), "%s", name);
+    c->offset = offset;
+    c->size = size;
+}
+
+static void build_columns(struct export *e, trace_decoder *d)
+{
+    const struct trace_schema_field *f = trace_decoder_fields(d);
+    uint32_t n = trace_decoder_header(d)->nfields, i, j;
+    char name[32];
+
+    add_column(e, "checkpoint", 0, sizeof(uint64_t));
+    add_column(e, "pc", 0, sizeof(uint64_t));
+    add_column(e, "op", 0, sizeof(uint32_t));
+    add_column(e, "mem", 0, HASH_LEN);
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < f[i].count; j++) {
+            if (f[i].count == 1) {
+                snprintf(name, sizeof(name), "%s", f[i].name);
+            } else {
+                snprintf(name, sizeof(name), "%s%u", f[i].name, j);
+            }
+            add_column(e, name, f[i].offset + j * f[i].size, f[i].size);
+        }
+    }
+}
+
+static void shuffle(uint8_t *out, const uint8_t *in, size_t rows,
+                    size_t size)
+{
+    size_t i, j;
+
+    for (i = 0; i < rows; i++) {
+        for (j = 0; j < size; j++) {
+            out[j * rows + i] = in[i * size + j];
+        }
+    }
+}
+
+static void unshuffle(uint8_t *out, const uint8_t *in, size_t rows,
+                      size_t size)
+{
+    size_t i, j;
+
+    for (i = 0; i < rows; i++) {
+        for (j = 0; j < size; j++) {
+            out[i * size + j] = in[j * rows + i];
+        }
+    }
+}
+
+static int flush_block(struct export *e)
+{
+    struct column_block b;
+    int i;
+
+    if (!e->rows) {
+        return 0;
+    }
+    for (i = 0; i < e->ncolumns; i++) {
+        size_t len = e->rows * e->columns[i].size;
+        uint8_t *data = e->shuffled;
+
+        shuffle(e->shuffled, e->bufs[i], e->rows, e->columns[i].size);
+        memset(&b, 0, sizeof(b));
+        b.rows = e->rows;
+        b.codec = CODEC_RAW;
+        b.len = len;
+#ifdef HAVE_ZLIB
+        uLongf clen = e->packed_size;
+        if (compress2(e->packed, &clen, e->shuffled, len, 6) == Z_OK
+            && clen < len) {
+            b.codec = CODEC_DEFLATE;
+            b.len = clen;
+            data = e->packed;
+        }
+#endif
+        if (fwrite(&b, sizeof(b), 1, e->files[i]) != 1
+            || fwrite(data, b.len, 1, e->files[i]) != 1) {
+            return -1;
+        }
+    }
+    e->rows = 0;
+    return 0;
+}
+
+static void add_row(struct export *e, const struct trace_record *rec)
+{
+    uint64_t checkpoint = htole64(e->total++), pc = htole64(rec->pc);
+    uint32_t op = htole32(rec->op);
+    uint32_t row = e->rows++;
+    int i;
+
+    memcpy(e->bufs[COL_CHECKPOINT] + row * 8, &checkpoint, 8);
+    memcpy(e->bufs[COL_PC] + row * 8, &pc, 8);
+    memcpy(e->bufs[COL_OP] + row * 4, &op, 4);
+    memset(e->bufs[COL_MEM] + row * HASH_LEN, 0, HASH_LEN);
+    for (i = NFIXED; i < e->ncolumns; i++) {
+        struct column *c = &e->columns[i];
+
+        if (rec->regs) {
+            memcpy(e->bufs[i] + row * c->size, rec->regs + c->offset,
+                   c->size);
+        } else {
+            memset(e->bufs[i] + row * c->size, 0, c->size);
+        }
+    }
+    if (rec->op == OP_COMPAREMEM && rec->data) {
+        hash_buffer(rec->data, rec->len, e->bufs[COL_MEM] + row * HASH_LEN);
+    }
+}
+
+static int write_index(struct export *e, const char *dir, const char *arch)
+{
+    char *path;
+    FILE *f;
+    int i;
+
+    if (asprintf(&path, "%s/index", dir) < 0 || !(f = fopen(path, "w"))) {
+        return -1;
+    }
+    fprintf(f, COLUMNS_MAGIC " %d\n", COLUMNS_VERSION);
+    fprintf(f, "arch %s\n", arch);
+    fprintf(f, "rows %" PRIu64 "\n", e->total);
+    for (i = 0; i < e->ncolumns; i++) {
+        fprintf(f, "column %s %zu\n", e->columns[i].name,
+                e->columns[i].size);
+    }
+    free(path);
+    return fclose(f) != 0 ? -1 : 0;
+}
+
+/* Export one trace to outdir/<its file name> */
+static int export_trace(const char *name)
+{
+    const char *base = strrchr(name, '/');
+    struct trace_record rec;
+    struct export e;
+    size_t max_size = 0;
+    char *dir, *path;
+    trace_decoder *d;
+    int i, r = 0;
+
+    d = trace_decoder_open(name);
+    if (!d) {
+        return -1;
+    }
+    if (trace_decoder_header(d)->fingerprint) {
+        fprintf(stderr, "%s: fingerprint trace, no registers to export\n",
+                name);
+        trace_decoder_close(d);
+        return -1;
+    }
+    if (asprintf(&dir, "%s/%s", outdir, base ? base + 1 : name) < 0) {
+        abort();
+    }
+    mkdir(dir, 0777);
+
+    memset(&e, 0, sizeof(e));
+    build_columns(&e, d);
+    e.files = calloc(e.ncolumns, sizeof(FILE *));
+    e.bufs = calloc(e.ncolumns, sizeof(uint8_t *));
+    for (i = 0; i < e.ncolumns; i++) {
+        if (e.columns[i].size > max_size) {
+            max_size = e.columns[i].size;
+        }
+        e.bufs[i] = malloc(BLOCK_ROWS * e.columns[i].size);
+        if (asprintf(&path, "%s/%s", dir, e.columns[i].name) < 0) {
+            abort();
+        }
+        e.files[i] = fopen(path, "w");
+        if (!e.files[i]) {
+            perror(path);
+            r = -1;
+        } else {
+            fwrite(COLUMN_MAGIC, 8, 1, e.files[i]);
+        }
+        free(path);
+    }
+    e.shuffled = malloc(BLOCK_ROWS * max_size);
+#ifdef HAVE_ZLIB
+    e.packed_size = compressBound(BLOCK_ROWS * max_size);
+    e.packed = malloc(e.packed_size);
+#endif
+
+    while (r == 0) {
+        int got = trace_decoder_next(d, &rec);
+
+        if (got) {
+            if (got < 0) {
+                fprintf(stderr, "%s: truncated after %" PRIu64
+                        " checkpoints\n", name, e.total);
+            }
+            break;
+        }
+        add_row(&e, &rec);
+        if (e.rows == BLOCK_ROWS) {
+            r = flush_block(&e);
+        }
+    }
+    if (r == 0) {
+        r = flush_block(&e);
+    }
+    for (i = 0; i < e.ncolumns; i++) {
+        if (e.files[i] && fclose(e.files[i]) != 0) {
+            r = -1;
+        }
+        free(e.bufs[i]);
+    }
+    if (r == 0) {
+        r = write_index(&e, dir, trace_decoder_header(d)->arch);
+    }
+    if (r == 0) {
+        fprintf(stderr, "%s: %" PRIu64 " checkpoints to %s\n",
+                name, e.total, dir);
+    } else {
+        fprintf(stderr, "%s: export to %s failed\n", name, dir);
+    }
+
+    trace_decoder_close(d);
+    free(e.columns);
+    free(e.files);
+    free(e.bufs);
+    free(e.shuffled);
+    free(e.packed);
+    free(dir);
+    return r;
+}
+
+static void *worker(void *opaque)
+{
+    for (;;) {
+        int j = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED);
+        if (j >= njobs) {
+            break;
+        }
+        if (export_trace(jobs[j]) != 0) {
+            __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+/* Print one column of an export, a value per line in hex, most
+ * significant byte first
+ */
+static int cat_column(const char *dir, const char *name)
+{
+    struct column_block b;
+    char magic[8], *path, line[128], col[32];
+    uint8_t *data = NULL, *values = NULL;
+    uint64_t row = 0;
+    size_t size = 0, s, i, j;
+    FILE *f;
+
+    if (asprintf(&path, "%s/index", dir) < 0 || !(f = fopen(path, "r"))) {
+        perror(dir);
+        return 1;
+    }
+    free(path);
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "column %31s %zu", col, &s) == 2
+            && strcmp(col, name) == 0) {
+            size = s;
+        }
+    }
+    fclose(f);
+    if (!size || strchr(name, '/')) {
+        fprintf(stderr, "no column %s in %s\n", name, dir);
+        return 1;
+    }
+
+    if (asprintf(&path, "%s/%s", dir, name) < 0 || !(f = fopen(path, "r"))
+        || fread(magic, 8, 1, f) != 1 || memcmp(magic, COLUMN_MAGIC, 8)) {
+        fprintf(stderr, "%s/%s is not a column\n", dir, name);
+        return 1;
+    }
+    free(path);
+    while (fread(&b, sizeof(b), 1, f) == 1) {
+        size_t len = b.rows * size;
+
+        if (b.rows > BLOCK_ROWS || b.len > len) {
+            goto bad;
+        }
+        data = realloc(data, b.len);
+        values = realloc(values, 2 * len);
+        if (fread(data, b.len, 1, f) != 1) {
+            goto bad;
+        }
+        if (b.codec == CODEC_RAW && b.len == len) {
+            memcpy(values + len, data, len);
+#ifdef HAVE_ZLIB
+        } else if (b.codec == CODEC_DEFLATE) {
+            uLongf out = len;
+            if (uncompress(values + len, &out, data, b.len) != Z_OK
+                || out != len) {
+                goto bad;
+            }
+#endif
+        } else {
+            goto bad;
+        }
+        unshuffle(values, values + len, b.rows, size);
+        for (i = 0; i < b.rows; i++, row++) {
+            printf("%" PRIu64 " ", row);
+            for (j = 0; j < size; j++) {
+                printf("%02x", values[i * size + size - 1 - j]);
+            }
+            printf("\n");
+        }
+    }
+    fclose(f);
+    free(data);
+    free(values);
+    return 0;
+
+ bad:
+    fprintf(stderr, "%s/%s is corrupt at row %" PRIu64 "\n", dir, name, row);
+    fclose(f);
+    free(data);
+    free(values);
+    return 1;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: risu-export [options] -o <dir> <trace>...\n"
+            "       risu-export --cat <export dir> <column>\n\n");
+    fprintf(stderr, "Export risu traces as a column per register, for "
+            "fast queries\n"
+            "over one register. Each trace goes to a directory of its own "
+            "in <dir>.\n\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr,
+            "  -o, --output=DIR  Where to put the exports\n");
+    fprintf(stderr,
+            "  -j, --jobs=N      Use N worker threads (default: number of "
+            "CPUs)\n");
+    fprintf(stderr,
+            "  --cat             Print a column of an export, a row per "
+            "line\n");
+}
+
+int main(int argc, char **argv)
+{
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int cat = 0, i;
+    pthread_t *threads;
+
+    for (;;) {
+        static struct option longopts[] = {
+            {"help", no_argument, 0, '?'},
+            {"output", required_argument, 0, 'o'},
+            {"jobs", required_argument, 0, 'j'},
+            {"cat", no_argument, 0, 'c'},
+            {0, 0, 0, 0}
+        };
+        int optidx = 0;
+        int c = getopt_long(argc, argv, "o:j:", longopts, &optidx);
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 0:
+            break;
+        case 'o':
+            outdir = optarg;
+            break;
+        case 'j':
+            nthreads = strtol(optarg, 0, 10);
+            break;
+        case 'c':
+            cat = 1;
+            break;
+        case '?':
+            usage();
+            exit(1);
+        default:
+            abort();
+        }
+    }
+
+    if (cat) {
+        if (argc - optind != 2) {
+            usage();
+            exit(1);
+        }
+        return cat_column(argv[optind], argv[optind + 1]);
+    }
+
+    jobs = argv + optind;
+    njobs = argc - optind;
+    if (!njobs || !outdir) {
+        usage();
+        exit(1);
+    }
+    if (nthreads > njobs) {
+        nthreads = njobs;
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    mkdir(outdir, 0777);
+
+    threads = calloc(nthreads, sizeof(pthread_t));
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return failed;
+}
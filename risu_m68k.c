@@ -36,5 +36,18 @@ int get_risuop(struct reginfo *ri)
 
 uintptr_t get_pc(struct reginfo *ri)
 {
-    return ri->gregs[R_PC];
+    return ri->pc;
+}
+
+int fill_checkpoint_slot(void *vuc, uintptr_t addr)
+{
+    uint16_t *p = (uint16_t *) addr;
+
+    /* A slot is a pair of NOPs, the same size as the risuop */
+    if (p[0] != 0x4e71 || p[1] != 0x4e71) {
+        return 0;
+    }
+    p[0] = 0x4afc;
+    p[1] = 0x7000 | OP_COMPARE;
+    return 1;
 }
@@ -43,3 +43,14 @@ uintptr_t get_pc(struct reginfo *ri)
 {
    return ri->nip;
 }
+
+int fill_checkpoint_slot(void *vuc, uintptr_t addr)
+{
+    uint32_t *p = (uint32_t *) addr;
+
+    if (*p != 0x60000000) {             /* nop */
+        return 0;
+    }
+    *p = 0x00005af0 | OP_COMPARE;
+    return 1;
+}
@@ -11,18 +11,128 @@
  *****************************************************************************/
 
 #include <stdio.h>
+#include <stddef.h>
 #include <ucontext.h>
 #include <string.h>
 
 #include "risu.h"
 #include "risu_reginfo_aarch64.h"
 
+const struct reginfo_field reginfo_fields[] = {
+    { "insn", offsetof(struct reginfo, faulting_insn), 4, 1 },
+    { "x", offsetof(struct reginfo, regs), 8, 31 },
+    { "sp", offsetof(struct reginfo, sp), 8, 1 },
+    { "pc", offsetof(struct reginfo, pc), 8, 1 },
+    { "flags", offsetof(struct reginfo, flags), 4, 1 },
+    { "fpsr", offsetof(struct reginfo, fpsr), 4, 1 },
+    { "fpcr", offsetof(struct reginfo, fpcr), 4, 1 },
+    { "v", offsetof(struct reginfo, vregs), 16, 32 },
+    { "z", offsetof(struct reginfo, zregs), RISU_SVE_VQ_MAX * 16, 32 },
+    { "p", offsetof(struct reginfo, pregs), RISU_SVE_VQ_MAX * 2, 16 },
+    { "ffr", offsetof(struct reginfo, pregs[16]), RISU_SVE_VQ_MAX * 2, 1 },
+    { NULL }
+};
+
+/* Packed block tags */
+#define REGINFO_FPSIMD 16
+#define REGINFO_SVE_Z 17
+#define REGINFO_SVE_P 18        /* and FFR */
+
+const struct reginfo_block_layout reginfo_blocks[] = {
+    { REGINFO_CORE, 0, 1, 0 },
+    { REGINFO_FPSIMD, offsetof(struct reginfo, vregs), 1, 0 },
+    { REGINFO_SVE_Z, offsetof(struct reginfo, zregs), 32,
+      sizeof(((struct reginfo *)0)->zregs[0]) },
+    { REGINFO_SVE_P, offsetof(struct reginfo, pregs), 17,
+      sizeof(((struct reginfo *)0)->pregs[0]) },
+    { REGINFO_END }
+};
+
+int reginfo_parts(struct reginfo *ri, struct reginfo_part *parts)
+{
+    int n = 0;
+
+    parts[n++] = (struct reginfo_part) {
+        REGINFO_CORE, ri, offsetof(struct reginfo, vregs), 1, 0
+    };
+    if (!ri->sve_vl) {
+        parts[n++] = (struct reginfo_part) {
+            REGINFO_FPSIMD, ri->vregs, sizeof(ri->vregs), 1, 0
+        };
+        return n;
+    }
+    parts[n++] = (struct reginfo_part) {
+        REGINFO_SVE_Z, ri->zregs, ri->sve_vl, 32, sizeof(ri->zregs[0])
+    };
+    parts[n++] = (struct reginfo_part) {
+        REGINFO_SVE_P, ri->pregs, ri->sve_vl / 8, 17, sizeof(ri->pregs[0])
+    };
+    return n;
+}
+
+/* Find the record with this magic in the signal frame, or NULL.
+ * Records which don't fit in __reserved (like SVE state with a long
+ * vector length) are in the area an EXTRA_MAGIC record points to.
+ */
+static struct _aarch64_ctx *find_record(ucontext_t *uc, uint32_t magic)
+{
+    struct _aarch64_ctx *ctx;
+
+    ctx = (struct _aarch64_ctx *) &uc->uc_mcontext.__reserved[0];
+
+    while (ctx->magic != magic && ctx->size != 0) {
+#ifdef EXTRA_MAGIC
+        if (ctx->magic == EXTRA_MAGIC) {
+            struct extra_context *extra = (struct extra_context *) ctx;
+            ctx = (struct _aarch64_ctx *) (uintptr_t) extra->datap;
+            continue;
+        }
+#endif
+        ctx += (ctx->size + sizeof(*ctx) - 1) / sizeof(*ctx);
+    }
+
+    return ctx->magic == magic ? ctx : NULL;
+}
+
+/* Find the FP/SIMD record in the signal frame, or NULL */
+static struct fpsimd_context *find_fpsimd_context(ucontext_t *uc)
+{
+    struct _aarch64_ctx *ctx = find_record(uc, FPSIMD_MAGIC);
+
+    if (!ctx || ctx->size != sizeof(struct fpsimd_context)) {
+        return NULL;
+    }
+    return (struct fpsimd_context *) ctx;
+}
+
+#ifdef SVE_MAGIC
+/* Find the SVE record in the signal frame, or NULL if there isn't one
+ * or its vector length is longer than we handle. It only has the
+ * register contents if the size says so; otherwise the task hasn't
+ * used SVE yet, and they are the FP/SIMD registers zero extended.
+ */
+static struct sve_context *find_sve_context(ucontext_t *uc, int *has_regs)
+{
+    struct sve_context *sve;
+
+    sve = (struct sve_context *) find_record(uc, SVE_MAGIC);
+    if (!sve || sve->vl > RISU_SVE_VQ_MAX * 16) {
+        return NULL;
+    }
+    *has_regs = sve->head.size >= SVE_SIG_CONTEXT_SIZE(sve->vl / 16);
+    return sve;
+}
+#endif
+
 /* reginfo_init: initialize with a ucontext */
 void reginfo_init(struct reginfo *ri, ucontext_t *uc)
 {
     int i;
-    struct _aarch64_ctx *ctx;
     struct fpsimd_context *fp;
+#ifdef SVE_MAGIC
+    struct sve_context *sve;
+    int has_regs;
+#endif
     /* necessary to be able to compare with memcmp later */
     memset(ri, 0, sizeof(*ri));
 
@@ -37,33 +147,136 @@ void reginfo_init(struct reginfo *ri, ucontext_t *uc)
     ri->fault_address = uc->uc_mcontext.fault_address;
     ri->faulting_insn = *((uint32_t *) uc->uc_mcontext.pc);
 
-    ctx = (struct _aarch64_ctx *) &uc->uc_mcontext.__reserved[0];
-
-    while (ctx->magic != FPSIMD_MAGIC && ctx->size != 0) {
-        ctx += (ctx->size + sizeof(*ctx) - 1) / sizeof(*ctx);
-    }
-
-    if (ctx->magic != FPSIMD_MAGIC || ctx->size != sizeof(*fp)) {
+    fp = find_fpsimd_context(uc);
+    if (!fp) {
         fprintf(stderr,
                 "risu_reginfo_aarch64: failed to get FP/SIMD state\n");
         return;
     }
 
-    fp = (struct fpsimd_context *) ctx;
     ri->fpsr = fp->fpsr;
     ri->fpcr = fp->fpcr;
 
+#ifdef SVE_MAGIC
+    sve = find_sve_context(uc, &has_regs);
+    if (sve) {
+        int vq = sve->vl / 16;
+        uint8_t *base = (uint8_t *) sve;
+
+        ri->sve_vl = sve->vl;
+        for (i = 0; i < 32; i++) {
+            if (has_regs) {
+                memcpy(ri->zregs[i], base + SVE_SIG_ZREG_OFFSET(vq, i),
+                       SVE_SIG_ZREG_SIZE(vq));
+            } else {
+                memcpy(ri->zregs[i], &fp->vregs[i], 16);
+            }
+        }
+        if (has_regs) {
+            for (i = 0; i < 16; i++) {
+                memcpy(ri->pregs[i], base + SVE_SIG_PREG_OFFSET(vq, i),
+                       SVE_SIG_PREG_SIZE(vq));
+            }
+            memcpy(ri->pregs[16], base + SVE_SIG_FFR_OFFSET(vq),
+                   SVE_SIG_FFR_SIZE(vq));
+        }
+        return;
+    }
+#endif
+
     for (i = 0; i < 32; i++) {
         ri->vregs[i] = fp->vregs[i];
     }
 };
 
+/* set_ucontext_reginfo: write the reginfo state back into a ucontext */
+void set_ucontext_reginfo(void *vuc, struct reginfo *ri)
+{
+    ucontext_t *uc = vuc;
+    struct fpsimd_context *fp;
+    int i;
+#ifdef SVE_MAGIC
+    int has_regs;
+#endif
+
+    for (i = 0; i < 31; i++) {
+        uc->uc_mcontext.regs[i] = ri->regs[i];
+    }
+    uc->uc_mcontext.pc = image_start_address + ri->pc;
+    uc->uc_mcontext.pstate =
+        (uc->uc_mcontext.pstate & ~0xf0000000) | ri->flags;
+
+    fp = find_fpsimd_context(uc);
+    if (!fp) {
+        return;
+    }
+    fp->fpsr = ri->fpsr;
+    fp->fpcr = ri->fpcr;
+
+#ifdef SVE_MAGIC
+    if (ri->sve_vl) {
+        struct sve_context *sve = find_sve_context(uc, &has_regs);
+        int vq = ri->sve_vl / 16;
+        uint8_t *base = (uint8_t *) sve;
+
+        for (i = 0; i < 32; i++) {
+            memcpy(&fp->vregs[i], ri->zregs[i], 16);
+        }
+        if (!sve || !has_regs) {
+            return;
+        }
+        for (i = 0; i < 32; i++) {
+            memcpy(base + SVE_SIG_ZREG_OFFSET(vq, i), ri->zregs[i],
+                   SVE_SIG_ZREG_SIZE(vq));
+        }
+        for (i = 0; i < 16; i++) {
+            memcpy(base + SVE_SIG_PREG_OFFSET(vq, i), ri->pregs[i],
+                   SVE_SIG_PREG_SIZE(vq));
+        }
+        memcpy(base + SVE_SIG_FFR_OFFSET(vq), ri->pregs[16],
+               SVE_SIG_FFR_SIZE(vq));
+        return;
+    }
+#endif
+
+    for (i = 0; i < 32; i++) {
+        fp->vregs[i] = ri->vregs[i];
+    }
+}
+
 /* reginfo_is_eq: compare the reginfo structs, returns nonzero if equal */
 int reginfo_is_eq(struct reginfo *r1, struct reginfo *r2)
 {
     return memcmp(r1, r2, sizeof(*r1)) == 0;
 }
 
+/* reginfo_canonicalise: reginfo_is_eq() compares everything, so there
+ * is nothing to do
+ */
+void reginfo_canonicalise(struct reginfo *ri)
+{
+}
+
+/* Print an SVE register of len bytes, most significant byte first */
+static void dump_sve_reg(FILE *f, const void *reg, int len)
+{
+    const uint8_t *p = reg;
+
+    while (len--) {
+        fprintf(f, "%02x", p[len]);
+    }
+}
+
+/* Print the name of predicate register i, where 16 is FFR */
+static void dump_sve_name(FILE *f, int i)
+{
+    if (i < 16) {
+        fprintf(f, "  P%-2d   : ", i);
+    } else {
+        fprintf(f, "  FFR   : ");
+    }
+}
+
 /* reginfo_dump: print state to a stream, returns nonzero on success */
 int reginfo_dump(struct reginfo *ri, FILE * f)
 {
@@ -80,6 +293,21 @@ int reginfo_dump(struct reginfo *ri, FILE * f)
     fprintf(f, "  fpsr  : %08x\n", ri->fpsr);
     fprintf(f, "  fpcr  : %08x\n", ri->fpcr);
 
+    if (ri->sve_vl) {
+        fprintf(f, "  vl    : %d\n", ri->sve_vl);
+        for (i = 0; i < 32; i++) {
+            fprintf(f, "  Z%-2d   : ", i);
+            dump_sve_reg(f, ri->zregs[i], ri->sve_vl);
+            fprintf(f, "\n");
+        }
+        for (i = 0; i < 17; i++) {
+            dump_sve_name(f, i);
+            dump_sve_reg(f, ri->pregs[i], ri->sve_vl / 8);
+            fprintf(f, "\n");
+        }
+        return !ferror(f);
+    }
+
     for (i = 0; i < 32; i++) {
         fprintf(f, "  V%2d   : %016" PRIx64 "%016" PRIx64 "\n", i,
                 (uint64_t) (ri->vregs[i] >> 64),
@@ -127,6 +355,30 @@ int reginfo_dump_mismatch(struct reginfo *m, struct reginfo *a, FILE * f)
         fprintf(f, "  fpcr  : %08x vs %08x\n", m->fpcr, a->fpcr);
     }
 
+    if (m->sve_vl != a->sve_vl) {
+        fprintf(f, "  vl    : %d vs %d\n", m->sve_vl, a->sve_vl);
+    }
+    if (m->sve_vl && m->sve_vl == a->sve_vl) {
+        for (i = 0; i < 32; i++) {
+            if (memcmp(m->zregs[i], a->zregs[i], m->sve_vl)) {
+                fprintf(f, "  Z%-2d   : ", i);
+                dump_sve_reg(f, m->zregs[i], m->sve_vl);
+                fprintf(f, " vs\n          ");
+                dump_sve_reg(f, a->zregs[i], m->sve_vl);
+                fprintf(f, "\n");
+            }
+        }
+        for (i = 0; i < 17; i++) {
+            if (memcmp(m->pregs[i], a->pregs[i], m->sve_vl / 8)) {
+                dump_sve_name(f, i);
+                dump_sve_reg(f, m->pregs[i], m->sve_vl / 8);
+                fprintf(f, " vs ");
+                dump_sve_reg(f, a->pregs[i], m->sve_vl / 8);
+                fprintf(f, "\n");
+            }
+        }
+    }
+
     for (i = 0; i < 32; i++) {
         if (m->vregs[i] != a->vregs[i]) {
             fprintf(f, "  V%2d   : "
@@ -13,6 +13,14 @@
 #ifndef RISU_REGINFO_AARCH64_H
 #define RISU_REGINFO_AARCH64_H
 
+/* The longest SVE vector we handle, in quadwords: 2048 bits, the
+ * architectural maximum
+ */
+#define RISU_SVE_VQ_MAX 16
+
+/* Bump this when struct reginfo changes (see risu_trace.h) */
+#define REGINFO_LAYOUT 1
+
 struct reginfo {
     uint64_t fault_address;
     uint64_t regs[31];
@@ -24,7 +32,18 @@ struct reginfo {
     /* FP/SIMD */
     uint32_t fpsr;
     uint32_t fpcr;
+    uint32_t sve_vl;            /* in bytes, or 0 without SVE */
+    uint32_t pad;
+
+    /* Without SVE */
     __uint128_t vregs[32];
+
+    /* With SVE the V registers are the bottom of the Z registers.
+     * Only the first sve_vl bytes of each Z (and sve_vl / 8 of each
+     * predicate) are used, and only those are packed.
+     */
+    uint64_t zregs[32][RISU_SVE_VQ_MAX * 2];
+    uint16_t pregs[17][RISU_SVE_VQ_MAX];        /* p0-p15, then FFR */
 };
 
 #endif /* RISU_REGINFO_AARCH64_H */
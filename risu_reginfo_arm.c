@@ -11,22 +11,46 @@
  *****************************************************************************/
 
 #include <stdio.h>
+#include <stddef.h>
 #include <ucontext.h>
 #include <string.h>
 
 #include "risu.h"
 #include "risu_reginfo_arm.h"
 
+const struct reginfo_field reginfo_fields[] = {
+    { "insn", offsetof(struct reginfo, faulting_insn), 4, 1 },
+    { "insnsize", offsetof(struct reginfo, faulting_insn_size), 4, 1 },
+    { "r", offsetof(struct reginfo, gpreg), 4, 16 },
+    { "cpsr", offsetof(struct reginfo, cpsr), 4, 1 },
+    { "fpscr", offsetof(struct reginfo, fpscr), 4, 1 },
+    { "d", offsetof(struct reginfo, fpregs), 8, 32 },
+    { NULL }
+};
+
+const struct reginfo_block_layout reginfo_blocks[] = {
+    { REGINFO_CORE, 0, 1, 0 },
+    { REGINFO_END }
+};
+
+/* All the state is always there, so it is packed as one block */
+int reginfo_parts(struct reginfo *ri, struct reginfo_part *parts)
+{
+    parts[0] = (struct reginfo_part) { REGINFO_CORE, ri, sizeof(*ri), 1, 0 };
+    return 1;
+}
+
 extern int insnsize(ucontext_t *uc);
 
-static void reginfo_init_vfp(struct reginfo *ri, ucontext_t *uc)
+static unsigned long *find_vfp_regspace(ucontext_t *uc)
 {
-    /* Read VFP registers. These live in uc->uc_regspace, which is
+    /* Find the VFP registers. These live in uc->uc_regspace, which is
      * a sequence of
      *   u32 magic
      *   u32 size
      *   data....
      * blocks. We have to skip through to find the one for VFP.
+     * Returns a pointer to its data, or NULL if there isn't one.
      */
     unsigned long *rs = uc->uc_regspace;
 
@@ -38,52 +62,19 @@ static void reginfo_init_vfp(struct reginfo *ri, ucontext_t *uc)
 
         switch (magic) {
         case 0:
-        {
-            /* We didn't find any VFP at all (probably a no-VFP
-             * kernel). Zero out all the state to avoid mismatches.
-             */
-            int j;
-            for (j = 0; j < 32; j++) {
-                ri->fpregs[j] = 0;
-            }
-            ri->fpscr = 0;
-            return;
-        }
+            /* We didn't find any VFP at all (probably a no-VFP kernel) */
+            return NULL;
         case 0x56465001:        /* VFP_MAGIC */
-        {
             /* This is the one we care about. The format (after
              *  the size word is 32 * 64 bit registers, then the
              *  32 bit fpscr, then some stuff we don't care about.
+             * Skip if it's smaller than we expected (should never happen!)
              */
-            int i;
-            /* Skip if it's smaller than we expected (should never happen!) */
-            if (size < ((32 * 2) + 1) * 4) {
-                rs += size / 4;
-                break;
-            }
-
-            for (i = 0; i < 32; i++) {
-                ri->fpregs[i] = *rs++;
-                ri->fpregs[i] |= (uint64_t) (*rs++) << 32;
-            }
-            /* Ignore the UNK/SBZP bits. We also ignore the cumulative
-             * exception bits unless we were specifically asked to test
-             * them on the risu command line -- too much of qemu gets
-             * them wrong and they aren't actually very important.
-             */
-            ri->fpscr = (*rs) & 0xffff9f9f;
-            if (!test_fp_exc) {
-                ri->fpscr &= ~0x9f;
+            if (size >= ((32 * 2) + 1) * 4) {
+                return rs;
             }
-            /* Clear the cumulative exception flags. This is a bit
-             * unclean, but makes sense because otherwise we'd have to
-             * insert explicit bit-clearing code in the generated code
-             * to avoid the test becoming useless once all the bits
-             * get set.
-             */
-            (*rs) &= ~0x9f;
-            return;
-        }
+            rs += size / 4;
+            break;
         default:
             /* Some other kind of block, ignore it */
             rs += size / 4;
@@ -92,6 +83,42 @@ static void reginfo_init_vfp(struct reginfo *ri, ucontext_t *uc)
     }
 }
 
+static void reginfo_init_vfp(struct reginfo *ri, ucontext_t *uc)
+{
+    unsigned long *rs = find_vfp_regspace(uc);
+    int i;
+
+    if (!rs) {
+        /* No VFP: zero out all the state to avoid mismatches. */
+        for (i = 0; i < 32; i++) {
+            ri->fpregs[i] = 0;
+        }
+        ri->fpscr = 0;
+        return;
+    }
+
+    for (i = 0; i < 32; i++) {
+        ri->fpregs[i] = *rs++;
+        ri->fpregs[i] |= (uint64_t) (*rs++) << 32;
+    }
+    /* Ignore the UNK/SBZP bits. We also ignore the cumulative
+     * exception bits unless we were specifically asked to test
+     * them on the risu command line -- too much of qemu gets
+     * them wrong and they aren't actually very important.
+     */
+    ri->fpscr = (*rs) & 0xffff9f9f;
+    if (!test_fp_exc) {
+        ri->fpscr &= ~0x9f;
+    }
+    /* Clear the cumulative exception flags. This is a bit
+     * unclean, but makes sense because otherwise we'd have to
+     * insert explicit bit-clearing code in the generated code
+     * to avoid the test becoming useless once all the bits
+     * get set.
+     */
+    (*rs) &= ~0x9f;
+}
+
 void reginfo_init(struct reginfo *ri, ucontext_t *uc)
 {
     memset(ri, 0, sizeof(*ri));         /* necessary for memcmp later */
@@ -129,12 +156,65 @@ void reginfo_init(struct reginfo *ri, ucontext_t *uc)
     reginfo_init_vfp(ri, uc);
 }
 
+/* set_ucontext_reginfo: write the reginfo state back into a ucontext */
+void set_ucontext_reginfo(void *vuc, struct reginfo *ri)
+{
+    ucontext_t *uc = vuc;
+    unsigned long *rs;
+    int i;
+
+    uc->uc_mcontext.arm_r0 = ri->gpreg[0];
+    uc->uc_mcontext.arm_r1 = ri->gpreg[1];
+    uc->uc_mcontext.arm_r2 = ri->gpreg[2];
+    uc->uc_mcontext.arm_r3 = ri->gpreg[3];
+    uc->uc_mcontext.arm_r4 = ri->gpreg[4];
+    uc->uc_mcontext.arm_r5 = ri->gpreg[5];
+    uc->uc_mcontext.arm_r6 = ri->gpreg[6];
+    uc->uc_mcontext.arm_r7 = ri->gpreg[7];
+    uc->uc_mcontext.arm_r8 = ri->gpreg[8];
+    uc->uc_mcontext.arm_r9 = ri->gpreg[9];
+    uc->uc_mcontext.arm_r10 = ri->gpreg[10];
+    uc->uc_mcontext.arm_fp = ri->gpreg[11];
+    uc->uc_mcontext.arm_ip = ri->gpreg[12];
+    uc->uc_mcontext.arm_lr = ri->gpreg[14];
+    uc->uc_mcontext.arm_pc = ri->gpreg[15] + image_start_address;
+    uc->uc_mcontext.arm_cpsr =
+        (uc->uc_mcontext.arm_cpsr & ~0xF80F0000) | ri->cpsr;
+    /* The Thumb bit isn't in the reginfo, but for a risuop we can
+     * tell which instruction set we were in from its size.
+     */
+    if (get_risuop(ri) >= 0) {
+        if (ri->faulting_insn_size == 2) {
+            uc->uc_mcontext.arm_cpsr |= 0x20;
+        } else {
+            uc->uc_mcontext.arm_cpsr &= ~0x20;
+        }
+    }
+
+    rs = find_vfp_regspace(uc);
+    if (!rs) {
+        return;
+    }
+    for (i = 0; i < 32; i++) {
+        *rs++ = ri->fpregs[i];
+        *rs++ = ri->fpregs[i] >> 32;
+    }
+    *rs = (*rs & ~0xffff9f9f) | ri->fpscr;
+}
+
 /* reginfo_is_eq: compare the reginfo structs, returns nonzero if equal */
 int reginfo_is_eq(struct reginfo *r1, struct reginfo *r2)
 {
     return memcmp(r1, r2, sizeof(*r1)) == 0;    /* ok since we memset 0 */
 }
 
+/* reginfo_canonicalise: reginfo_is_eq() compares everything, so there
+ * is nothing to do
+ */
+void reginfo_canonicalise(struct reginfo *ri)
+{
+}
+
 /* reginfo_dump: print the state to a stream, returns nonzero on success */
 int reginfo_dump(struct reginfo *ri, FILE *f)
 {
@@ -13,6 +13,9 @@
 #ifndef RISU_REGINFO_ARM_H
 #define RISU_REGINFO_ARM_H
 
+/* Bump this when struct reginfo changes (see risu_trace.h) */
+#define REGINFO_LAYOUT 1
+
 struct reginfo {
     uint64_t fpregs[32];
     uint32_t faulting_insn;
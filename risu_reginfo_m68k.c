@@ -7,6 +7,7 @@
  *****************************************************************************/
 
 #include <stdio.h>
+#include <stddef.h>
 #include <ucontext.h>
 #include <string.h>
 #include <math.h>
@@ -14,6 +15,31 @@
 #include "risu.h"
 #include "risu_reginfo_m68k.h"
 
+const struct reginfo_field reginfo_fields[] = {
+    { "insn", offsetof(struct reginfo, faulting_insn), 4, 1 },
+    { "pc", offsetof(struct reginfo, pc), 4, 1 },
+    { "d", offsetof(struct reginfo, gregs), 4, 8 },
+    { "a", offsetof(struct reginfo, gregs[8]), 4, 8 },
+    { "sr", offsetof(struct reginfo, gregs[R_PS]), 4, 1 },
+    { "fpcr", offsetof(struct reginfo, fpregs.f_pcr), 4, 1 },
+    { "fpsr", offsetof(struct reginfo, fpregs.f_psr), 4, 1 },
+    { "fpiar", offsetof(struct reginfo, fpregs.f_fpiaddr), 4, 1 },
+    { "fp", offsetof(struct reginfo, fpregs.f_fpregs), 12, 8 },
+    { NULL }
+};
+
+const struct reginfo_block_layout reginfo_blocks[] = {
+    { REGINFO_CORE, 0, 1, 0 },
+    { REGINFO_END }
+};
+
+/* All the state is always there, so it is packed as one block */
+int reginfo_parts(struct reginfo *ri, struct reginfo_part *parts)
+{
+    parts[0] = (struct reginfo_part) { REGINFO_CORE, ri, sizeof(*ri), 1, 0 };
+    return 1;
+}
+
 /* reginfo_init: initialize with a ucontext */
 void reginfo_init(struct reginfo *ri, ucontext_t *uc)
 {
@@ -37,6 +63,32 @@ void reginfo_init(struct reginfo *ri, ucontext_t *uc)
     }
 }
 
+/* set_ucontext_reginfo: write the reginfo state back into a ucontext */
+void set_ucontext_reginfo(void *vuc, struct reginfo *ri)
+{
+    ucontext_t *uc = vuc;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        if (i == R_SP || i == R_A6) {
+            continue;
+        }
+        uc->uc_mcontext.gregs[i] = ri->gregs[i];
+    }
+    uc->uc_mcontext.gregs[R_PC] = ri->pc + image_start_address;
+    /* only the condition codes can be set from userspace */
+    uc->uc_mcontext.gregs[R_PS] =
+        (uc->uc_mcontext.gregs[R_PS] & ~0xff) | (ri->gregs[R_PS] & 0xff);
+
+    uc->uc_mcontext.fpregs.f_pcr = ri->fpregs.f_pcr;
+    uc->uc_mcontext.fpregs.f_psr = ri->fpregs.f_psr;
+    for (i = 0; i < 8; i++) {
+        memcpy(uc->uc_mcontext.fpregs.f_fpregs[i],
+               ri->fpregs.f_fpregs[i],
+               sizeof(ri->fpregs.f_fpregs[0]));
+    }
+}
+
 /* reginfo_is_eq: compare the reginfo structs, returns nonzero if equal */
 int reginfo_is_eq(struct reginfo *m, struct reginfo *a)
 {
@@ -74,6 +126,30 @@ int reginfo_is_eq(struct reginfo *m, struct reginfo *a)
     return 1;
 }
 
+/* reginfo_canonicalise: keep only what reginfo_is_eq() compares */
+void reginfo_canonicalise(struct reginfo *ri)
+{
+    struct reginfo c;
+    int i;
+
+    memset(&c, 0, sizeof(c));
+    c.gregs[R_PS] = ri->gregs[R_PS];
+    for (i = 0; i < 16; i++) {
+        if (i == R_SP || i == R_A6) {
+            continue;
+        }
+        c.gregs[i] = ri->gregs[i];
+    }
+    c.fpregs.f_pcr = ri->fpregs.f_pcr;
+    c.fpregs.f_psr = ri->fpregs.f_psr;
+    for (i = 0; i < 8; i++) {
+        c.fpregs.f_fpregs[i][0] = ri->fpregs.f_fpregs[i][0];
+        c.fpregs.f_fpregs[i][1] = ri->fpregs.f_fpregs[i][1];
+        c.fpregs.f_fpregs[i][2] = ri->fpregs.f_fpregs[i][2];
+    }
+    *ri = c;
+}
+
 /* reginfo_dump: print state to a stream, returns nonzero on success */
 int reginfo_dump(struct reginfo *ri, FILE *f)
 {
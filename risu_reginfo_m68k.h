@@ -9,6 +9,9 @@
 #ifndef RISU_REGINFO_M68K_H
 #define RISU_REGINFO_M68K_H
 
+/* Bump this when struct reginfo changes (see risu_trace.h) */
+#define REGINFO_LAYOUT 1
+
 struct reginfo {
     uint32_t faulting_insn;
     uint32_t pc;
@@ -12,6 +12,7 @@
  *****************************************************************************/
 
 #include <stdio.h>
+#include <stddef.h>
 #include <ucontext.h>
 #include <string.h>
 #include <math.h>
@@ -19,9 +20,39 @@
 #include "risu.h"
 #include "risu_reginfo_ppc64.h"
 
+#define CTR 35
+#define LNK 36
 #define XER 37
 #define CCR 38
 
+const struct reginfo_field reginfo_fields[] = {
+    { "insn", offsetof(struct reginfo, faulting_insn), 4, 1 },
+    { "nip", offsetof(struct reginfo, nip), 8, 1 },
+    { "r", offsetof(struct reginfo, gregs), 8, 32 },
+    { "ctr", offsetof(struct reginfo, gregs[CTR]), 8, 1 },
+    { "lr", offsetof(struct reginfo, gregs[LNK]), 8, 1 },
+    { "xer", offsetof(struct reginfo, gregs[XER]), 8, 1 },
+    { "ccr", offsetof(struct reginfo, gregs[CCR]), 8, 1 },
+    { "f", offsetof(struct reginfo, fpregs), 8, 32 },
+    { "fpscr", offsetof(struct reginfo, fpregs[32]), 8, 1 },
+    { "v", offsetof(struct reginfo, vrregs.vrregs), 16, 32 },
+    { "vscr", offsetof(struct reginfo, vrregs.vscr), 4, 1 },
+    { "vrsave", offsetof(struct reginfo, vrregs.vrsave), 4, 1 },
+    { NULL }
+};
+
+const struct reginfo_block_layout reginfo_blocks[] = {
+    { REGINFO_CORE, 0, 1, 0 },
+    { REGINFO_END }
+};
+
+/* All the state is always there, so it is packed as one block */
+int reginfo_parts(struct reginfo *ri, struct reginfo_part *parts)
+{
+    parts[0] = (struct reginfo_part) { REGINFO_CORE, ri, sizeof(*ri), 1, 0 };
+    return 1;
+}
+
 /* reginfo_init: initialize with a ucontext */
 void reginfo_init(struct reginfo *ri, ucontext_t *uc)
 {
@@ -49,6 +80,39 @@ void reginfo_init(struct reginfo *ri, ucontext_t *uc)
     ri->vrregs.vrsave = uc->uc_mcontext.v_regs->vrsave;
 }
 
+/* set_ucontext_reginfo: write the reginfo state back into a ucontext */
+void set_ucontext_reginfo(void *vuc, struct reginfo *ri)
+{
+    ucontext_t *uc = vuc;
+    int i;
+
+    for (i = 0; i < 32; i++) {
+        /* leave the stack and thread pointers alone */
+        if (i == 1 || i == 13) {
+            continue;
+        }
+        uc->uc_mcontext.gp_regs[i] = ri->gregs[i];
+    }
+    uc->uc_mcontext.gp_regs[CTR] = ri->gregs[CTR];
+    uc->uc_mcontext.gp_regs[LNK] = ri->gregs[LNK];
+    uc->uc_mcontext.gp_regs[XER] = ri->gregs[XER];
+    uc->uc_mcontext.gp_regs[CCR] = ri->gregs[CCR];
+    uc->uc_mcontext.regs->nip = ri->nip + image_start_address;
+
+    for (i = 0; i < NFPREG; i++) {
+        uc->uc_mcontext.fp_regs[i] = ri->fpregs[i];
+    }
+
+    for (i = 0; i < 32; i++) {
+        uc->uc_mcontext.v_regs->vrregs[i][0] = ri->vrregs.vrregs[i][0];
+        uc->uc_mcontext.v_regs->vrregs[i][1] = ri->vrregs.vrregs[i][1];
+        uc->uc_mcontext.v_regs->vrregs[i][2] = ri->vrregs.vrregs[i][2];
+        uc->uc_mcontext.v_regs->vrregs[i][3] = ri->vrregs.vrregs[i][3];
+    }
+    uc->uc_mcontext.v_regs->vscr = ri->vrregs.vscr;
+    uc->uc_mcontext.v_regs->vrsave = ri->vrregs.vrsave;
+}
+
 /* reginfo_is_eq: compare the reginfo structs, returns nonzero if equal */
 int reginfo_is_eq(struct reginfo *m, struct reginfo *a)
 {
@@ -92,6 +156,37 @@ int reginfo_is_eq(struct reginfo *m, struct reginfo *a)
     return 1;
 }
 
+/* reginfo_canonicalise: keep only what reginfo_is_eq() compares */
+void reginfo_canonicalise(struct reginfo *ri)
+{
+    struct reginfo c;
+    int i;
+
+    memset(&c, 0, sizeof(c));
+    for (i = 0; i < 32; i++) {
+        if (i == 1 || i == 13) {
+            continue;
+        }
+        c.gregs[i] = ri->gregs[i];
+    }
+    c.gregs[XER] = ri->gregs[XER];
+    c.gregs[CCR] = ri->gregs[CCR] & 0x10;
+
+    /* all NaNs are equal, and so are +0 and -0 */
+    for (i = 0; i < 32; i++) {
+        if (isnan(ri->fpregs[i])) {
+            c.fpregs[i] = NAN;
+        } else if (ri->fpregs[i] == 0) {
+            c.fpregs[i] = 0;
+        } else {
+            c.fpregs[i] = ri->fpregs[i];
+        }
+    }
+
+    memcpy(c.vrregs.vrregs, ri->vrregs.vrregs, sizeof(c.vrregs.vrregs));
+    *ri = c;
+}
+
 /* reginfo_dump: print state to a stream, returns nonzero on success */
 int reginfo_dump(struct reginfo *ri, FILE * f)
 {
@@ -0,0 +1,318 @@
+/******************************************************************************
+ * Copyright (c) 2017 Linaro Limited
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stddef.h>
+#include <ucontext.h>
+#include <string.h>
+
+#include "risu.h"
+#include "risu_reginfo_x86_64.h"
+
+/* The flags we compare: CF, PF, AF, ZF, SF, DF and OF */
+#define EFLAGS_MASK 0xcd5
+
+/* FP_XSTATE_MAGIC1 in the software reserved bytes of the FXSAVE area
+ * means the kernel saved an XSAVE area after it, with the usual
+ * layout: the XSAVE header at 512, and the upper halves of the YMM
+ * registers at 576 if bit 2 of its xstate_bv is set. The features the
+ * area has room for follow the magic.
+ */
+#define FXSAVE_SW_OFFSET 464
+#define FXSAVE_SW_XFEATURES 472
+#ifndef FP_XSTATE_MAGIC1              /* <signal.h> may have it */
+#define FP_XSTATE_MAGIC1 0x46505853
+#endif
+#define XSAVE_HDR_OFFSET 512
+#define XSAVE_YMMH_OFFSET 576
+#define XSTATE_YMM 4
+
+/* Packed block tags */
+#define REGINFO_SSE 16
+#define REGINFO_AVX 17
+
+/* ucontext gregs index for each register, in encoding order */
+static const int reg_index[16] = {
+    REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP, REG_RSI, REG_RDI,
+    REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15
+};
+
+static const char *const reg_name[16] = {
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+    "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
+};
+
+const struct reginfo_field reginfo_fields[] = {
+    { "insn", offsetof(struct reginfo, faulting_insn), 4, 1 },
+    { "rip", offsetof(struct reginfo, rip), 8, 1 },
+    { "rax", offsetof(struct reginfo, regs[0]), 8, 1 },
+    { "rcx", offsetof(struct reginfo, regs[1]), 8, 1 },
+    { "rdx", offsetof(struct reginfo, regs[2]), 8, 1 },
+    { "rbx", offsetof(struct reginfo, regs[3]), 8, 1 },
+    { "rbp", offsetof(struct reginfo, regs[5]), 8, 1 },
+    { "rsi", offsetof(struct reginfo, regs[6]), 8, 1 },
+    { "rdi", offsetof(struct reginfo, regs[7]), 8, 1 },
+    { "r8", offsetof(struct reginfo, regs[8]), 8, 1 },
+    { "r9", offsetof(struct reginfo, regs[9]), 8, 1 },
+    { "r10", offsetof(struct reginfo, regs[10]), 8, 1 },
+    { "r11", offsetof(struct reginfo, regs[11]), 8, 1 },
+    { "r12", offsetof(struct reginfo, regs[12]), 8, 1 },
+    { "r13", offsetof(struct reginfo, regs[13]), 8, 1 },
+    { "r14", offsetof(struct reginfo, regs[14]), 8, 1 },
+    { "r15", offsetof(struct reginfo, regs[15]), 8, 1 },
+    { "eflags", offsetof(struct reginfo, eflags), 8, 1 },
+    { "mxcsr", offsetof(struct reginfo, mxcsr), 4, 1 },
+    { "fcw", offsetof(struct reginfo, fcw), 2, 1 },
+    { "fsw", offsetof(struct reginfo, fsw), 2, 1 },
+    { "ftw", offsetof(struct reginfo, ftw), 2, 1 },
+    { "st", offsetof(struct reginfo, st), sizeof(struct x87reg), 8 },
+    { "xmm", offsetof(struct reginfo, xmm), 16, 16 },
+    { "ymmh", offsetof(struct reginfo, ymmh), 16, 16 },
+    { NULL }
+};
+
+const struct reginfo_block_layout reginfo_blocks[] = {
+    { REGINFO_CORE, 0, 1, 0 },
+    { REGINFO_SSE, offsetof(struct reginfo, xmm), 1, 0 },
+    { REGINFO_AVX, offsetof(struct reginfo, ymmh), 1, 0 },
+    { REGINFO_END }
+};
+
+int reginfo_parts(struct reginfo *ri, struct reginfo_part *parts)
+{
+    int n = 0;
+
+    parts[n++] = (struct reginfo_part) {
+        REGINFO_CORE, ri, offsetof(struct reginfo, xmm), 1, 0
+    };
+    parts[n++] = (struct reginfo_part) {
+        REGINFO_SSE, ri->xmm, sizeof(ri->xmm), 1, 0
+    };
+    if (ri->avx) {
+        parts[n++] = (struct reginfo_part) {
+            REGINFO_AVX, ri->ymmh, sizeof(ri->ymmh), 1, 0
+        };
+    }
+    return n;
+}
+
+/* Find the upper halves of the YMM registers in the signal frame, or
+ * NULL if the XSAVE area has no room for them. They only hold anything
+ * if the XSTATE_YMM bit in *xstate_bv is set; otherwise they are all
+ * zeroes.
+ */
+static uint8_t *find_ymmh(struct _libc_fpstate *fp, uint64_t **xstate_bv)
+{
+    uint8_t *base = (uint8_t *) fp;
+    uint32_t magic;
+    uint64_t xfeatures;
+
+    memcpy(&magic, base + FXSAVE_SW_OFFSET, sizeof(magic));
+    memcpy(&xfeatures, base + FXSAVE_SW_XFEATURES, sizeof(xfeatures));
+    if (magic != FP_XSTATE_MAGIC1 || !(xfeatures & XSTATE_YMM)) {
+        return NULL;
+    }
+    *xstate_bv = (uint64_t *) (base + XSAVE_HDR_OFFSET);
+    return base + XSAVE_YMMH_OFFSET;
+}
+
+/* reginfo_init: initialize with a ucontext */
+void reginfo_init(struct reginfo *ri, ucontext_t *uc)
+{
+    struct _libc_fpstate *fp = uc->uc_mcontext.fpregs;
+    uint8_t *rip = (uint8_t *) uc->uc_mcontext.gregs[REG_RIP];
+    uint64_t *xstate_bv;
+    uint8_t *ymmh;
+    int i;
+
+    /* necessary to be able to compare with memcmp later */
+    memset(ri, 0, sizeof(*ri));
+
+    for (i = 0; i < 16; i++) {
+        ri->regs[i] = uc->uc_mcontext.gregs[reg_index[i]];
+    }
+    /* the stack is in a different place on each side */
+    ri->regs[4] = 0xdeadbeefdeadbeef;
+    ri->rip = uc->uc_mcontext.gregs[REG_RIP] - image_start_address;
+    ri->eflags = uc->uc_mcontext.gregs[REG_EFL] & EFLAGS_MASK;
+    ri->faulting_insn = rip[0] | (rip[1] << 8) | (rip[2] << 16);
+
+    if (!fp) {
+        return;
+    }
+    ri->mxcsr = fp->mxcsr;
+    if (!test_fp_exc) {
+        /* ignore the exception status bits */
+        ri->mxcsr &= ~0x3f;
+    }
+    ri->fcw = fp->cwd;
+    ri->fsw = fp->swd;
+    ri->ftw = fp->ftw;
+    for (i = 0; i < 8; i++) {
+        memcpy(&ri->st[i].mantissa, fp->_st[i].significand, 8);
+        ri->st[i].exponent = fp->_st[i].exponent;
+    }
+    memcpy(ri->xmm, fp->_xmm, sizeof(ri->xmm));
+
+    ymmh = find_ymmh(fp, &xstate_bv);
+    if (ymmh) {
+        ri->avx = 1;
+        if (*xstate_bv & XSTATE_YMM) {
+            memcpy(ri->ymmh, ymmh, sizeof(ri->ymmh));
+        }
+    }
+}
+
+/* set_ucontext_reginfo: write the reginfo state back into a ucontext */
+void set_ucontext_reginfo(void *vuc, struct reginfo *ri)
+{
+    ucontext_t *uc = vuc;
+    struct _libc_fpstate *fp = uc->uc_mcontext.fpregs;
+    uint64_t *xstate_bv;
+    uint8_t *ymmh;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        if (i != 4) {
+            uc->uc_mcontext.gregs[reg_index[i]] = ri->regs[i];
+        }
+    }
+    uc->uc_mcontext.gregs[REG_RIP] = image_start_address + ri->rip;
+    uc->uc_mcontext.gregs[REG_EFL] =
+        (uc->uc_mcontext.gregs[REG_EFL] & ~EFLAGS_MASK) | ri->eflags;
+
+    if (!fp) {
+        return;
+    }
+    fp->mxcsr = (fp->mxcsr & (test_fp_exc ? 0 : 0x3f)) | ri->mxcsr;
+    fp->cwd = ri->fcw;
+    fp->swd = ri->fsw;
+    fp->ftw = ri->ftw;
+    for (i = 0; i < 8; i++) {
+        memcpy(fp->_st[i].significand, &ri->st[i].mantissa, 8);
+        fp->_st[i].exponent = ri->st[i].exponent;
+    }
+    memcpy(fp->_xmm, ri->xmm, sizeof(ri->xmm));
+
+    ymmh = find_ymmh(fp, &xstate_bv);
+    if (ymmh && ri->avx) {
+        memcpy(ymmh, ri->ymmh, sizeof(ri->ymmh));
+        *xstate_bv |= XSTATE_YMM;
+    }
+}
+
+/* reginfo_is_eq: compare the reginfo structs, returns nonzero if equal */
+int reginfo_is_eq(struct reginfo *r1, struct reginfo *r2)
+{
+    return memcmp(r1, r2, sizeof(*r1)) == 0;    /* ok since we memset 0 */
+}
+
+/* reginfo_canonicalise: reginfo_is_eq() compares everything, so there
+ * is nothing to do
+ */
+void reginfo_canonicalise(struct reginfo *ri)
+{
+}
+
+/* reginfo_dump: print state to a stream, returns nonzero on success */
+int reginfo_dump(struct reginfo *ri, FILE *f)
+{
+    int i;
+    fprintf(f, "  faulting insn %06x\n", ri->faulting_insn);
+
+    for (i = 0; i < 16; i++) {
+        fprintf(f, "  %-6s: %016" PRIx64 "\n", reg_name[i], ri->regs[i]);
+    }
+    fprintf(f, "  rip   : %016" PRIx64 "\n", ri->rip);
+    fprintf(f, "  eflags: %08" PRIx64 "\n", ri->eflags);
+    fprintf(f, "  mxcsr : %08x\n", ri->mxcsr);
+    fprintf(f, "  fcw   : %04x\n", ri->fcw);
+    fprintf(f, "  fsw   : %04x\n", ri->fsw);
+    fprintf(f, "  ftw   : %04x\n", ri->ftw);
+
+    for (i = 0; i < 8; i++) {
+        fprintf(f, "  st%d   : %04x%016" PRIx64 "\n", i,
+                ri->st[i].exponent, ri->st[i].mantissa);
+    }
+    for (i = 0; i < 16; i++) {
+        if (ri->avx) {
+            fprintf(f, "  ymm%-2d : %016" PRIx64 "%016" PRIx64
+                    "%016" PRIx64 "%016" PRIx64 "\n", i,
+                    ri->ymmh[i][1], ri->ymmh[i][0],
+                    ri->xmm[i][1], ri->xmm[i][0]);
+        } else {
+            fprintf(f, "  xmm%-2d : %016" PRIx64 "%016" PRIx64 "\n", i,
+                    ri->xmm[i][1], ri->xmm[i][0]);
+        }
+    }
+
+    return !ferror(f);
+}
+
+/* reginfo_dump_mismatch: print mismatch details to a stream, ret nonzero=ok */
+int reginfo_dump_mismatch(struct reginfo *m, struct reginfo *a, FILE *f)
+{
+    int i;
+    fprintf(f, "mismatch detail (master : apprentice):\n");
+    if (m->faulting_insn != a->faulting_insn) {
+        fprintf(f, "  faulting insn mismatch %06x vs %06x\n",
+                m->faulting_insn, a->faulting_insn);
+    }
+    for (i = 0; i < 16; i++) {
+        if (m->regs[i] != a->regs[i]) {
+            fprintf(f, "  %-6s: %016" PRIx64 " vs %016" PRIx64 "\n",
+                    reg_name[i], m->regs[i], a->regs[i]);
+        }
+    }
+    if (m->rip != a->rip) {
+        fprintf(f, "  rip   : %016" PRIx64 " vs %016" PRIx64 "\n",
+                m->rip, a->rip);
+    }
+    if (m->eflags != a->eflags) {
+        fprintf(f, "  eflags: %08" PRIx64 " vs %08" PRIx64 "\n",
+                m->eflags, a->eflags);
+    }
+    if (m->mxcsr != a->mxcsr) {
+        fprintf(f, "  mxcsr : %08x vs %08x\n", m->mxcsr, a->mxcsr);
+    }
+    if (m->fcw != a->fcw) {
+        fprintf(f, "  fcw   : %04x vs %04x\n", m->fcw, a->fcw);
+    }
+    if (m->fsw != a->fsw) {
+        fprintf(f, "  fsw   : %04x vs %04x\n", m->fsw, a->fsw);
+    }
+    if (m->ftw != a->ftw) {
+        fprintf(f, "  ftw   : %04x vs %04x\n", m->ftw, a->ftw);
+    }
+    if (m->avx != a->avx) {
+        fprintf(f, "  avx   : %d vs %d\n", m->avx, a->avx);
+    }
+
+    for (i = 0; i < 8; i++) {
+        if (m->st[i].mantissa != a->st[i].mantissa
+            || m->st[i].exponent != a->st[i].exponent) {
+            fprintf(f, "  st%d   : %04x%016" PRIx64 " vs %04x%016" PRIx64
+                    "\n", i, m->st[i].exponent, m->st[i].mantissa,
+                    a->st[i].exponent, a->st[i].mantissa);
+        }
+    }
+    for (i = 0; i < 16; i++) {
+        if (memcmp(m->xmm[i], a->xmm[i], sizeof(m->xmm[i]))
+            || memcmp(m->ymmh[i], a->ymmh[i], sizeof(m->ymmh[i]))) {
+            fprintf(f, "  ymm%-2d : "
+                    "%016" PRIx64 "%016" PRIx64 "%016" PRIx64 "%016" PRIx64
+                    " vs\n          "
+                    "%016" PRIx64 "%016" PRIx64 "%016" PRIx64 "%016" PRIx64
+                    "\n", i,
+                    m->ymmh[i][1], m->ymmh[i][0], m->xmm[i][1], m->xmm[i][0],
+                    a->ymmh[i][1], a->ymmh[i][0], a->xmm[i][1], a->xmm[i][0]);
+        }
+    }
+
+    return !ferror(f);
+}
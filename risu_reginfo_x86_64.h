@@ -0,0 +1,44 @@
+/******************************************************************************
+ * Copyright (c) 2017 Linaro Limited
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *****************************************************************************/
+
+#ifndef RISU_REGINFO_X86_64_H
+#define RISU_REGINFO_X86_64_H
+
+/* x87 register, as stored by FXSAVE */
+struct x87reg {
+    uint64_t mantissa;
+    uint16_t exponent;
+    uint16_t pad[3];
+};
+
+/* Bump this when struct reginfo changes (see risu_trace.h) */
+#define REGINFO_LAYOUT 1
+
+struct reginfo {
+    uint32_t faulting_insn;     /* the first three bytes of it */
+    uint32_t mxcsr;
+    uint64_t rip;               /* offset from the start of the image */
+    /* in encoding order: rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8... */
+    uint64_t regs[16];
+    uint64_t eflags;
+
+    /* x87 */
+    uint16_t fcw;
+    uint16_t fsw;
+    uint16_t ftw;               /* abridged, one bit per register */
+    uint16_t avx;               /* nonzero if there are YMM registers */
+    struct x87reg st[8];
+
+    /* SSE, and the upper halves of the AVX registers: these are
+     * separate blocks when packed, the second only if avx is set
+     */
+    uint64_t xmm[16][2];
+    uint64_t ymmh[16][2];
+};
+
+#endif /* RISU_REGINFO_X86_64_H */
@@ -0,0 +1,758 @@
+/*******************************************************************************
+ * Copyright (c) 2017 Linaro Limited
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ ******************************************************************************/
+
+/* risu-stats: summarise a whole corpus of trace files: checkpoints
+ * per op and per PC, and how often each register changes. Given pairs
+ * of traces (eg master and --record'ed apprentice) it also counts
+ * which checkpoints and registers differ between them.
+ *
+ * Each trace (or pair) is a job for a pool of worker threads, so the
+ * decompression and decoding is spread over all the CPUs. Workers keep
+ * their own totals, which are merged at the end.
+ *
+ * If the traces were recorded with risu --timestamps we also say where
+ * the time went: the time between two checkpoints is charged to the
+ * later one's PC, and given the image map (risugen --map) split
+ * between the test instructions in that stretch, by pattern. The times
+ * of a pair come from the first trace. An image container (risugen
+ * --container) carries the same information as the map.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <fcntl.h>
+
+#include "risu.h"
+
+/* Needed by the per-arch reginfo code we link against */
+__thread uintptr_t image_start_address;
+__thread void *memblock;
+int test_fp_exc;
+
+union payload {
+    struct reginfo ri;
+    uint8_t mem[MEMBLOCKLEN];
+};
+
+/* Ops we count separately; op -1 (an UNDEF which isn't a risuop)
+ * goes in slot 0 and anything unexpected in the last one.
+ */
+#define NOPS 7
+static const char *op_names[NOPS] = {
+    "undef", "compare", "testend", "setmemblock", "getmemblock",
+    "comparemem", "other"
+};
+
+static int op_slot(int32_t op)
+{
+    if (op < -1 || op >= NOPS - 2) {
+        return NOPS - 1;
+    }
+    return op + 1;
+}
+
+/* The registers, one element per register rather than per field */
+struct reg_elem {
+    char name[32];
+    size_t offset, size;
+};
+static struct reg_elem *elems;
+static int nelems;
+
+struct pc_entry {
+    uintptr_t pc;
+    uint64_t count, diffs;
+    uint64_t ns;            /* time since the previous checkpoint */
+};
+
+/* From the image map or container: the test units, sorted by the offset of the
+ * checkpoint (or slot) after each, and the patterns they came from.
+ */
+struct map_unit {
+    uintptr_t end;
+    int pattern;
+};
+static struct map_unit *units;
+static size_t nunits;
+static char **patterns;
+static int npatterns;
+
+/* Open addressing hash table of pc_entry, keyed by pc; an entry with
+ * a count of 0 is free.
+ */
+struct pc_table {
+    struct pc_entry *e;
+    size_t size, used;
+};
+
+struct stats {
+    uint64_t files, truncated, desync;
+    uint64_t checkpoints;
+    uint64_t ops[NOPS];
+    uint64_t reg_mismatches, mem_mismatches;
+    uint64_t *changes;      /* per elem: changed since last checkpoint */
+    uint64_t *diffs;        /* per elem: differs between a pair */
+    struct pc_table pcs;
+    /* timing: intervals between timestamped checkpoints */
+    uint64_t timed, ns, unattributed_ns;
+    uint64_t *pattern_ns, *pattern_units;
+};
+
+static char **jobs;
+static int njobs, pairs;
+static int next_job;
+
+static void stats_init(struct stats *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->changes = calloc(nelems, sizeof(uint64_t));
+    s->diffs = calloc(nelems, sizeof(uint64_t));
+    s->pattern_ns = calloc(npatterns + 1, sizeof(uint64_t));
+    s->pattern_units = calloc(npatterns + 1, sizeof(uint64_t));
+    s->pcs.size = 1024;
+    s->pcs.e = calloc(s->pcs.size, sizeof(struct pc_entry));
+}
+
+static struct pc_entry *pc_lookup(struct pc_table *t, uintptr_t pc)
+{
+    size_t i;
+
+    if (t->used * 2 >= t->size) {
+        struct pc_table bigger;
+        bigger.size = t->size * 2;
+        bigger.used = 0;
+        bigger.e = calloc(bigger.size, sizeof(struct pc_entry));
+        for (i = 0; i < t->size; i++) {
+            if (t->e[i].count) {
+                *pc_lookup(&bigger, t->e[i].pc) = t->e[i];
+            }
+        }
+        free(t->e);
+        *t = bigger;
+    }
+
+    i = (pc * 0x9e3779b97f4a7c15ULL >> 17) & (t->size - 1);
+    while (t->e[i].count && t->e[i].pc != pc) {
+        i = (i + 1) & (t->size - 1);
+    }
+    if (!t->e[i].count) {
+        t->e[i].pc = pc;
+        t->used++;
+    }
+    return &t->e[i];
+}
+
+static void count_changes(struct stats *s, struct reginfo *prev,
+                          struct reginfo *ri)
+{
+    int i;
+
+    for (i = 0; i < nelems; i++) {
+        if (memcmp((char *)prev + elems[i].offset,
+                   (char *)ri + elems[i].offset, elems[i].size)) {
+            s->changes[i]++;
+        }
+    }
+}
+
+static void count_diffs(struct stats *s, struct reginfo *a,
+                        struct reginfo *b)
+{
+    int i;
+
+    for (i = 0; i < nelems; i++) {
+        if (memcmp((char *)a + elems[i].offset,
+                   (char *)b + elems[i].offset, elems[i].size)) {
+            s->diffs[i]++;
+        }
+    }
+}
+
+/* Split the time between checkpoints at from and to evenly between
+ * the test units in that stretch of the image
+ */
+static void charge_patterns(struct stats *s, uintptr_t from, uintptr_t to,
+                            uint64_t ns)
+{
+    size_t lo = 0, hi = nunits, i;
+    uint64_t k;
+
+    /* first unit ending after from */
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (units[mid].end <= from) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (i = lo; i < nunits && units[i].end <= to; i++) {
+        continue;
+    }
+    k = i - lo;
+    if (!k) {
+        /* register setup and the like */
+        s->unattributed_ns += ns;
+        return;
+    }
+    for (i = lo; i < lo + k; i++) {
+        s->pattern_ns[units[i].pattern] += ns / k;
+        s->pattern_units[units[i].pattern]++;
+    }
+}
+
+/* The pattern of the test unit whose checkpoint is at pc */
+static const char *pc_pattern(uintptr_t pc)
+{
+    size_t lo = 0, hi = nunits;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (units[mid].end < pc) {
+            lo = mid + 1;
+        } else if (units[mid].end > pc) {
+            hi = mid;
+        } else {
+            return patterns[units[mid].pattern];
+        }
+    }
+    return "";
+}
+
+static trace_file *open_trace(const char *name)
+{
+    trace_file *t = trace_open(name, 0);
+    if (!t) {
+        perror(name);
+    } else if (!trace_is_native(t, name)) {
+        trace_close(t);
+        t = NULL;
+    }
+    return t;
+}
+
+/* Go through one trace, or a pair of them in step */
+static void process(struct stats *s, const char *name_a, const char *name_b)
+{
+    union payload *pa = malloc(sizeof(*pa)), *pb = malloc(sizeof(*pb));
+    struct reginfo *prev = malloc(sizeof(*prev));
+    trace_file *ta, *tb = NULL;
+    trace_header_t ha, hb;
+    int have_prev = 0;
+    uint64_t prev_ts = 0;
+    uintptr_t prev_pc = 0;
+
+    ta = open_trace(name_a);
+    if (name_b) {
+        tb = open_trace(name_b);
+    }
+    if (!ta || (name_b && !tb)) {
+        goto out;
+    }
+    if (trace_fingerprint_mode(ta) || (tb && trace_fingerprint_mode(tb))) {
+        /* no register values to look at */
+        fprintf(stderr, "%s: fingerprint trace, skipped\n",
+                trace_fingerprint_mode(ta) ? name_a : name_b);
+        goto out;
+    }
+    s->files += name_b ? 2 : 1;
+
+    for (;;) {
+        struct pc_entry *pe;
+        int r = trace_read_record(ta, &ha, pa);
+
+        if (tb) {
+            int rb = trace_read_record(tb, &hb, pb);
+            if (r < 0 || rb < 0) {
+                s->truncated++;
+                break;
+            }
+            if (r || rb) {
+                if (!r || !rb) {
+                    s->desync++;
+                }
+                break;
+            }
+            if (ha.pc != hb.pc || ha.risu_op != hb.risu_op) {
+                s->desync++;
+                break;
+            }
+        } else if (r) {
+            if (r < 0) {
+                s->truncated++;
+            }
+            break;
+        }
+
+        s->checkpoints++;
+        s->ops[op_slot(ha.risu_op)]++;
+        pe = pc_lookup(&s->pcs, ha.pc);
+        pe->count++;
+
+        if (ha.timestamp && prev_ts && ha.timestamp >= prev_ts) {
+            uint64_t ns = ha.timestamp - prev_ts;
+            pe->ns += ns;
+            s->timed++;
+            s->ns += ns;
+            if (nunits) {
+                charge_patterns(s, prev_pc, ha.pc, ns);
+            }
+        }
+        prev_ts = ha.timestamp;
+        prev_pc = ha.pc;
+
+        switch (ha.risu_op) {
+        case OP_SETMEMBLOCK:
+        case OP_GETMEMBLOCK:
+            break;
+        case OP_COMPAREMEM:
+            if (tb && memcmp(pa->mem, pb->mem, MEMBLOCKLEN)) {
+                s->mem_mismatches++;
+                pe->diffs++;
+            }
+            break;
+        default:
+            if (have_prev) {
+                count_changes(s, prev, &pa->ri);
+            }
+            *prev = pa->ri;
+            have_prev = 1;
+            if (tb && !reginfo_is_eq(&pa->ri, &pb->ri)) {
+                s->reg_mismatches++;
+                pe->diffs++;
+                count_diffs(s, &pa->ri, &pb->ri);
+            }
+            break;
+        }
+    }
+
+ out:
+    if (ta) {
+        trace_close(ta);
+    }
+    if (tb) {
+        trace_close(tb);
+    }
+    free(pa);
+    free(pb);
+    free(prev);
+}
+
+static void *worker(void *opaque)
+{
+    struct stats *s = opaque;
+    int step = pairs ? 2 : 1;
+
+    for (;;) {
+        int j = __atomic_fetch_add(&next_job, step, __ATOMIC_RELAXED);
+        if (j >= njobs) {
+            break;
+        }
+        process(s, jobs[j], pairs ? jobs[j + 1] : NULL);
+    }
+    return NULL;
+}
+
+static void stats_merge(struct stats *to, struct stats *from)
+{
+    size_t i;
+
+    to->files += from->files;
+    to->truncated += from->truncated;
+    to->desync += from->desync;
+    to->checkpoints += from->checkpoints;
+    to->reg_mismatches += from->reg_mismatches;
+    to->mem_mismatches += from->mem_mismatches;
+    to->timed += from->timed;
+    to->ns += from->ns;
+    to->unattributed_ns += from->unattributed_ns;
+    for (i = 0; i < npatterns; i++) {
+        to->pattern_ns[i] += from->pattern_ns[i];
+        to->pattern_units[i] += from->pattern_units[i];
+    }
+    for (i = 0; i < NOPS; i++) {
+        to->ops[i] += from->ops[i];
+    }
+    for (i = 0; i < nelems; i++) {
+        to->changes[i] += from->changes[i];
+        to->diffs[i] += from->diffs[i];
+    }
+    for (i = 0; i < from->pcs.size; i++) {
+        struct pc_entry *f = &from->pcs.e[i];
+        if (f->count) {
+            struct pc_entry *t = pc_lookup(&to->pcs, f->pc);
+            t->count += f->count;
+            t->diffs += f->diffs;
+            t->ns += f->ns;
+        }
+    }
+}
+
+static void build_elems(void)
+{
+    const struct reginfo_field *f;
+    int i;
+
+    for (f = reginfo_fields; f->name; f++) {
+        nelems += f->count;
+    }
+    elems = calloc(nelems, sizeof(*elems));
+    nelems = 0;
+    for (f = reginfo_fields; f->name; f++) {
+        for (i = 0; i < f->count; i++) {
+            struct reg_elem *e = &elems[nelems++];
+            if (f->count == 1) {
+                snprintf(e->name, sizeof(e->name), "%s", f->name);
+            } else {
+                snprintf(e->name, sizeof(e->name), "%s%d", f->name, i);
+            }
+            e->offset = f->offset + i * f->size;
+            e->size = f->size;
+        }
+    }
+}
+
+/* Sort order for the summary tables: by diffs if we have pairs,
+ * otherwise by count, biggest first.
+ */
+static uint64_t *sort_key;
+
+static int cmp_pc(const void *a, const void *b)
+{
+    const struct pc_entry *x = a, *y = b;
+    uint64_t kx = pairs ? x->diffs : x->count;
+    uint64_t ky = pairs ? y->diffs : y->count;
+    if (kx != ky) {
+        return kx < ky ? 1 : -1;
+    }
+    return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+static int cmp_pc_time(const void *a, const void *b)
+{
+    const struct pc_entry *x = a, *y = b;
+    if (x->ns != y->ns) {
+        return x->ns < y->ns ? 1 : -1;
+    }
+    return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+static int cmp_elem(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    if (sort_key[x] != sort_key[y]) {
+        return sort_key[x] < sort_key[y] ? 1 : -1;
+    }
+    return x - y;
+}
+
+static void report_time(struct stats *s, struct pc_entry *pcs, size_t n,
+                        int top)
+{
+    size_t i;
+
+    printf("\n%.3f ms between %" PRIu64 " pairs of timestamped "
+           "checkpoints\n", s->ns / 1e6, s->timed);
+
+    qsort(pcs, n, sizeof(*pcs), cmp_pc_time);
+    printf("\ntop %d PCs by time since the previous checkpoint:\n", top);
+    printf("  %-18s %12s %12s %12s%s\n", "image offset", "checkpoints",
+           "total us", "mean ns", nunits ? "  pattern" : "");
+    for (i = 0; i < n && i < top && pcs[i].ns; i++) {
+        printf("  0x%016" PRIxPTR " %12" PRIu64 " %12.1f %12.0f  %s\n",
+               pcs[i].pc, pcs[i].count, pcs[i].ns / 1e3,
+               (double)pcs[i].ns / pcs[i].count, pc_pattern(pcs[i].pc));
+    }
+
+    if (nunits) {
+        int *order = malloc(npatterns * sizeof(int));
+        int j;
+
+        for (j = 0; j < npatterns; j++) {
+            order[j] = j;
+        }
+        sort_key = s->pattern_ns;
+        qsort(order, npatterns, sizeof(int), cmp_elem);
+        printf("\npatterns by time:\n");
+        printf("  %-24s %12s %12s %12s %6s\n", "pattern", "insns",
+               "total us", "mean ns", "%");
+        for (j = 0; j < npatterns; j++) {
+            int p = order[j];
+            if (!s->pattern_units[p]) {
+                continue;
+            }
+            printf("  %-24s %12" PRIu64 " %12.1f %12.0f %6.2f\n",
+                   patterns[p], s->pattern_units[p], s->pattern_ns[p] / 1e3,
+                   (double)s->pattern_ns[p] / s->pattern_units[p],
+                   100.0 * s->pattern_ns[p] / s->ns);
+        }
+        printf("  %-24s %12s %12.1f %12s %6.2f\n", "(setup)", "",
+               s->unattributed_ns / 1e3, "",
+               100.0 * s->unattributed_ns / s->ns);
+        free(order);
+    }
+}
+
+static void report(struct stats *s, int top)
+{
+    struct pc_entry *pcs;
+    int *order;
+    size_t i, n;
+
+    printf("%" PRIu64 " trace files, %" PRIu64 " checkpoints\n",
+           s->files, s->checkpoints);
+    if (s->truncated) {
+        printf("%" PRIu64 " truncated\n", s->truncated);
+    }
+    if (s->desync) {
+        printf("%" PRIu64 " pairs out of sync\n", s->desync);
+    }
+    if (pairs) {
+        printf("%" PRIu64 " register mismatches, %" PRIu64
+               " memory mismatches\n", s->reg_mismatches, s->mem_mismatches);
+    }
+
+    printf("\ncheckpoints by op:\n");
+    for (i = 0; i < NOPS; i++) {
+        if (s->ops[i]) {
+            printf("  %-12s %12" PRIu64 "\n", op_names[i], s->ops[i]);
+        }
+    }
+
+    pcs = malloc(s->pcs.used * sizeof(*pcs));
+    for (i = n = 0; i < s->pcs.size; i++) {
+        if (s->pcs.e[i].count) {
+            pcs[n++] = s->pcs.e[i];
+        }
+    }
+    qsort(pcs, n, sizeof(*pcs), cmp_pc);
+    printf("\n%zd distinct PCs, top %d by %s:\n", n, top,
+           pairs ? "mismatches" : "checkpoints");
+    printf("  %-18s %12s%s%s\n", "image offset", "checkpoints",
+           pairs ? "   mismatches" : "", nunits ? "  pattern" : "");
+    for (i = 0; i < n && i < top; i++) {
+        if (pairs) {
+            printf("  0x%016" PRIxPTR " %12" PRIu64 " %12" PRIu64 "  %s\n",
+                   pcs[i].pc, pcs[i].count, pcs[i].diffs,
+                   pc_pattern(pcs[i].pc));
+        } else {
+            printf("  0x%016" PRIxPTR " %12" PRIu64 "  %s\n",
+                   pcs[i].pc, pcs[i].count, pc_pattern(pcs[i].pc));
+        }
+    }
+    if (s->timed) {
+        report_time(s, pcs, n, top);
+    }
+    free(pcs);
+
+    order = malloc(nelems * sizeof(int));
+    for (i = 0; i < nelems; i++) {
+        order[i] = i;
+    }
+    sort_key = pairs ? s->diffs : s->changes;
+    qsort(order, nelems, sizeof(int), cmp_elem);
+    printf("\nregisters by %s:\n", pairs ? "mismatches" : "changes");
+    printf("  %-12s %12s%s\n", "register", "changes",
+           pairs ? "   mismatches" : "");
+    for (i = 0; i < nelems; i++) {
+        int e = order[i];
+        if (!s->changes[e] && !s->diffs[e]) {
+            continue;
+        }
+        if (pairs) {
+            printf("  %-12s %12" PRIu64 " %12" PRIu64 "\n",
+                   elems[e].name, s->changes[e], s->diffs[e]);
+        } else {
+            printf("  %-12s %12" PRIu64 "\n", elems[e].name, s->changes[e]);
+        }
+    }
+    free(order);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: risu-stats [options] <trace>...\n\n");
+    fprintf(stderr, "Summarise the checkpoints in a set of risu traces.\n\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr,
+            "  --pairs           Traces come in pairs to be compared with "
+            "each other\n"
+            "                    (eg master and apprentice)\n");
+    fprintf(stderr,
+            "  -j, --jobs=N      Use N worker threads (default: number of "
+            "CPUs)\n");
+    fprintf(stderr,
+            "  --top=N           Show the top N PCs (default 20)\n");
+    fprintf(stderr,
+            "  --test-fp-exc     Compare FP exception status bits too\n");
+    fprintf(stderr,
+            "  --map=FILE        Image map (risugen --map), to split the "
+            "time between\n"
+            "                    timestamped checkpoints by pattern\n");
+    fprintf(stderr,
+            "  --image=FILE      Image container (risugen --container), "
+            "instead of --map\n");
+}
+
+static int cmp_unit(const void *a, const void *b)
+{
+    const struct map_unit *x = a, *y = b;
+    return x->end < y->end ? -1 : x->end > y->end;
+}
+
+/* Read the insn records from an image map */
+static void read_map(const char *name)
+{
+    FILE *f = fopen(name, "r");
+    char line[1024];
+    size_t alloc = 0;
+
+    if (!f) {
+        perror(name);
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long start, len, istart, ilen;
+        char *pat;
+        int off, i;
+
+        if (sscanf(line, "insn %lu %lu %lu %lu %n",
+                   &start, &len, &istart, &ilen, &off) != 4) {
+            continue;
+        }
+        pat = line + off;
+        pat[strcspn(pat, "\n")] = 0;
+        for (i = 0; i < npatterns; i++) {
+            if (strcmp(patterns[i], pat) == 0) {
+                break;
+            }
+        }
+        if (i == npatterns) {
+            patterns = realloc(patterns, (npatterns + 1) * sizeof(char *));
+            patterns[npatterns++] = strdup(pat);
+        }
+        if (nunits == alloc) {
+            alloc = alloc ? alloc * 2 : 1024;
+            units = realloc(units, alloc * sizeof(*units));
+        }
+        units[nunits].end = start + len;
+        units[nunits].pattern = i;
+        nunits++;
+    }
+    fclose(f);
+    qsort(units, nunits, sizeof(*units), cmp_unit);
+}
+
+/* Take the units from an image container */
+static void read_image(const char *name)
+{
+    struct image_meta meta;
+    int fd = open(name, O_RDONLY);
+    uint32_t i;
+
+    if (fd < 0) {
+        perror(name);
+        exit(1);
+    }
+    if (image_read_meta(fd, &meta) != 0) {
+        fprintf(stderr, "%s is not a valid image container\n", name);
+        exit(1);
+    }
+    close(fd);
+    patterns = meta.names;
+    npatterns = meta.h.npatterns;
+    units = calloc(meta.h.nunits, sizeof(*units));
+    for (i = 0; i < meta.h.nunits; i++) {
+        units[i].end = meta.units[i].start + meta.units[i].len;
+        units[i].pattern = meta.units[i].pattern;
+    }
+    nunits = meta.h.nunits;
+    qsort(units, nunits, sizeof(*units), cmp_unit);
+}
+
+int main(int argc, char **argv)
+{
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int top = 20, i;
+    pthread_t *threads;
+    struct stats *stats;
+
+    for (;;) {
+        static struct option longopts[] = {
+            {"help", no_argument, 0, '?'},
+            {"pairs", no_argument, &pairs, 1},
+            {"jobs", required_argument, 0, 'j'},
+            {"top", required_argument, 0, 'n'},
+            {"test-fp-exc", no_argument, &test_fp_exc, 1},
+            {"map", required_argument, 0, 'm'},
+            {"image", required_argument, 0, 'i'},
+            {0, 0, 0, 0}
+        };
+        int optidx = 0;
+        int c = getopt_long(argc, argv, "j:", longopts, &optidx);
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 0:
+            break;
+        case 'j':
+            nthreads = strtol(optarg, 0, 10);
+            break;
+        case 'n':
+            top = strtol(optarg, 0, 10);
+            break;
+        case 'm':
+            read_map(optarg);
+            break;
+        case 'i':
+            read_image(optarg);
+            break;
+        case '?':
+            usage();
+            exit(1);
+        default:
+            abort();
+        }
+    }
+
+    jobs = argv + optind;
+    njobs = argc - optind;
+    if (!njobs || (pairs && (njobs & 1))) {
+        usage();
+        exit(1);
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+
+    build_elems();
+    threads = calloc(nthreads, sizeof(pthread_t));
+    stats = calloc(nthreads, sizeof(struct stats));
+    for (i = 0; i < nthreads; i++) {
+        stats_init(&stats[i]);
+        if (pthread_create(&threads[i], NULL, worker, &stats[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        if (i > 0) {
+            stats_merge(&stats[0], &stats[i]);
+        }
+    }
+
+    report(&stats[0], top);
+    return 0;
+}
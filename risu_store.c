@@ -0,0 +1,376 @@
+/*******************************************************************************
+ * Copyright (c) 2017 Linaro Limited
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ ******************************************************************************/
+
+/* risu-store: keep a corpus of traces in a deduplicating store (see
+ * store.c). Each trace stream is cut into chunks where a rolling hash
+ * of the last 64 bytes hits a pattern, so a stretch which several
+ * traces share (the register set up at the start of each test, a
+ * memory block, or a whole trace recorded twice) is cut the same way
+ * wherever it is, and stored once. The streams are those trace_read()
+ * sees: decompressed, so that the sharing isn't hidden by the
+ * compression.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "risu.h"
+
+/* Needed by the per-arch reginfo code we link against */
+__thread uintptr_t image_start_address;
+__thread void *memblock;
+int test_fp_exc;
+
+/* Chunks are at least CHUNK_MIN bytes, and after that end with
+ * probability 1 / (CHUNK_MASK + 1) at each byte: 10K on average.
+ */
+#define CHUNK_MIN (2 * 1024)
+#define CHUNK_MASK ((1 << 13) - 1)
+
+static uint64_t gear[256];
+
+static void init_gear(void)
+{
+    uint64_t x = 0;
+    int i;
+
+    /* splitmix64, so every store cuts the same way */
+    for (i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+struct add_stats {
+    uint64_t bytes;
+    size_t chunks, new_chunks;
+    uint64_t stored;
+};
+
+static int emit_chunk(const char *dir, FILE *manifest, const uint8_t *chunk,
+                      size_t len, struct add_stats *st)
+{
+    uint8_t hash[HASH_LEN];
+    char hashstr[HASH_STR_LEN];
+    size_t stored;
+
+    if (store_put_chunk(dir, chunk, len, hash, &stored) != 0) {
+        return -1;
+    }
+    hash_to_str(hash, hashstr);
+    fprintf(manifest, "%s %zu\n", hashstr, len);
+    st->bytes += len;
+    st->chunks++;
+    if (stored) {
+        st->new_chunks++;
+        st->stored += stored;
+    }
+    return 0;
+}
+
+static char *manifest_path(const char *dir, const char *name)
+{
+    char *path;
+
+    if (!name[0] || strchr(name, '/') || name[0] == '.'
+        || asprintf(&path, "%s/streams/%s", dir, name) < 0) {
+        return NULL;
+    }
+    return path;
+}
+
+/* Add the trace file trace_name to the store as stream name */
+static int add_stream(const char *dir, const char *trace_name,
+                      const char *name)
+{
+    static uint8_t in[64 * 1024], chunk[STORE_MAX_CHUNK];
+    struct add_stats st;
+    char *path, *tmp;
+    trace_file *t;
+    FILE *manifest;
+    size_t len = 0;
+    ssize_t got, i;
+    uint64_t h = 0;
+    int r = 0;
+
+    path = manifest_path(dir, name);
+    if (!path) {
+        fprintf(stderr, "risu-store: bad stream name %s\n", name);
+        return 1;
+    }
+    t = trace_open(trace_name, 0);
+    if (!t) {
+        perror(trace_name);
+        free(path);
+        return 1;
+    }
+    if (asprintf(&tmp, "%s.tmp.%d", path, getpid()) < 0
+        || !(manifest = fopen(tmp, "w"))) {
+        perror(path);
+        trace_close(t);
+        free(path);
+        return 1;
+    }
+    fprintf(manifest, STORE_MAGIC "%d\n", STORE_VERSION);
+    memset(&st, 0, sizeof(st));
+
+    while (r == 0 && (got = trace_read_some(t, in, sizeof(in))) > 0) {
+        for (i = 0; i < got; i++) {
+            chunk[len++] = in[i];
+            h = (h << 1) + gear[in[i]];
+            if ((len >= CHUNK_MIN && (h & CHUNK_MASK) == 0)
+                || len == STORE_MAX_CHUNK) {
+                r = emit_chunk(dir, manifest, chunk, len, &st);
+                len = 0;
+                h = 0;
+                if (r) {
+                    break;
+                }
+            }
+        }
+    }
+    if (r == 0 && got < 0) {
+        fprintf(stderr, "risu-store: error reading %s\n", trace_name);
+        r = -1;
+    }
+    if (r == 0 && len) {
+        r = emit_chunk(dir, manifest, chunk, len, &st);
+    }
+    trace_close(t);
+
+    if (fclose(manifest) != 0 || r != 0 || rename(tmp, path) != 0) {
+        fprintf(stderr, "risu-store: failed to add %s\n", trace_name);
+        unlink(tmp);
+        r = 1;
+    } else {
+        printf("%s: %" PRIu64 " bytes in %zu chunks, %zu new "
+               "(%" PRIu64 " bytes stored)\n", name, st.bytes, st.chunks,
+               st.new_chunks, st.stored);
+    }
+    free(tmp);
+    free(path);
+    return r;
+}
+
+/* Write stream name back out as an ordinary trace */
+static int get_stream(const char *dir, const char *name, const char *out)
+{
+    static uint8_t buf[64 * 1024];
+    char *path = manifest_path(dir, name);
+    trace_file *t, *o;
+    ssize_t got;
+    int r = 0;
+
+    t = path ? trace_open(path, 0) : NULL;
+    if (!t) {
+        fprintf(stderr, "risu-store: no stream %s\n", name);
+        free(path);
+        return 1;
+    }
+    o = trace_open(out, 1);
+    if (!o) {
+        perror(out);
+        trace_close(t);
+        free(path);
+        return 1;
+    }
+    while ((got = trace_read_some(t, buf, sizeof(buf))) > 0) {
+        if (trace_write(o, buf, got) != 0) {
+            r = 1;
+            break;
+        }
+    }
+    if (got < 0) {
+        r = 1;
+    }
+    trace_close(o);
+    trace_close(t);
+    free(path);
+    return r;
+}
+
+/* Sum the sizes of the chunk files */
+static void count_chunks(const char *dir, size_t *n, uint64_t *bytes)
+{
+    char *sub, *path;
+    struct dirent *e, *f;
+    struct stat st;
+    DIR *d, *c;
+
+    *n = 0;
+    *bytes = 0;
+    if (asprintf(&sub, "%s/chunks", dir) < 0 || !(d = opendir(sub))) {
+        return;
+    }
+    while ((e = readdir(d))) {
+        if (e->d_name[0] == '.' || asprintf(&path, "%s/%s", sub,
+                                            e->d_name) < 0) {
+            continue;
+        }
+        c = opendir(path);
+        while (c && (f = readdir(c))) {
+            char *chunk;
+
+            if (f->d_name[0] == '.' || strstr(f->d_name, ".tmp.")
+                || asprintf(&chunk, "%s/%s", path, f->d_name) < 0) {
+                continue;
+            }
+            if (stat(chunk, &st) == 0) {
+                (*n)++;
+                *bytes += st.st_size;
+            }
+            free(chunk);
+        }
+        if (c) {
+            closedir(c);
+        }
+        free(path);
+    }
+    closedir(d);
+    free(sub);
+}
+
+/* List the streams, and how much the store saves */
+static int list_streams(const char *dir)
+{
+    char line[128], *sub, *path;
+    uint64_t total = 0, stored;
+    size_t nchunks;
+    struct dirent *e;
+    DIR *d;
+
+    if (asprintf(&sub, "%s/streams", dir) < 0 || !(d = opendir(sub))) {
+        perror(dir);
+        return 1;
+    }
+    while ((e = readdir(d))) {
+        uint64_t bytes = 0;
+        size_t chunks = 0;
+        unsigned long len;
+        FILE *f;
+
+        if (e->d_name[0] == '.' || strstr(e->d_name, ".tmp.")
+            || asprintf(&path, "%s/%s", sub, e->d_name) < 0) {
+            continue;
+        }
+        f = fopen(path, "r");
+        if (f && fgets(line, sizeof(line), f)
+            && strncmp(line, STORE_MAGIC, strlen(STORE_MAGIC)) == 0) {
+            while (fgets(line, sizeof(line), f)) {
+                if (sscanf(line, "%*s %lu", &len) == 1) {
+                    bytes += len;
+                    chunks++;
+                }
+            }
+            printf("%-40s %12" PRIu64 " bytes %8zu chunks\n",
+                   e->d_name, bytes, chunks);
+            total += bytes;
+        }
+        if (f) {
+            fclose(f);
+        }
+        free(path);
+    }
+    closedir(d);
+    free(sub);
+
+    count_chunks(dir, &nchunks, &stored);
+    printf("total %" PRIu64 " bytes of streams in %zu unique chunks, "
+           "%" PRIu64 " bytes stored", total, nchunks, stored);
+    if (stored) {
+        printf(" (%.1fx)", (double)total / stored);
+    }
+    printf("\n");
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: risu-store <store> add [-n <name>] <trace>...\n"
+            "       risu-store <store> get <name> <trace>\n"
+            "       risu-store <store> ls\n\n");
+    fprintf(stderr, "Keep traces in a deduplicating store. The stream "
+            "added as <name>\n"
+            "can be read back by anything that reads traces as "
+            "<store>/streams/<name>.\n\n");
+    fprintf(stderr, "Commands:\n");
+    fprintf(stderr,
+            "  add               Add traces, named after the file unless "
+            "-n is given\n");
+    fprintf(stderr,
+            "  get               Write a stream back out as an ordinary "
+            "trace (- for\n"
+            "                    stdout)\n");
+    fprintf(stderr,
+            "  ls                List the streams, and the space they take "
+            "up\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir, *cmd, *name = NULL;
+    char *sub;
+    int i, r = 0;
+
+    if (argc < 3) {
+        usage();
+        exit(2);
+    }
+    dir = argv[1];
+    cmd = argv[2];
+    optind = 3;
+
+    if (strcmp(cmd, "add") == 0) {
+        int c;
+
+        while ((c = getopt(argc, argv, "n:")) != -1) {
+            if (c != 'n') {
+                usage();
+                exit(2);
+            }
+            name = optarg;
+        }
+        if (optind == argc || (name && argc - optind != 1)) {
+            usage();
+            exit(2);
+        }
+        mkdir(dir, 0777);
+        if (asprintf(&sub, "%s/chunks", dir) >= 0) {
+            mkdir(sub, 0777);
+            free(sub);
+        }
+        if (asprintf(&sub, "%s/streams", dir) >= 0) {
+            mkdir(sub, 0777);
+            free(sub);
+        }
+        init_gear();
+        for (i = optind; i < argc; i++) {
+            const char *base = strrchr(argv[i], '/');
+
+            r |= add_stream(dir, argv[i],
+                            name ? name : base ? base + 1 : argv[i]);
+        }
+        return r;
+    }
+    if (strcmp(cmd, "get") == 0 && argc == 5) {
+        return get_stream(dir, argv[3], argv[4]);
+    }
+    if (strcmp(cmd, "ls") == 0 && argc == 3) {
+        return list_streams(dir);
+    }
+    usage();
+    exit(2);
+}
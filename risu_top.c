@@ -0,0 +1,320 @@
+/*******************************************************************************
+ * Copyright (c) 2017 Linaro Limited
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ ******************************************************************************/
+
+/* risu-top: watch the live counters of running risu sessions (risu
+ * --stats), or print them for Prometheus' node exporter to pick up
+ * from its textfile directory.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "risu.h"
+
+struct page {
+    const char *name;
+    struct stats_page *p;
+    struct session_stats before[STATS_MAX_SESSIONS];
+    struct session_stats now[STATS_MAX_SESSIONS];
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct stats_page *map_page(const char *name)
+{
+    struct stats_page *p;
+    int fd = open(name, O_RDONLY);
+
+    if (fd < 0) {
+        perror(name);
+        return NULL;
+    }
+    p = mmap(NULL, sizeof(*p), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror(name);
+        return NULL;
+    }
+    if (__atomic_load_n(&p->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC
+        || p->version != STATS_VERSION) {
+        fprintf(stderr, "%s is not a risu stats page\n", name);
+        munmap(p, sizeof(*p));
+        return NULL;
+    }
+    return p;
+}
+
+/* Copy the sessions; the writers don't stop, so each counter is as of
+ * some moment during the copy, which is all we need.
+ */
+static void snapshot(struct page *pg, struct session_stats *to)
+{
+    int i;
+
+    for (i = 0; i < STATS_MAX_SESSIONS; i++) {
+        struct session_stats *s = &pg->p->sessions[i];
+
+        to[i].state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+        if (to[i].state == STATS_FREE || to[i].state == STATS_CLAIMED) {
+            continue;
+        }
+        memcpy((char *)&to[i] + sizeof(to[i].state),
+               (char *)s + sizeof(s->state), sizeof(*s) - sizeof(s->state));
+    }
+}
+
+static const char *state_name(struct session_stats *s)
+{
+    static char buf[32];
+
+    if (s->state == STATS_FINISHED) {
+        snprintf(buf, sizeof(buf), s->status ? "failed(%d)" : "done",
+                 s->status);
+        return buf;
+    }
+    if (kill(s->pid, 0) != 0 && errno == ESRCH) {
+        return "dead";
+    }
+    return "running";
+}
+
+static const char *human(uint64_t n, char *buf)
+{
+    const char *units = " KMGTP";
+    double v = n;
+
+    if (n < 10000) {
+        sprintf(buf, "%" PRIu64, n);
+        return buf;
+    }
+    while (v >= 1000 && units[1]) {
+        v /= 1024;
+        units++;
+    }
+    sprintf(buf, "%.1f%c", v, *units);
+    return buf;
+}
+
+static void print_top(struct page *pages, int npages, uint64_t interval)
+{
+    char b1[16], b2[16], b3[16];
+    uint64_t t = now_ns();
+    int i, j;
+
+    printf("%-7s %-24s %-10s %9s %10s %10s %7s %7s %5s %7s %5s %6s\n",
+           "PID", "IMAGE", "STATE", "CKPT/S", "CKPTS", "PC", "SENT",
+           "RECV", "WAIT%", "TRACE", "RATIO", "IDLE");
+    for (i = 0; i < npages; i++) {
+        for (j = 0; j < STATS_MAX_SESSIONS; j++) {
+            struct session_stats *s = &pages[i].now[j];
+            struct session_stats *b = &pages[i].before[j];
+            double secs = interval / 1e9, rate = 0, wait = 0;
+            uint64_t end;
+
+            if (s->state != STATS_RUNNING && s->state != STATS_FINISHED) {
+                continue;
+            }
+            /* same session as last time? */
+            if (b->start_ns == s->start_ns && b->pid == s->pid && secs) {
+                rate = (s->checkpoints - b->checkpoints) / secs;
+                wait = (s->send_wait_ns - b->send_wait_ns) / 1e9 / secs;
+            }
+            end = s->state == STATS_FINISHED ? s->end_ns : t;
+            printf("%-7d %-24.24s %-10s %9.0f %10" PRIu64 " %10" PRIx64
+                   " %7s %7s %5.1f %7s %5.1f %5.0fs\n",
+                   s->pid, s->image, state_name(s), rate, s->checkpoints,
+                   s->pc, human(s->bytes_sent, b1),
+                   human(s->bytes_received, b2), wait * 100,
+                   human(s->trace_bytes, b3),
+                   s->trace_file_bytes
+                   ? (double)s->trace_bytes / s->trace_file_bytes : 0.0,
+                   s->last_checkpoint_ns && end > s->last_checkpoint_ns
+                   ? (end - s->last_checkpoint_ns) / 1e9 : 0.0);
+        }
+    }
+}
+
+static void print_prometheus(struct page *pages, int npages)
+{
+    static const struct {
+        const char *name, *help;
+        size_t offset;
+    } metrics[] = {
+        { "risu_checkpoints_total", "Checkpoints reached",
+          offsetof(struct session_stats, checkpoints) },
+        { "risu_sent_bytes_total", "Bytes sent to the peer",
+          offsetof(struct session_stats, bytes_sent) },
+        { "risu_received_bytes_total", "Bytes received from the peer",
+          offsetof(struct session_stats, bytes_received) },
+        { "risu_send_wait_seconds_total", "Time spent in send_data_pkt",
+          offsetof(struct session_stats, send_wait_ns) },
+        { "risu_trace_bytes_total", "Trace bytes written, uncompressed",
+          offsetof(struct session_stats, trace_bytes) },
+        { "risu_trace_file_bytes_total", "Trace bytes written to disk",
+          offsetof(struct session_stats, trace_file_bytes) },
+        { "risu_pc", "Image offset of the last checkpoint",
+          offsetof(struct session_stats, pc) },
+        { "risu_idle_seconds", "Time since the last checkpoint", 0 },
+        { "risu_running", "1 while the session runs", 0 },
+    };
+    uint64_t t = now_ns();
+    size_t m;
+    int i, j;
+
+    for (m = 0; m < sizeof(metrics) / sizeof(metrics[0]); m++) {
+        printf("# HELP %s %s\n# TYPE %s %s\n", metrics[m].name,
+               metrics[m].help, metrics[m].name,
+               strstr(metrics[m].name, "_total") ? "counter" : "gauge");
+        for (i = 0; i < npages; i++) {
+            for (j = 0; j < STATS_MAX_SESSIONS; j++) {
+                struct session_stats *s = &pages[i].now[j];
+                double v;
+
+                if (s->state != STATS_RUNNING
+                    && s->state != STATS_FINISHED) {
+                    continue;
+                }
+                if (strcmp(metrics[m].name, "risu_idle_seconds") == 0) {
+                    uint64_t end = s->state == STATS_FINISHED ? s->end_ns : t;
+                    v = s->last_checkpoint_ns && end > s->last_checkpoint_ns
+                        ? (end - s->last_checkpoint_ns) / 1e9 : 0;
+                } else if (strcmp(metrics[m].name, "risu_running") == 0) {
+                    v = strcmp(state_name(s), "running") == 0;
+                } else {
+                    v = *(uint64_t *)((char *)s + metrics[m].offset);
+                    if (strstr(metrics[m].name, "_seconds")) {
+                        v /= 1e9;
+                    }
+                }
+                printf("%s{file=\"%s\",role=\"%s\",pid=\"%d\","
+                       "slot=\"%d\",image=\"%s\"} %.17g\n", metrics[m].name,
+                       pages[i].name, pages[i].p->role, s->pid, j,
+                       s->image, v);
+            }
+        }
+    }
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: risu-top [options] <stats file>...\n\n");
+    fprintf(stderr, "Show the live counters of risu sessions run with "
+            "--stats.\n\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr,
+            "  -d, --delay=SECS  Time between updates (default 1)\n");
+    fprintf(stderr,
+            "  -n, --count=N     Stop after N updates\n");
+    fprintf(stderr,
+            "  --prometheus      Print the counters once, in Prometheus "
+            "text format\n");
+}
+
+int main(int argc, char **argv)
+{
+    double delay = 1;
+    int count = -1, prometheus = 0, npages = 0, i;
+    struct page *pages;
+    uint64_t last;
+
+    for (;;) {
+        static struct option longopts[] = {
+            {"help", no_argument, 0, '?'},
+            {"delay", required_argument, 0, 'd'},
+            {"count", required_argument, 0, 'n'},
+            {"prometheus", no_argument, 0, 'P'},
+            {0, 0, 0, 0}
+        };
+        int optidx = 0;
+        int c = getopt_long(argc, argv, "d:n:", longopts, &optidx);
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 0:
+            break;
+        case 'd':
+            delay = strtod(optarg, NULL);
+            break;
+        case 'n':
+            count = strtol(optarg, 0, 10);
+            break;
+        case 'P':
+            prometheus = 1;
+            break;
+        case '?':
+            usage();
+            exit(1);
+        default:
+            abort();
+        }
+    }
+    if (optind == argc || delay <= 0) {
+        usage();
+        exit(1);
+    }
+
+    pages = calloc(argc - optind, sizeof(*pages));
+    for (i = optind; i < argc; i++) {
+        pages[npages].p = map_page(argv[i]);
+        if (pages[npages].p) {
+            pages[npages++].name = argv[i];
+        }
+    }
+    if (!npages) {
+        return 1;
+    }
+
+    if (prometheus) {
+        for (i = 0; i < npages; i++) {
+            snapshot(&pages[i], pages[i].now);
+        }
+        print_prometheus(pages, npages);
+        return 0;
+    }
+
+    for (i = 0; i < npages; i++) {
+        snapshot(&pages[i], pages[i].now);
+    }
+    last = now_ns();
+    while (count--) {
+        struct timespec ts = { (time_t)delay,
+                               (long)((delay - (time_t)delay) * 1e9) };
+        uint64_t t;
+
+        nanosleep(&ts, NULL);
+        t = now_ns();
+        for (i = 0; i < npages; i++) {
+            memcpy(pages[i].before, pages[i].now, sizeof(pages[i].now));
+            snapshot(&pages[i], pages[i].now);
+        }
+        if (isatty(STDOUT_FILENO)) {
+            printf("\033[H\033[J");
+        }
+        print_top(pages, npages, t - last);
+        fflush(stdout);
+        last = t;
+    }
+    return 0;
+}
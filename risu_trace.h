@@ -0,0 +1,249 @@
+/*******************************************************************************
+ * Copyright (c) 2017 Linaro Limited
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ ******************************************************************************/
+
+/* Reading risu traces: the file format, and the decoder in
+ * librisutrace.a. None of this depends on the arch risu was built
+ * for, so a trace recorded on any arch can be read on any host.
+ */
+
+#ifndef RISU_TRACE_H
+#define RISU_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Content hashes (hash.c) */
+#define HASH_LEN 16
+#define HASH_STR_LEN (HASH_LEN * 2 + 1)
+void hash_buffer(const void *data, size_t len, uint8_t hash[HASH_LEN]);
+void hash_to_str(const uint8_t hash[HASH_LEN], char buf[HASH_STR_LEN]);
+
+/* Ops code under test can request from risu: */
+#define OP_COMPARE 0
+#define OP_TESTEND 1
+#define OP_SETMEMBLOCK 2
+#define OP_GETMEMBLOCK 3
+#define OP_COMPAREMEM 4
+/* Benchmark blocks (risugen --bench), handled locally: */
+#define OP_BENCHSTART 5     /* paramreg is the number of iterations */
+#define OP_BENCHLOOP 6      /* paramreg is the number of insns in the block */
+/* Also handled locally: paramreg points at a table of register values
+ * in the image to load (see loadstate_op() in reginfo.c)
+ */
+#define OP_LOADSTATE 7
+
+/* Fingerprint mode: rather than the full state at each checkpoint,
+ * send or record only a hash of it (see reginfo_canonicalise()), or
+ * keep a running hash of all of them which is checked at the end of
+ * the test. On a mismatch a live master asks for the full state.
+ */
+#define FINGERPRINT_OFF 0
+#define FINGERPRINT_EACH 1      /* a hash per checkpoint */
+#define FINGERPRINT_CHAIN 2     /* one hash chain, at the end (traces only) */
+
+/* A trace is a struct trace_file_header and the schema after it,
+ * then a record for each checkpoint: a trace_header_t and its
+ * payload. Every integer in it is little-endian, whatever the host.
+ *
+ * The payload of a COMPAREMEM is the memory block, memblock_len
+ * bytes; a SETMEMBLOCK or GETMEMBLOCK has none. Any other op has the
+ * registers, as a series of blocks, each a struct reginfo_block and
+ * its data padded to a multiple of 8 bytes, ending with a
+ * REGINFO_END block. The schema block with the same tag says where
+ * the data goes in the recording arch's struct reginfo (of
+ * reginfo_size bytes): it is count pieces of equal size, which go
+ * stride bytes apart from offset. The schema's fields then say where
+ * each register is in that. Registers of 2, 4 or 8 bytes are
+ * little-endian integers, and larger ones are in the arch's own
+ * register layout.
+ *
+ * In a fingerprint trace the payload is a hash in place of the
+ * registers or memory; with FINGERPRINT_CHAIN there is only the
+ * TESTEND record, with the hash of the chain.
+ *
+ * Traces from before the file header (version 1) are no longer read.
+ */
+#define TRACE_MAGIC "RISUTRC"
+#define TRACE_VERSION 2
+
+struct trace_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;       /* this, and the schema */
+    char arch[16];              /* as risu was built, eg "aarch64" */
+    uint32_t layout;            /* the arch's REGINFO_LAYOUT */
+    uint32_t reginfo_size;
+    uint32_t memblock_len;
+    uint32_t fingerprint;       /* FINGERPRINT_* */
+    uint32_t nblocks, nfields;
+    uint8_t image_hash[HASH_LEN];
+    /* nblocks struct trace_schema_block, nfields trace_schema_field */
+};
+
+struct trace_schema_block {
+    uint32_t tag;
+    uint32_t offset;
+    uint32_t count;
+    uint32_t stride;
+};
+
+#define TRACE_FIELD_NAME_LEN 16
+
+/* A register, or count of them size bytes apart (eg "x" for x0-x30) */
+struct trace_schema_field {
+    char name[TRACE_FIELD_NAME_LEN];
+    uint32_t offset;
+    uint32_t size;
+    uint32_t count;
+    uint32_t reserved;
+};
+
+typedef struct {
+    uint64_t pc;                /* image offset */
+    uint32_t risu_op;
+    uint32_t reserved;
+    /* when we reached the checkpoint, in ns on a monotonic clock, with
+     * --timestamps (otherwise 0)
+     */
+    uint64_t timestamp;
+} trace_header_t;
+
+struct reginfo_block {
+    uint32_t tag;
+    uint32_t len;       /* of the data, not counting the padding */
+};
+
+#define REGINFO_END 0
+#define REGINFO_CORE 1      /* always first; arch specific tags follow */
+
+/* Trace files (trace.c) */
+typedef struct trace_file trace_file;
+
+/* Open a trace for reading or writing; "-" is stdin/stdout.
+ * Returns NULL on failure (with errno set).
+ */
+trace_file *trace_open(const char *name, int for_write);
+/* Read or write exactly bytes: 0 for success, 1 for failure/EOF */
+int trace_read(trace_file *t, void *ptr, size_t bytes);
+int trace_write(trace_file *t, void *ptr, size_t bytes);
+void trace_close(trace_file *t);
+
+/* Write the file header and schema (as trace_native_header() makes
+ * them); call before anything else is written. Returns as
+ * trace_write().
+ */
+int trace_write_header(trace_file *t, const struct trace_file_header *h);
+/* Read the file header of a trace being read: 0 for success, with *h
+ * the header as it is in the file and the schema after it, or one of
+ * these (and the trace can't be read).
+ */
+#define TRACE_BAD_HEADER 1
+#define TRACE_NO_HEADER 2       /* not a trace, or a version 1 one */
+int trace_read_header(trace_file *t, const struct trace_file_header **h);
+/* Say on stderr why trace_read_header() refused trace name */
+void trace_header_error(const char *name, int r);
+/* The FINGERPRINT_* mode of a trace being read */
+int trace_fingerprint_mode(trace_file *t);
+
+/* Read up to bytes of the trace as it was written, file header and
+ * all, for copying it: returns how many we got, 0 at EOF or -1 on
+ * error.
+ */
+ssize_t trace_read_some(trace_file *t, void *ptr, size_t bytes);
+
+/* Count what is written to the trace (before and after compression)
+ * in these counters, with relaxed atomics
+ */
+void trace_set_counters(trace_file *t, uint64_t *bytes, uint64_t *file_bytes);
+
+/* Hand the compression and writing of a trace opened for writing to a
+ * helper thread; trace_write() then just queues the data, so it is
+ * cheap enough to call from the SIGILL handler. Write errors are
+ * reported by a later trace_write().
+ */
+void trace_start_writer(trace_file *t);
+
+/* Likewise, decompress a trace opened for reading ahead of time on a
+ * helper thread, so trace_read() normally just copies out data which
+ * is already waiting.
+ */
+void trace_start_reader(trace_file *t);
+
+/* The trace store (store.c, and risu-store to fill it): trace streams
+ * kept as deduplicated, content defined chunks. trace_open() reads a
+ * stream's manifest (DIR/streams/NAME) as if it were the trace itself.
+ */
+#define STORE_MAGIC "RISU-STREAM "
+#define STORE_VERSION 1
+#define STORE_MAX_CHUNK (64 * 1024)
+
+typedef struct store_stream store_stream;
+
+/* Is the file open on fd a stream manifest? */
+int store_is_manifest(int fd);
+/* Open a manifest to read the stream back; NULL on failure */
+store_stream *store_open(const char *manifest);
+/* Read up to bytes, returning how many we got (0 at EOF, -1 on error) */
+ssize_t store_read(store_stream *s, void *ptr, size_t bytes);
+void store_close(store_stream *s);
+
+/* The malloc'd path of the chunk with this hash in store dir */
+char *store_chunk_path(const char *dir, const uint8_t hash[HASH_LEN]);
+/* Add a chunk to store dir if it isn't there already, returning its
+ * hash, and in stored how many bytes it took (0 if we had it).
+ * Returns 0 for success.
+ */
+int store_put_chunk(const char *dir, const void *data, size_t len,
+                    uint8_t hash[HASH_LEN], size_t *stored);
+
+/* The decoder (trace_decode.c): read the records of a trace from any
+ * arch, given its schema.
+ */
+typedef struct trace_decoder trace_decoder;
+
+struct trace_record {
+    uint64_t pc;
+    uint32_t op;
+    uint64_t timestamp;
+    /* The registers, laid out as the recording arch's struct reginfo
+     * (reginfo_size bytes), or NULL if the record has none
+     */
+    const uint8_t *regs;
+    /* The memory block of a COMPAREMEM, or the hash in a fingerprint
+     * trace, len bytes of it (NULL if none)
+     */
+    const uint8_t *data;
+    size_t len;
+};
+
+/* Open a trace to decode. Returns NULL on failure, having said why on
+ * stderr.
+ */
+trace_decoder *trace_decoder_open(const char *name);
+void trace_decoder_close(trace_decoder *d);
+/* The trace's header, and the nfields fields of its schema, with the
+ * integers in host order
+ */
+const struct trace_file_header *trace_decoder_header(trace_decoder *d);
+const struct trace_schema_field *trace_decoder_fields(trace_decoder *d);
+/* Read the next record: 0 for success, 1 at the end of the trace and
+ * -1 if it is truncated or malformed. The payload is valid until the
+ * next call.
+ */
+int trace_decoder_next(trace_decoder *d, struct trace_record *rec);
+/* Element i of a field of a record's registers: the value of a
+ * register of up to 8 bytes, or a pointer to its bytes (NULL if the
+ * record has no registers).
+ */
+uint64_t trace_field_value(const struct trace_record *rec,
+                           const struct trace_schema_field *f, int i);
+const uint8_t *trace_field_bytes(const struct trace_record *rec,
+                                 const struct trace_schema_field *f, int i);
+
+#endif /* RISU_TRACE_H */
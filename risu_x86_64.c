@@ -0,0 +1,70 @@
+/******************************************************************************
+ * Copyright (c) 2017 Linaro Limited
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *****************************************************************************/
+
+#include <string.h>
+
+#include "risu.h"
+
+/* A risuop is UD2 followed by a byte holding the op. A checkpoint slot
+ * is a NOP of the same size (nopl (%rax)).
+ */
+#define UD2_0 0x0f
+#define UD2_1 0x0b
+#define RISUOP_LEN 3
+
+static const uint8_t slot_insn[RISUOP_LEN] = { 0x0f, 0x1f, 0x00 };
+static const uint8_t filled_slot[RISUOP_LEN] = { UD2_0, UD2_1, OP_COMPARE };
+
+void advance_pc(void *vuc)
+{
+    /* We can't tell the length of an arbitrary x86 insn, so this
+     * assumes it was a risuop; risugen doesn't generate UNDEFs.
+     */
+    ucontext_t *uc = vuc;
+    uc->uc_mcontext.gregs[REG_RIP] += RISUOP_LEN;
+}
+
+void set_ucontext_paramreg(void *vuc, uint64_t value)
+{
+    ucontext_t *uc = vuc;
+    uc->uc_mcontext.gregs[REG_RAX] = value;
+}
+
+uint64_t get_reginfo_paramreg(struct reginfo *ri)
+{
+    return ri->regs[0];
+}
+
+int get_risuop(struct reginfo *ri)
+{
+    /* Return the risuop we have been asked to do
+     * (or -1 if this was a SIGILL for a non-risuop insn)
+     */
+    uint32_t insn = ri->faulting_insn;
+
+    if ((insn & 0xffff) != (UD2_0 | (UD2_1 << 8))) {
+        return -1;
+    }
+    return insn >> 16;
+}
+
+uintptr_t get_pc(struct reginfo *ri)
+{
+   return ri->rip;
+}
+
+int fill_checkpoint_slot(void *vuc, uintptr_t addr)
+{
+    uint8_t *p = (uint8_t *) addr;
+
+    if (memcmp(p, slot_insn, sizeof(slot_insn)) != 0) {
+        return 0;
+    }
+    memcpy(p, filled_slot, sizeof(filled_slot));
+    return 1;
+}
@@ -27,6 +27,10 @@ our @ISA    = qw(Exporter);
 our @EXPORT = qw(write_test_code);
 
 my $periodic_reg_random = 1;
+my $loadstate = 0;
+
+# Position of the last test instruction generated, for the image map
+my ($insn_start, $insn_end);
 my $enable_aarch64_ld1 = 0;
 
 # Note that we always start in ARM mode even if the C code was compiled for
@@ -93,6 +97,9 @@ my $OP_TESTEND = 1;        # end of test, stop
 my $OP_SETMEMBLOCK = 2;    # r0 is address of memory block (8192 bytes)
 my $OP_GETMEMBLOCK = 3;    # add the address of memory block to r0
 my $OP_COMPAREMEM = 4;     # compare memory block
+my $OP_BENCHSTART = 5;     # r0 is the iteration count of a bench block
+my $OP_BENCHLOOP = 6;      # r0 is its insn count; loop or end it
+my $OP_LOADSTATE = 7;      # r0 is the address of a register table
 
 sub write_thumb_risuop($)
 {
@@ -125,6 +132,22 @@ sub write_risuop($)
     }
 }
 
+# A checkpoint slot is a no-op the same size as a risuop, emitted
+# where a compare would go in --compare-every mode. If a sparse
+# checkpoint fails risu rewrites the slots in the failing region
+# into OP_COMPARE risuops and re-runs it.
+sub write_checkpoint_slot()
+{
+    image_slot($bytecount);
+    if ($is_thumb) {
+        insn16(0xbf00);         # nop
+    } elsif ($is_aarch64) {
+        insn32(0xd503201f);     # nop
+    } else {
+        insn32(0xe320f000);     # nop
+    }
+}
+
 sub write_switch_to_thumb()
 {
     # Switch to thumb if we're not already there
@@ -282,14 +305,16 @@ sub write_mov_ri($$)
     }
 }
 
-# write random fp value of passed precision (1=single, 2=double, 4=quad)
-sub write_random_fpreg_var($)
+# random fp value of passed precision (1=single, 2=double, 4=quad),
+# as a list of 32 bit words, least significant first
+sub random_fpreg_var($)
 {
     my ($precision) = @_;
     my $randomize_low = 0;
+    my @words;
 
     if ($precision != 1 && $precision != 2 && $precision != 4) {
-	die "write_random_fpreg: invalid precision.\n";
+	die "random_fpreg_var: invalid precision.\n";
     }
 
     my ($low, $high);
@@ -324,9 +349,16 @@ sub write_random_fpreg_var($)
 	if ($randomize_low) {
 	    $low = rand(0xffffffff);
 	}
-	insn32($low);
+	push @words, int($low);
     }
-    insn32($high);
+    push @words, int($high);
+    return @words;
+}
+
+sub write_random_fpreg_var($)
+{
+    my ($precision) = @_;
+    insn32($_) for random_fpreg_var($precision);
 }
 
 sub write_random_double_fpreg()
@@ -390,22 +422,26 @@ sub write_random_single_fpreg()
     insn32($value);
 }
 
-sub write_random_arm_fpreg()
+sub random_arm_fpreg()
 {
-    # Write out 64 bits of random data intended to
-    # initialise an FP register.
+    # 64 bits of random data intended to initialise an FP
+    # register, as two words, least significant first.
     # We tweak the "randomness" here to increase the
     # chances of picking interesting values like
     # NaN, -0.0, and so on, which would be unlikely
     # to occur if we simply picked 64 random bits.
     if (rand() < 0.5) {
-        write_random_fpreg_var(2); # double
+        return random_fpreg_var(2); # double
     } else {
-        write_random_fpreg_var(1); # single
-        write_random_fpreg_var(1); # single
+        return (random_fpreg_var(1), random_fpreg_var(1)); # singles
     }
 }
 
+sub write_random_arm_fpreg()
+{
+    insn32($_) for random_arm_fpreg();
+}
+
 sub write_random_arm_regdata($)
 {
     my ($fp_enabled) = @_;
@@ -490,11 +526,63 @@ sub write_random_aarch64_regdata($)
     }
 }
 
+# Load the table of registers for an OP_LOADSTATE into r0/x0 and
+# have risu load them, then jump over the table
+sub write_loadstate(@)
+{
+    my $table = loadstate_table(@_);
+    write_pc_adr(0, 3 * 4);
+    write_risuop($OP_LOADSTATE);
+    write_jump_fwd(length($table));
+    write_data($table);
+}
+
+# As write_random_arm_regdata(), with an OP_LOADSTATE
+sub write_random_arm_loadstate($)
+{
+    my ($fp_enabled) = @_;
+    write_switch_to_arm();
+
+    my @table = ([ "r", 0, 4, map { int(rand(0xffffffff)) } 0..12 ],
+                 [ "r", 14, 4, int(rand(0xffffffff)) ],
+                 [ "cpsr", 0, 4, 0 ]);
+    if ($fp_enabled) {
+        my @d;
+        for (0..31) {
+            my ($low, $high) = random_arm_fpreg();
+            push @d, $low | ($high << 32);
+        }
+        push @table, [ "d", 0, 8, @d ];
+    }
+    write_loadstate(@table);
+}
+
+# As write_random_aarch64_regdata(). The vector registers are still
+# loaded by the code: on an SVE host risu sets them from the Z
+# registers, so "v" entries would be ignored, and we can't write Z
+# entries without knowing the host's vector length.
+sub write_random_aarch64_loadstate($)
+{
+    my ($fp_enabled) = @_;
+
+    if ($fp_enabled) {
+        write_random_aarch64_fpdata();
+    }
+    write_loadstate([ "x", 0, 8,
+                      map { (int(rand(0xffffffff)) << 32)
+                            | int(rand(0xffffffff)) } 0..30 ],
+                    [ "flags", 0, 4, 0 ]);
+}
+
 sub write_random_register_data($)
 {
     my ($fp_enabled) = @_;
 
-    if ($is_aarch64) {
+    if ($loadstate && $is_aarch64) {
+        write_random_aarch64_loadstate($fp_enabled);
+    } elsif ($loadstate) {
+        write_random_arm_loadstate($fp_enabled);
+    } elsif ($is_aarch64) {
         write_random_aarch64_regdata($fp_enabled);
     } else {
         write_random_arm_regdata($fp_enabled);
@@ -829,6 +917,7 @@ sub gen_one_insn($$)
             }
         }
 
+        $insn_start = $bytecount;
         if ($is_thumb) {
             # Since the encoding diagrams in the ARM ARM give 32 bit
             # Thumb instructions as low half | high half, we
@@ -846,6 +935,7 @@ sub gen_one_insn($$)
             # ARM is simple, always a 32 bit word
             insn32($insn);
         }
+        $insn_end = $bytecount;
 
         if (defined $memblock) {
             # Clean up following a memory access instruction:
@@ -871,6 +961,33 @@ sub gen_one_insn($$)
     }
 }
 
+# --bench: each group of patterns goes in a block of straight-line
+# code with no checkpoints, which risu runs $iterations times and times.
+sub write_bench_blocks($$$$$)
+{
+    my ($details, $groups, $numinsns, $iterations, $condprob) = @_;
+    my $n = 0;
+
+    for my $g (@$groups) {
+        my ($name, @keys) = @$g;
+        write_mov_ri(0, $iterations);
+        my $start = $bytecount;
+        write_risuop($OP_BENCHSTART);
+        for my $i (1..$numinsns) {
+            my $insn_enc = $keys[int rand (@keys)];
+            my $forcecond = (rand() < $condprob) ? 1 : 0;
+            my $unit = $bytecount;
+            gen_one_insn($forcecond, $details->{$insn_enc});
+            map_record('insn', $unit, $bytecount - $unit,
+                       $insn_start, $insn_end - $insn_start, $insn_enc);
+            progress_update(++$n);
+        }
+        write_mov_ri(0, $numinsns);
+        write_risuop($OP_BENCHLOOP);
+        bench_block($start, $bytecount - $start, $name);
+    }
+}
+
 sub write_test_code($$$$$$$$)
 {
     my ($params) = @_;
@@ -892,21 +1009,47 @@ sub write_test_code($$$$$$$$)
     my $condprob = $params->{ 'condprob' };
     my $fpscr = $params->{ 'fpscr' };
     my $numinsns = $params->{ 'numinsns' };
+    my $bench = $params->{ 'bench' };
+    my $compare_every = $params->{ 'compare_every' };
     my $fp_enabled = $params->{ 'fp_enabled' };
+    $loadstate = $params->{ 'loadstate' } // 0;
     my $outfile = $params->{ 'outfile' };
+    my $mapfile = $params->{ 'mapfile' };
 
     my @pattern_re = @{ $params->{ 'pattern_re' } };
     my @not_pattern_re = @{ $params->{ 'not_pattern_re' } };
     my %insn_details = %{ $params->{ 'details' } };
 
     open_bin($outfile);
+    if (defined $mapfile) {
+        open_map($mapfile);
+        if ($is_aarch64) {
+            map_record('arch', 'aarch64');
+            map_record('endian', 'little');
+            map_record('disas', '-m', 'aarch64');
+            map_encoding('nop', 0xd503201f, 32);
+            map_encoding('testend', 0x00005af0 | $OP_TESTEND, 32);
+        } elsif ($test_thumb) {
+            map_record('arch', 'thumb');
+            map_record('endian', 'little');
+            map_record('disas', '-m', 'arm', '-M', 'force-thumb');
+            map_encoding('nop', 0xbf00, 16);
+            map_encoding('testend', 0xdee0 | $OP_TESTEND, 16);
+        } else {
+            map_record('arch', 'arm');
+            map_record('endian', 'little');
+            map_record('disas', '-m', 'arm');
+            map_encoding('nop', 0xe320f000, 32);
+            map_encoding('testend', 0xe7fe5af0 | $OP_TESTEND, 32);
+        }
+    }
 
     # convert from probability that insn will be conditional to
     # probability of forcing insn to unconditional
     $condprob = 1 - $condprob;
 
     # TODO better random number generator?
-    srand(0);
+    srand($params->{ 'seed' });
 
     # Get a list of the insn keys which are permitted by the re patterns
     my @keys = sort keys %insn_details;
@@ -919,12 +1062,18 @@ sub write_test_code($$$$$$$$)
         my $re = '\b((' . join(')|(',@not_pattern_re) . '))\b';
         @keys = grep !/$re/, @keys;
     }
+    # a benchmark runs each group of patterns separately
+    my @groups;
+    if ($bench) {
+        @groups = bench_groups(\%insn_details, @keys);
+        @keys = map { @$_[1..$#$_] } @groups;
+    }
     if (!@keys) {
         print STDERR "No instruction patterns available! (bad config file or --pattern argument?)\n";
         exit(1);
     }
     print "Generating code using patterns: @keys...\n";
-    progress_start(78, $numinsns);
+    progress_start(78, $bench ? $numinsns * @groups : $numinsns);
 
     if ($fp_enabled) {
         write_set_fpscr($fpscr);
@@ -932,28 +1081,53 @@ sub write_test_code($$$$$$$$)
 
     if (grep { defined($insn_details{$_}->{blocks}->{"memory"}) } @keys) {
         write_memblock_setup();
+        image_info('memblock_len', 8192);
     }
     # memblock setup doesn't clean its registers, so this must come afterwards.
+    my $reset = $bytecount;
     write_random_register_data($fp_enabled);
     write_switch_to_test_mode();
+    map_record('reset', $reset, $bytecount - $reset);
 
-    for my $i (1..$numinsns) {
-        my $insn_enc = $keys[int rand (@keys)];
-        #dump_insn_details($insn_enc, $insn_details{$insn_enc});
-        my $forcecond = (rand() < $condprob) ? 1 : 0;
-        gen_one_insn($forcecond, $insn_details{$insn_enc});
-        write_risuop($OP_COMPARE);
-        # Rewrite the registers periodically. This avoids the tendency
-        # for the VFP registers to decay to NaNs and zeroes.
-        if ($periodic_reg_random && ($i % 100) == 0) {
-            write_random_register_data($fp_enabled);
-            write_switch_to_test_mode();
+    if ($bench) {
+        write_bench_blocks(\%insn_details, \@groups, $numinsns, $bench,
+                           $condprob);
+    } else {
+        for my $i (1..$numinsns) {
+            my $insn_enc = $keys[int rand (@keys)];
+            #dump_insn_details($insn_enc, $insn_details{$insn_enc});
+            my $forcecond = (rand() < $condprob) ? 1 : 0;
+            my $unit = $bytecount;
+            gen_one_insn($forcecond, $insn_details{$insn_enc});
+            map_record('insn', $unit, $bytecount - $unit,
+                       $insn_start, $insn_end - $insn_start, $insn_enc);
+            # Rewrite the registers periodically. This avoids the tendency
+            # for the VFP registers to decay to NaNs and zeroes.
+            my $reg_random = $periodic_reg_random && ($i % 100) == 0;
+            # Always compare before randomising, so a sparse region never
+            # spans the register setup code and its inline data.
+            if ($reg_random || ($i % $compare_every) == 0) {
+                map_record('compare', $bytecount);
+                write_risuop($OP_COMPARE);
+            } else {
+                map_record('slot', $bytecount);
+                write_checkpoint_slot();
+            }
+            if ($reg_random) {
+                $reset = $bytecount;
+                write_random_register_data($fp_enabled);
+                write_switch_to_test_mode();
+                map_record('reset', $reset, $bytecount - $reset);
+            }
+            progress_update($i);
         }
-        progress_update($i);
     }
+    map_record('end', $bytecount);
     write_risuop($OP_TESTEND);
     progress_end();
     close_bin();
+    close_map();
+    bench_summary() if $bench;
 }
 
 1;
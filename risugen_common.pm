@@ -23,10 +23,14 @@ BEGIN {
     require Exporter;
 
     our @ISA = qw(Exporter);
-    our @EXPORT = qw(open_bin close_bin set_endian insn32 insn16 $bytecount
+    our @EXPORT = qw(open_bin close_bin set_endian insn32 insn16 insn8 $bytecount
                    progress_start progress_update progress_end
                    eval_with_fields is_pow_of_2 sextract ctz
-                   dump_insn_details);
+                   dump_insn_details
+                   open_map close_map map_record map_encoding
+                   bench_groups bench_block bench_summary
+                   image_container image_info set_container_info
+                   loadstate_table write_data image_slot);
 }
 
 our $bytecount;
@@ -40,15 +44,130 @@ sub set_endian
     $bigendian = @_;
 }
 
+# Image containers (see struct image_header in risu.h). If asked to,
+# open_bin() leaves room for the header, and close_bin() appends the
+# table of test units (from the 'insn' map records) and the pattern
+# names, and then fills the header in.
+my $IMAGE_ALIGN = 65536;
+my $container = 0;
+my %image_info;
+my @image_units;
+my @image_patterns;
+my %image_pattern_index;
+
+sub image_container(%)
+{
+    # Write a container rather than a plain image, with the given
+    # arch, seed and info (text saying how it was generated).
+    %image_info = @_;
+    $container = 1;
+}
+
+sub image_info($$)
+{
+    my ($key, $value) = @_;
+    $image_info{$key} = $value;
+}
+
+sub image_unit($$$)
+{
+    my ($start, $len, $pattern) = @_;
+    if (!exists $image_pattern_index{$pattern}) {
+        $image_pattern_index{$pattern} = scalar @image_patterns;
+        push @image_patterns, $pattern;
+    }
+    push @image_units, [ $start, $len, $image_pattern_index{$pattern} ];
+}
+
+# Checkpoint slots (--compare-every). Their offsets go in a table
+# after the end of the test, so risu only ever rewrites a slot where
+# we put one, not the same bytes inside a test insn: the offsets in
+# ascending order and then how many there are, as 32 bit words, and
+# then the magic "RISUSLOT" to end the code with.
+my @image_slots;
+
+sub image_slot($)
+{
+    my ($offset) = @_;
+    push @image_slots, $offset;
+}
+
+sub write_slot_table()
+{
+    insn32($_) for @image_slots;
+    insn32(scalar @image_slots);
+    print BIN "RISUSLOT";
+    $bytecount += 8;
+}
+
+sub write_image_meta()
+{
+    my $e = $bigendian ? ">" : "<";
+    my $pad8 = sub { "\0" x ((8 - $_[0] % 8) % 8) };
+
+    my $code_size = $bytecount;
+    my $units_offset = $IMAGE_ALIGN + $code_size;
+    print BIN $pad8->($units_offset);
+    $units_offset += (8 - $units_offset % 8) % 8;
+    for my $u (@image_units) {
+        print BIN pack("L$e L$e L$e", @$u);
+    }
+    my $names_offset = $units_offset + 12 * @image_units;
+    my $names = join('', map { "$_\0" } @image_patterns);
+    print BIN $names;
+    my $info_offset = $names_offset + length($names);
+    my $info = $image_info{info} // '';
+    print BIN $info;
+
+    seek(BIN, 0, 0) or die "can't seek in output file: $!";
+    print BIN pack("a8 L$e L$e a16 Q$e Q$e Q$e Q$e L$e L$e Q$e Q$e Q$e Q$e",
+                   "RISUIMG", 1, $image_info{memblock_len} // 0,
+                   $image_info{arch}, $image_info{seed} // 0,
+                   $IMAGE_ALIGN, $code_size,
+                   $units_offset, scalar @image_units, scalar @image_patterns,
+                   $names_offset, length($names),
+                   $info_offset, length($info));
+}
+
+# Replace the info in an existing container file, eg one copied from
+# the risugen --cache, which is at the end of it. The header is 104
+# bytes, with the info's offset and length last.
+sub set_container_info($$)
+{
+    my ($file, $info) = @_;
+    open(my $fh, "+<", $file) or die "can't open $file: $!";
+    binmode($fh);
+    my $hdr;
+    read($fh, $hdr, 104) == 104 && substr($hdr, 0, 8) eq "RISUIMG\0"
+        or die "$file is not an image container";
+    my $e = unpack("V", substr($hdr, 8, 4)) == 1 ? "<" : ">";
+    my ($info_offset) = unpack("Q$e", substr($hdr, 88, 8));
+    truncate($fh, $info_offset) or die "can't truncate $file: $!";
+    seek($fh, $info_offset, 0) or die "can't seek in $file: $!";
+    print $fh $info;
+    seek($fh, 96, 0) or die "can't seek in $file: $!";
+    print $fh pack("Q$e", length($info));
+    close($fh) or die "can't close $file: $!";
+}
+
 sub open_bin
 {
     my ($fname) = @_;
+    # a new file, not one it may be hardlinked to (risugen --cache)
+    unlink($fname) if -f $fname;
     open(BIN, ">", $fname) or die "can't open %fname: $!";
+    binmode(BIN);
+    if ($container) {
+        # the header goes in the first page, once we know it
+        print BIN "\0" x $IMAGE_ALIGN;
+    }
     $bytecount = 0;
 }
 
 sub close_bin
 {
+    write_slot_table() if @image_slots;
+    write_image_meta() if $container;
     close(BIN) or die "can't close output file: $!";
 }
 
@@ -66,6 +185,129 @@ sub insn16($)
     $bytecount += 2;
 }
 
+sub insn8($)
+{
+    my ($insn) = @_;
+    print BIN pack("C", $insn);
+    $bytecount += 1;
+}
+
+# Raw data in the image, eg a loadstate_table()
+sub write_data($)
+{
+    my ($data) = @_;
+    print BIN $data;
+    $bytecount += length($data);
+}
+
+# The register table for an OP_LOADSTATE (see loadstate_op() in
+# reginfo.c). Each argument is [name, first, size, values...] for
+# elements first onwards of the reginfo field name, each of size
+# bytes: values up to 8 bytes are numbers, and larger ones are
+# strings of bytes in the target's order.
+sub loadstate_table(@)
+{
+    my $e = $bigendian ? ">" : "<";
+    my %fmt = (1 => "C", 2 => "S$e", 4 => "L$e", 8 => "Q$e");
+    my $table = "";
+    for my $entry (@_) {
+        my ($name, $first, $size, @values) = @$entry;
+        my $data = $size > 8 ? join("", @values)
+                             : pack("$fmt{$size}*", @values);
+        die "bad loadstate entry $name" if length($data) != $size * @values;
+        $table .= pack("a8 C C S$e", $name, $first, scalar @values, $size);
+        $table .= $data . "\0" x (-length($data) & 3);
+    }
+    return $table . "\0" x 4;
+}
+
+# Image map. If asked to, we write a text file describing the layout
+# of the image we generate: one line per record, "kind args...".
+#   insn <unitstart> <unitlen> <insnstart> <insnlen> <pattern name>
+#      a test instruction and its setup code, up to its checkpoint
+#   compare <offset> / slot <offset>
+#      a register compare or a --compare-every checkpoint slot
+#   reset <offset> <len>
+#      a register randomisation block (ending in a compare)
+#   end <offset>
+#      the final OP_TESTEND
+#   bench <offset> <len> <group>
+#      a --bench block, from its OP_BENCHSTART to its OP_BENCHLOOP
+# plus header records describing the encodings tools need to edit
+# the image (nop, testend) and how to disassemble it (disas).
+# Offsets are in bytes from the start of the image.
+my $mapfile;
+
+sub open_map($)
+{
+    my ($fname) = @_;
+    unlink($fname) if -f $fname;
+    open($mapfile, ">", $fname) or die "can't open $fname: $!";
+    print $mapfile "# risugen image map\n";
+}
+
+sub close_map()
+{
+    if (defined $mapfile) {
+        close($mapfile) or die "can't close map file: $!";
+        undef $mapfile;
+    }
+}
+
+sub map_record(@)
+{
+    image_unit($_[1], $_[2], $_[5]) if $container && $_[0] eq 'insn';
+    print $mapfile join(' ', @_) . "\n" if defined $mapfile;
+}
+
+sub map_encoding($$$)
+{
+    # Record an instruction encoding in the map as hex bytes
+    # in image (memory) order.
+    my ($what, $insn, $width) = @_;
+    my $bytes;
+    if ($width == 16) {
+        $bytes = pack($bigendian ? "n" : "v", $insn);
+    } else {
+        $bytes = pack($bigendian ? "N" : "V", $insn);
+    }
+    map_record($what, unpack("H*", $bytes));
+}
+
+# Benchmark images (--bench). The test insns are run in one block
+# per group of patterns with the same instruction name, so
+# "ADD A1" and "ADD A2" are timed together. Memory patterns are left
+# out, since each would trap to risu for OP_GETMEMBLOCK.
+sub bench_groups($@)
+{
+    my ($details, @keys) = @_;
+    my %groups;
+    for my $k (@keys) {
+        next if defined($details->{$k}->{blocks}->{"memory"});
+        my ($name) = split(/ /, $k);
+        push @{ $groups{$name} }, $k;
+    }
+    return map { [ $_, @{ $groups{$_} } ] } sort keys %groups;
+}
+
+my @bench_blocks;
+
+sub bench_block($$$)
+{
+    # Note a block from its OP_BENCHSTART to the end of its
+    # OP_BENCHLOOP; risu reports timings by group name from a
+    # --container image, and by the OP_BENCHSTART offset otherwise.
+    my ($start, $len, $name) = @_;
+    map_record('bench', $start, $len, $name);
+    push @bench_blocks, sprintf("0x%x %s", $start, $name);
+}
+
+sub bench_summary()
+{
+    print "Bench blocks (image offset, group):\n";
+    print "  $_\n" for @bench_blocks;
+}
+
 # Progress bar implementation
 my $lastprog;
 my $proglen;
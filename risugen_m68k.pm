@@ -24,6 +24,9 @@ our @EXPORT = qw(write_test_code);
 
 my $periodic_reg_random = 1;
 
+# Position of the last test instruction generated, for the image map
+my $insn_start;
+
 #
 # Maximum alignment restriction permitted for a memory op.
 my $MAXALIGN = 64;
@@ -94,6 +97,8 @@ my $OP_TESTEND = 1;        # end of test, stop
 my $OP_SETMEMBLOCK = 2;    # r0 is address of memory block (8192 bytes)
 my $OP_GETMEMBLOCK = 3;    # add the address of memory block to r0
 my $OP_COMPAREMEM = 4;     # compare memory block
+my $OP_BENCHSTART = 5;     # a0 is the iteration count of a bench block
+my $OP_BENCHLOOP = 6;      # a0 is its insn count; loop or end it
 
 sub write_random_register_data()
 {
@@ -143,6 +148,7 @@ sub gen_one_insn($$)
         # OK, we got a good one
         $constraintfailures = 0;
 
+        $insn_start = $bytecount;
         insn16($insn >> 16);
         if ($insnwidth == 32) {
             insn16($insn & 0xffff);
@@ -152,13 +158,53 @@ sub gen_one_insn($$)
     }
 }
 
+# No-op placeholder for a compare in --compare-every mode; risu
+# rewrites these into OP_COMPARE risuops to re-run a failing region.
+sub write_checkpoint_slot()
+{
+    image_slot($bytecount);
+    # two nops, to match the size of a risuop
+    insn16(0x4e71);
+    insn16(0x4e71);
+}
+
+# --bench: each group of patterns goes in a block of straight-line
+# code with no checkpoints, which risu runs $iterations times and times.
+sub write_bench_blocks($$$$$)
+{
+    my ($details, $groups, $numinsns, $iterations, $condprob) = @_;
+    my $n = 0;
+
+    for my $g (@$groups) {
+        my ($name, @keys) = @$g;
+        write_mov_ri(8, $iterations);
+        my $start = $bytecount;
+        write_risuop($OP_BENCHSTART);
+        for my $i (1..$numinsns) {
+            my $insn_enc = $keys[int rand (@keys)];
+            my $forcecond = (rand() < $condprob) ? 1 : 0;
+            my $unit = $bytecount;
+            gen_one_insn($forcecond, $details->{$insn_enc});
+            map_record('insn', $unit, $bytecount - $unit,
+                       $insn_start, $bytecount - $insn_start, $insn_enc);
+            progress_update(++$n);
+        }
+        write_mov_ri(8, $numinsns);
+        write_risuop($OP_BENCHLOOP);
+        bench_block($start, $bytecount - $start, $name);
+    }
+}
+
 sub write_test_code($)
 {
     my ($params) = @_;
 
     my $condprob = $params->{ 'condprob' };
     my $numinsns = $params->{ 'numinsns' };
+    my $bench = $params->{ 'bench' };
+    my $compare_every = $params->{ 'compare_every' };
     my $outfile = $params->{ 'outfile' };
+    my $mapfile = $params->{ 'mapfile' };
 
     my @pattern_re = @{ $params->{ 'pattern_re' } };
     my @not_pattern_re = @{ $params->{ 'not_pattern_re' } };
@@ -168,13 +214,21 @@ sub write_test_code($)
     set_endian(1);
 
     open_bin($outfile);
+    if (defined $mapfile) {
+        open_map($mapfile);
+        map_record('arch', 'm68k');
+        map_record('endian', 'big');
+        map_record('disas', '-m', 'm68k');
+        map_encoding('nop', 0x4e71, 16);
+        map_encoding('testend', 0x4afc7000 | $OP_TESTEND, 32);
+    }
 
     # convert from probability that insn will be conditional to
     # probability of forcing insn to unconditional
     $condprob = 1 - $condprob;
 
     # TODO better random number generator?
-    srand(0);
+    srand($params->{ 'seed' });
 
     # Get a list of the insn keys which are permitted by the re patterns
     my @keys = sort keys %insn_details;
@@ -187,35 +241,64 @@ sub write_test_code($)
         my $re = '\b((' . join(')|(',@not_pattern_re) . '))\b';
         @keys = grep !/$re/, @keys;
     }
+    # a benchmark runs each group of patterns separately
+    my @groups;
+    if ($bench) {
+        @groups = bench_groups(\%insn_details, @keys);
+        @keys = map { @$_[1..$#$_] } @groups;
+    }
     if (!@keys) {
         print STDERR "No instruction patterns available! (bad config file or --pattern argument?)\n";
         exit(1);
     }
     print "Generating code using patterns: @keys...\n";
-    progress_start(78, $numinsns);
+    progress_start(78, $bench ? $numinsns * @groups : $numinsns);
 
     if (grep { defined($insn_details{$_}->{blocks}->{"memory"}) } @keys) {
         write_memblock_setup();
+        image_info('memblock_len', 8192);
     }
 
     # memblock setup doesn't clean its registers, so this must come afterwards.
+    my $reset = $bytecount;
     write_random_register_data();
+    map_record('reset', $reset, $bytecount - $reset);
 
-    for my $i (1..$numinsns) {
-        my $insn_enc = $keys[int rand (@keys)];
-        my $forcecond = (rand() < $condprob) ? 1 : 0;
-        gen_one_insn($forcecond, $insn_details{$insn_enc});
-        write_risuop($OP_COMPARE);
-        # Rewrite the registers periodically. This avoids the tendency
-        # for the VFP registers to decay to NaNs and zeroes.
-        if ($periodic_reg_random && ($i % 100) == 0) {
-            write_random_register_data();
+    if ($bench) {
+        write_bench_blocks(\%insn_details, \@groups, $numinsns, $bench,
+                           $condprob);
+    } else {
+        for my $i (1..$numinsns) {
+            my $insn_enc = $keys[int rand (@keys)];
+            my $forcecond = (rand() < $condprob) ? 1 : 0;
+            my $unit = $bytecount;
+            gen_one_insn($forcecond, $insn_details{$insn_enc});
+            map_record('insn', $unit, $bytecount - $unit,
+                       $insn_start, $bytecount - $insn_start, $insn_enc);
+            # Rewrite the registers periodically. This avoids the tendency
+            # for the VFP registers to decay to NaNs and zeroes.
+            my $reg_random = $periodic_reg_random && ($i % 100) == 0;
+            if ($reg_random || ($i % $compare_every) == 0) {
+                map_record('compare', $bytecount);
+                write_risuop($OP_COMPARE);
+            } else {
+                map_record('slot', $bytecount);
+                write_checkpoint_slot();
+            }
+            if ($reg_random) {
+                $reset = $bytecount;
+                write_random_register_data();
+                map_record('reset', $reset, $bytecount - $reset);
+            }
+            progress_update($i);
         }
-        progress_update($i);
     }
+    map_record('end', $bytecount);
     write_risuop($OP_TESTEND);
     progress_end();
     close_bin();
+    close_map();
+    bench_summary() if $bench;
 }
 
 1;
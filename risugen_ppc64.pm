@@ -26,6 +26,11 @@ our @ISA    = qw(Exporter);
 our @EXPORT = qw(write_test_code);
 
 my $periodic_reg_random = 1;
+my $loadstate = 0;
+my $word = "L<";           # pack format of a 32 bit word in the image
+
+# Position of the last test instruction generated, for the image map
+my $insn_start;
 
 #
 # Maximum alignment restriction permitted for a memory op.
@@ -184,11 +189,60 @@ my $OP_TESTEND = 1;        # end of test, stop
 my $OP_SETMEMBLOCK = 2;    # r0 is address of memory block (8192 bytes)
 my $OP_GETMEMBLOCK = 3;    # add the address of memory block to r0
 my $OP_COMPAREMEM = 4;     # compare memory block
+my $OP_BENCHSTART = 5;     # r0 is the iteration count of a bench block
+my $OP_BENCHLOOP = 6;      # r0 is its insn count; loop or end it
+my $OP_LOADSTATE = 7;      # r0 is the address of a register table
+
+# The 32 bit immediates of write_mov_ri(), as lis sign extends them
+sub random_sxt32()
+{
+    my $imm = int(rand(0xffffffff));
+    return $imm & 0x80000000 ? $imm | (0xffffffff << 32) : $imm;
+}
+
+# The same state as write_random_register_data() loads, from a table
+# risu loads with an OP_LOADSTATE
+sub write_random_loadstate($)
+{
+    my ($fp_enabled) = @_;
+    my @table = ([ "r", 0, 8, random_sxt32() ],
+                 [ "r", 2, 8, map { random_sxt32() } 2..12 ],
+                 [ "r", 14, 8, map { random_sxt32() } 14..31 ],
+                 [ "ccr", 0, 8, 0 ],
+                 [ "xer", 0, 8, 0 ]);
+    push @table, [ "v", 0, 16,
+                   map { pack("$word*", int(rand(0xfffff)), int(rand(0xfffff)),
+                                        int(rand(0xffff)), int(rand(0xffff))) }
+                   0..31 ];
+    if ($fp_enabled) {
+        push @table, [ "f", 0, 8,
+                       map { int(rand(0xfffff)) | (int(rand(0xfffff)) << 32) }
+                       0..31 ];
+    }
+    my $table = loadstate_table(@table);
+
+    # r0 = the address of the table, using the lr without changing it
+    insn32(0x7e8802a6);     # mflr r20
+    insn32(0x429f0005);     # bcl 20,31,$+4
+    insn32(0x7ea802a6);     # mflr r21
+    insn32(0x7e8803a6);     # mtlr r20
+    insn32(0x38150014);     # addi r0,r21,20
+    write_risuop($OP_LOADSTATE);
+    # b over the table
+    insn32(0x48000000 | (4 + length($table)));
+    write_data($table);
+}
 
 sub write_random_register_data($)
 {
     my ($fp_enabled) = @_;
 
+    if ($loadstate) {
+        write_random_loadstate($fp_enabled);
+        write_risuop($OP_COMPARE);
+        return;
+    }
+
     clear_vr_registers();
 
     write_random_ppc64_vrdata();
@@ -338,6 +392,7 @@ sub gen_one_insn($$)
             $basereg = eval_with_fields($insnname, $insn, $rec, "memory", $memblock);
         }
 
+        $insn_start = $bytecount;
         insn32($insn);
 
         if (defined $memblock) {
@@ -362,31 +417,80 @@ sub write_risuop($)
     insn32(0x00005af0 | $op);
 }
 
+# No-op placeholder for a compare in --compare-every mode; risu
+# rewrites these into OP_COMPARE risuops to re-run a failing region.
+sub write_checkpoint_slot()
+{
+    image_slot($bytecount);
+    insn32(0x60000000); # nop (ori 0,0,0)
+}
+
+# --bench: each group of patterns goes in a block of straight-line
+# code with no checkpoints, which risu runs $iterations times and times.
+sub write_bench_blocks($$$$$)
+{
+    my ($details, $groups, $numinsns, $iterations, $condprob) = @_;
+    my $n = 0;
+
+    for my $g (@$groups) {
+        my ($name, @keys) = @$g;
+        write_mov_ri32(0, $iterations);
+        my $start = $bytecount;
+        write_risuop($OP_BENCHSTART);
+        for my $i (1..$numinsns) {
+            my $insn_enc = $keys[int rand (@keys)];
+            my $forcecond = (rand() < $condprob) ? 1 : 0;
+            my $unit = $bytecount;
+            gen_one_insn($forcecond, $details->{$insn_enc});
+            map_record('insn', $unit, $bytecount - $unit,
+                       $insn_start, 4, $insn_enc);
+            progress_update(++$n);
+        }
+        write_mov_ri32(0, $numinsns);
+        write_risuop($OP_BENCHLOOP);
+        bench_block($start, $bytecount - $start, $name);
+    }
+}
+
 sub write_test_code($)
 {
     my ($params) = @_;
 
     my $condprob = $params->{ 'condprob' };
     my $numinsns = $params->{ 'numinsns' };
+    my $bench = $params->{ 'bench' };
+    my $compare_every = $params->{ 'compare_every' };
     my $fp_enabled = $params->{ 'fp_enabled' };
+    $loadstate = $params->{ 'loadstate' } // 0;
     my $outfile = $params->{ 'outfile' };
+    my $mapfile = $params->{ 'mapfile' };
 
     my @pattern_re = @{ $params->{ 'pattern_re' } };
     my @not_pattern_re = @{ $params->{ 'not_pattern_re' } };
     my %insn_details = %{ $params->{ 'details' } };
 
-    if ($params->{ 'bigendian' } eq 1) {
+    my $bigendian = $params->{ 'bigendian' } eq 1;
+    if ($bigendian) {
         set_endian(1);
+        $word = "L>";
     }
 
     open_bin($outfile);
+    if (defined $mapfile) {
+        open_map($mapfile);
+        map_record('arch', 'ppc64');
+        map_record('endian', $bigendian ? 'big' : 'little');
+        map_record('disas', '-m', 'powerpc:common64', $bigendian ? '-EB' : '-EL');
+        map_encoding('nop', 0x60000000, 32);
+        map_encoding('testend', 0x00005af0 | $OP_TESTEND, 32);
+    }
 
     # convert from probability that insn will be conditional to
     # probability of forcing insn to unconditional
     $condprob = 1 - $condprob;
 
     # TODO better random number generator?
-    srand(0);
+    srand($params->{ 'seed' });
 
     # Get a list of the insn keys which are permitted by the re patterns
     my @keys = sort keys %insn_details;
@@ -399,36 +503,63 @@ sub write_test_code($)
         my $re = '\b((' . join(')|(',@not_pattern_re) . '))\b';
         @keys = grep !/$re/, @keys;
     }
+    # a benchmark runs each group of patterns separately
+    my @groups;
+    if ($bench) {
+        @groups = bench_groups(\%insn_details, @keys);
+        @keys = map { @$_[1..$#$_] } @groups;
+    }
     if (!@keys) {
         print STDERR "No instruction patterns available! (bad config file or --pattern argument?)\n";
         exit(1);
     }
     print "Generating code using patterns: @keys...\n";
-    progress_start(78, $numinsns);
+    progress_start(78, $bench ? $numinsns * @groups : $numinsns);
 
     if (grep { defined($insn_details{$_}->{blocks}->{"memory"}) } @keys) {
         write_memblock_setup();
     }
 
     # memblock setup doesn't clean its registers, so this must come afterwards.
+    my $reset = $bytecount;
     write_random_register_data($fp_enabled);
+    map_record('reset', $reset, $bytecount - $reset);
 
-    for my $i (1..$numinsns) {
-        my $insn_enc = $keys[int rand (@keys)];
-        #dump_insn_details($insn_enc, $insn_details{$insn_enc});
-        my $forcecond = (rand() < $condprob) ? 1 : 0;
-        gen_one_insn($forcecond, $insn_details{$insn_enc});
-        write_risuop($OP_COMPARE);
-        # Rewrite the registers periodically. This avoids the tendency
-        # for the VFP registers to decay to NaNs and zeroes.
-        if ($periodic_reg_random && ($i % 100) == 0) {
-            write_random_register_data($fp_enabled);
+    if ($bench) {
+        write_bench_blocks(\%insn_details, \@groups, $numinsns, $bench,
+                           $condprob);
+    } else {
+        for my $i (1..$numinsns) {
+            my $insn_enc = $keys[int rand (@keys)];
+            #dump_insn_details($insn_enc, $insn_details{$insn_enc});
+            my $forcecond = (rand() < $condprob) ? 1 : 0;
+            my $unit = $bytecount;
+            gen_one_insn($forcecond, $insn_details{$insn_enc});
+            map_record('insn', $unit, $bytecount - $unit, $insn_start, 4, $insn_enc);
+            # Rewrite the registers periodically. This avoids the tendency
+            # for the VFP registers to decay to NaNs and zeroes.
+            my $reg_random = $periodic_reg_random && ($i % 100) == 0;
+            if ($reg_random || ($i % $compare_every) == 0) {
+                map_record('compare', $bytecount);
+                write_risuop($OP_COMPARE);
+            } else {
+                map_record('slot', $bytecount);
+                write_checkpoint_slot();
+            }
+            if ($reg_random) {
+                $reset = $bytecount;
+                write_random_register_data($fp_enabled);
+                map_record('reset', $reset, $bytecount - $reset);
+            }
+            progress_update($i);
         }
-        progress_update($i);
     }
+    map_record('end', $bytecount);
     write_risuop($OP_TESTEND);
     progress_end();
     close_bin();
+    close_map();
+    bench_summary() if $bench;
 }
 
 1;
@@ -0,0 +1,505 @@
+#!/usr/bin/perl -w
+###############################################################################
+# Copyright (c) 2017 Linaro Limited
+# All rights reserved. This program and the accompanying materials
+# are made available under the terms of the Eclipse Public License v1.0
+# which accompanies this distribution, and is available at
+# http://www.eclipse.org/legal/epl-v10.html
+###############################################################################
+
+# risugen -- generate a test binary file for use with risu
+# See 'risugen --help' for usage information.
+package risugen_x86_64;
+
+use strict;
+use warnings;
+
+use risugen_common;
+
+require Exporter;
+
+our @ISA    = qw(Exporter);
+our @EXPORT = qw(write_test_code);
+
+my $periodic_reg_random = 1;
+my $loadstate = 0;
+
+# Position of the last test instruction generated, for the image map
+my $insn_start;
+
+#
+# Maximum alignment restriction permitted for a memory op.
+my $MAXALIGN = 64;
+
+my $OP_COMPARE = 0;        # compare registers
+my $OP_TESTEND = 1;        # end of test, stop
+my $OP_SETMEMBLOCK = 2;    # rax is address of memory block (8192 bytes)
+my $OP_GETMEMBLOCK = 3;    # add the address of memory block to rax
+my $OP_COMPAREMEM = 4;     # compare memory block
+my $OP_BENCHSTART = 5;     # rax is the iteration count of a bench block
+my $OP_BENCHLOOP = 6;      # rax is its insn count; loop or end it
+my $OP_LOADSTATE = 7;      # rax is the address of a register table
+
+my $REG_RAX = 0;
+my $REG_RSP = 4;
+
+# Patterns give the bytes of an insn in order, each most significant
+# bit first, so we emit the value we generate from the top down.
+sub write_bytes($$)
+{
+    my ($val, $len) = @_;
+    for (my $i = $len - 1; $i >= 0; $i--) {
+        insn8(($val >> ($i * 8)) & 0xff);
+    }
+}
+
+sub write_risuop($)
+{
+    # ud2, followed by the op
+    my ($op) = @_;
+    insn8(0x0f);
+    insn8(0x0b);
+    insn8($op);
+}
+
+# No-op placeholder for a compare in --compare-every mode; risu
+# rewrites these into OP_COMPARE risuops to re-run a failing region.
+sub write_checkpoint_slot()
+{
+    image_slot($bytecount);
+    # nopl (%rax), the same size as the risuop
+    insn8(0x0f);
+    insn8(0x1f);
+    insn8(0x00);
+}
+
+sub rex($$$)
+{
+    # REX.W prefix, with the top bits of the reg and rm fields
+    my ($w, $reg, $rm) = @_;
+    insn8(0x40 | ($w << 3) | (($reg >> 3) << 2) | ($rm >> 3));
+}
+
+sub modrm_rr($$)
+{
+    my ($reg, $rm) = @_;
+    insn8(0xc0 | (($reg & 7) << 3) | ($rm & 7));
+}
+
+sub rand64()
+{
+    return (int(rand(0xffffffff)) << 32) | int(rand(0xffffffff));
+}
+
+sub write_mov_ri($$)
+{
+    # movabs $imm, %reg
+    my ($r, $imm) = @_;
+    rex(1, 0, $r);
+    insn8(0xb8 | ($r & 7));
+    insn32($imm & 0xffffffff);
+    insn32(($imm >> 32) & 0xffffffff);
+}
+
+sub write_mov_rr($$)
+{
+    # mov %src, %dst
+    my ($dst, $src) = @_;
+    rex(1, $src, $dst);
+    insn8(0x89);
+    modrm_rr($src, $dst);
+}
+
+sub write_sub_rr($$)
+{
+    # sub %src, %dst
+    my ($dst, $src) = @_;
+    rex(1, $src, $dst);
+    insn8(0x29);
+    modrm_rr($src, $dst);
+}
+
+sub write_random_regdata()
+{
+    # general purpose registers, except rsp
+    for (my $i = 0; $i < 16; $i++) {
+        next if $i == $REG_RSP;
+        write_mov_ri($i, rand64());
+    }
+    # and the arithmetic flags: push $imm; popfq
+    insn8(0x68);
+    insn32(int(rand(0xffffffff)) & 0x8d5);
+    insn8(0x9d);
+}
+
+sub write_random_xmmdata()
+{
+    for (my $i = 0; $i < 16; $i++) {
+        # movdqu 2(%rip), %xmmN, then jump over the 16 bytes of data
+        insn8(0xf3);
+        rex(0, $i, 0);
+        insn8(0x0f);
+        insn8(0x6f);
+        insn8(0x05 | (($i & 7) << 3));
+        insn32(2);
+        insn8(0xeb);
+        insn8(16);
+        for (my $j = 0; $j < 4; $j++) {
+            insn32(int(rand(0xffffffff)));
+        }
+    }
+}
+
+sub write_set_mxcsr($)
+{
+    my ($mxcsr) = @_;
+    # ldmxcsr 2(%rip), then jump over the value
+    insn8(0x0f);
+    insn8(0xae);
+    insn8(0x15);
+    insn32(2);
+    insn8(0xeb);
+    insn8(4);
+    insn32($mxcsr);
+}
+
+# The same random state as the two above, loaded by risu from a table
+# rather than by an instruction per register
+sub write_random_loadstate($)
+{
+    my ($fp_enabled) = @_;
+    my @names = qw(rax rcx rdx rbx rsp rbp rsi rdi);
+    my @table;
+
+    for (my $i = 0; $i < 16; $i++) {
+        next if $i == $REG_RSP;
+        push @table, [ $i < 8 ? $names[$i] : "r$i", 0, 8, rand64() ];
+    }
+    push @table, [ "eflags", 0, 8, int(rand(0xffffffff)) & 0x8d5 ];
+    if ($fp_enabled) {
+        push @table, [ "xmm", 0, 16,
+                       map { pack("V4", map { int(rand(0xffffffff)) } 1..4) }
+                       0..15 ];
+    }
+    my $table = loadstate_table(@table);
+
+    # lea 8(%rip), %rax: the table follows the risuop and the jmp
+    insn8(0x48);
+    insn8(0x8d);
+    insn8(0x05);
+    insn32(8);
+    write_risuop($OP_LOADSTATE);
+    # jmp over it
+    insn8(0xe9);
+    insn32(length($table));
+    write_data($table);
+}
+
+sub write_random_register_data($)
+{
+    my ($fp_enabled) = @_;
+
+    if ($loadstate) {
+        write_random_loadstate($fp_enabled);
+    } else {
+        write_random_xmmdata() if $fp_enabled;
+        write_random_regdata();
+    }
+    write_risuop($OP_COMPARE);
+}
+
+sub write_memblock_setup()
+{
+    # Write code which sets up the memory block for loads and stores.
+    # We set rax to point to a block of 8K length
+    # of random data, aligned to the maximum desired alignment.
+    my $align = $MAXALIGN;
+    my $datalen = 8192 + $align;
+    if (!is_pow_of_2($align) || $align > 128) {
+        die "bad alignment!";
+    }
+
+    # lea datablock(%rip), %rax: the data follows the next 20 bytes
+    insn8(0x48);
+    insn8(0x8d);
+    insn8(0x05);
+    insn32(20);
+    # add $(align - 1), %rax; and $~(align - 1), %rax
+    insn8(0x48);
+    insn8(0x05);
+    insn32($align - 1);
+    insn8(0x48);
+    insn8(0x25);
+    insn32(~($align - 1) & 0xffffffff);
+    write_risuop($OP_SETMEMBLOCK);
+    # jmp over the data
+    insn8(0xe9);
+    insn32($datalen);
+
+    for (my $i = 0; $i < $datalen / 4; $i++) {
+        insn32(int(rand(0xffffffff)));
+    }
+}
+
+# Functions for use in constraints blocks
+
+# True if none of the given register numbers is rsp, which the test
+# insns mustn't touch: it points somewhere different on each side.
+sub no_rsp(@)
+{
+    return !grep { $_ == $REG_RSP } @_;
+}
+
+# Functions used in memory blocks to handle addressing modes.
+# These all have the same basic API: they get called with parameters
+# corresponding to the interesting fields of the instruction,
+# and should generate code to set up the base register to be
+# valid. They must return the register number of the base register.
+# The last (array) parameter lists the registers which are trashed
+# by the instruction (ie which are the targets of the load).
+# This is used to avoid problems when the base reg is a load target.
+
+# Global used to communicate between align(x) and reg() etc.
+my $alignment_restriction;
+
+sub align($)
+{
+    my ($a) = @_;
+    if (!is_pow_of_2($a) || ($a < 0) || ($a > $MAXALIGN)) {
+        die "bad align() value $a\n";
+    }
+    $alignment_restriction = $a;
+}
+
+sub write_get_offset()
+{
+    # Emit code to get a random offset within the memory block, of the
+    # right alignment, into rax
+    # We require the offset to not be within 256 bytes of either
+    # end, which allows for an 8 bit displacement and a 32 byte access.
+    my $offset = (rand(2048 - 512) + 256) & ~($alignment_restriction - 1);
+    write_mov_ri($REG_RAX, $offset);
+    write_risuop($OP_GETMEMBLOCK);
+}
+
+sub reg($@)
+{
+    my ($base, @trashed) = @_;
+    write_get_offset();
+    # Now rax is the address we want to do the access to,
+    # so just move it into the basereg
+    if ($base != $REG_RAX) {
+        write_mov_rr($base, $REG_RAX);
+        write_mov_ri($REG_RAX, 0);
+    }
+    if (grep $_ == $base, @trashed) {
+        return -1;
+    }
+    return $base;
+}
+
+sub gen_one_insn($)
+{
+    # Given an instruction-details array, generate an instruction
+    my $constraintfailures = 0;
+
+    INSN: while(1) {
+        my ($rec) = @_;
+        my $insn = rand64();
+        my $insnname = $rec->{name};
+        my $insnwidth = $rec->{width};
+        my $fixedbits = $rec->{fixedbits};
+        my $fixedbitmask = $rec->{fixedbitmask};
+        my $constraint = $rec->{blocks}{"constraints"};
+        my $memblock = $rec->{blocks}{"memory"};
+
+        if ($insnwidth < 64) {
+            $insn &= (1 << $insnwidth) - 1;
+        }
+        $insn &= ~$fixedbitmask;
+        $insn |= $fixedbits;
+
+        if (defined $constraint) {
+            # user-specified constraint: evaluate in an environment
+            # with variables set corresponding to the variable fields.
+            my $v = eval_with_fields($insnname, $insn, $rec, "constraints", $constraint);
+            if (!$v) {
+                $constraintfailures++;
+                if ($constraintfailures > 10000) {
+                    print "10000 consecutive constraint failures for $insnname constraints string:\n$constraint\n";
+                    exit (1);
+                }
+                next INSN;
+            }
+        }
+
+        # OK, we got a good one
+        $constraintfailures = 0;
+
+        my $basereg;
+
+        if (defined $memblock) {
+            # This is a load or store. We simply evaluate the block,
+            # which is expected to be a call to a function which emits
+            # the code to set up the base register and returns the
+            # number of the base register.
+            align(16);
+            $basereg = eval_with_fields($insnname, $insn, $rec, "memory", $memblock);
+        }
+
+        $insn_start = $bytecount;
+        write_bytes($insn, $insnwidth / 8);
+
+        if (defined $memblock) {
+            # Clean up following a memory access instruction:
+            # we need to turn the (possibly written-back) basereg
+            # into an offset from the base of the memory block,
+            # to avoid making register values depend on memory layout.
+            # $basereg -1 means the basereg was a target of a load
+            # (and so it doesn't contain a memory address after the op)
+            if ($basereg != -1) {
+                write_mov_ri($REG_RAX, 0);
+                write_risuop($OP_GETMEMBLOCK);
+                write_sub_rr($basereg, $REG_RAX);
+                write_mov_ri($REG_RAX, 0);
+            }
+            write_risuop($OP_COMPAREMEM);
+        }
+        return;
+    }
+}
+
+# --bench: each group of patterns goes in a block of straight-line
+# code with no checkpoints, which risu runs $iterations times and times.
+sub write_bench_blocks($$$$)
+{
+    my ($details, $groups, $numinsns, $iterations) = @_;
+    my $n = 0;
+
+    for my $g (@$groups) {
+        my ($name, @keys) = @$g;
+        write_mov_ri($REG_RAX, $iterations);
+        my $start = $bytecount;
+        write_risuop($OP_BENCHSTART);
+        for my $i (1..$numinsns) {
+            my $insn_enc = $keys[int rand (@keys)];
+            my $unit = $bytecount;
+            gen_one_insn($details->{$insn_enc});
+            map_record('insn', $unit, $bytecount - $unit,
+                       $insn_start, $details->{$insn_enc}->{width} / 8, $insn_enc);
+            progress_update(++$n);
+        }
+        write_mov_ri($REG_RAX, $numinsns);
+        write_risuop($OP_BENCHLOOP);
+        bench_block($start, $bytecount - $start, $name);
+    }
+}
+
+sub write_test_code($)
+{
+    my ($params) = @_;
+
+    my $fpscr = $params->{ 'fpscr' };
+    my $numinsns = $params->{ 'numinsns' };
+    my $bench = $params->{ 'bench' };
+    my $compare_every = $params->{ 'compare_every' };
+    my $fp_enabled = $params->{ 'fp_enabled' };
+    $loadstate = $params->{ 'loadstate' } // 0;
+    my $outfile = $params->{ 'outfile' };
+    my $mapfile = $params->{ 'mapfile' };
+
+    my @pattern_re = @{ $params->{ 'pattern_re' } };
+    my @not_pattern_re = @{ $params->{ 'not_pattern_re' } };
+    my %insn_details = %{ $params->{ 'details' } };
+
+    open_bin($outfile);
+    if (defined $mapfile) {
+        open_map($mapfile);
+        map_record('arch', 'x86_64');
+        map_record('endian', 'little');
+        map_record('disas', '-m', 'i386:x86-64');
+        map_record('nop', '90');
+        map_record('testend', sprintf("0f0b%02x", $OP_TESTEND));
+    }
+
+    # TODO better random number generator?
+    srand($params->{ 'seed' });
+
+    # Get a list of the insn keys which are permitted by the re patterns
+    my @keys = sort keys %insn_details;
+    if (@pattern_re) {
+        my $re = '\b((' . join(')|(',@pattern_re) . '))\b';
+        @keys = grep /$re/, @keys;
+    }
+    # exclude any specifics
+    if (@not_pattern_re) {
+        my $re = '\b((' . join(')|(',@not_pattern_re) . '))\b';
+        @keys = grep !/$re/, @keys;
+    }
+    # a benchmark runs each group of patterns separately
+    my @groups;
+    if ($bench) {
+        @groups = bench_groups(\%insn_details, @keys);
+        @keys = map { @$_[1..$#$_] } @groups;
+    }
+    if (!@keys) {
+        print STDERR "No instruction patterns available! (bad config file or --pattern argument?)\n";
+        exit(1);
+    }
+    print "Generating code using patterns: @keys...\n";
+    progress_start(78, $bench ? $numinsns * @groups : $numinsns);
+
+    if ($fp_enabled) {
+        # with the default (all exceptions masked) if not given
+        write_set_mxcsr($fpscr || 0x1f80);
+    }
+
+    if (grep { defined($insn_details{$_}->{blocks}->{"memory"}) } @keys) {
+        write_memblock_setup();
+        image_info('memblock_len', 8192);
+    }
+
+    # memblock setup doesn't clean its registers, so this must come afterwards.
+    my $reset = $bytecount;
+    write_random_register_data($fp_enabled);
+    map_record('reset', $reset, $bytecount - $reset);
+
+    if ($bench) {
+        write_bench_blocks(\%insn_details, \@groups, $numinsns, $bench);
+    } else {
+        for my $i (1..$numinsns) {
+            my $insn_enc = $keys[int rand (@keys)];
+            my $unit = $bytecount;
+            gen_one_insn($insn_details{$insn_enc});
+            map_record('insn', $unit, $bytecount - $unit,
+                       $insn_start, $insn_details{$insn_enc}->{width} / 8,
+                       $insn_enc);
+            # Rewrite the registers periodically. This avoids the tendency
+            # for the SSE registers to decay to NaNs and zeroes.
+            my $reg_random = $periodic_reg_random && ($i % 100) == 0;
+            # Always compare before randomising, so a sparse region never
+            # spans the register setup code and its inline data.
+            if ($reg_random || ($i % $compare_every) == 0) {
+                map_record('compare', $bytecount);
+                write_risuop($OP_COMPARE);
+            } else {
+                map_record('slot', $bytecount);
+                write_checkpoint_slot();
+            }
+            if ($reg_random) {
+                $reset = $bytecount;
+                write_random_register_data($fp_enabled);
+                map_record('reset', $reset, $bytecount - $reset);
+            }
+            progress_update($i);
+        }
+    }
+    map_record('end', $bytecount);
+    write_risuop($OP_TESTEND);
+    progress_end();
+    close_bin();
+    close_map();
+    bench_summary() if $bench;
+}
+
+1;
@@ -0,0 +1,131 @@
+/*******************************************************************************
+ * Copyright (c) 2017 Linaro Limited
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ ******************************************************************************/
+
+/* Live counters (--stats): a page of struct session_stats in a shared
+ * file mapping, which risu-top reads while we run. Each session (each
+ * thread, or each daemon worker, which inherits the mapping) claims a
+ * slot and is the only writer of it; the counters are updated with
+ * relaxed atomics, so neither side takes a lock, and the SIGILL
+ * handler can update them.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "risu.h"
+
+static struct stats_page *stats_page;
+
+__thread struct session_stats *session_stats;
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int stats_open(const char *path, const char *role)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        return -1;
+    }
+    if (ftruncate(fd, sizeof(struct stats_page)) != 0) {
+        close(fd);
+        return -1;
+    }
+    stats_page = mmap(NULL, sizeof(struct stats_page),
+                      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (stats_page == MAP_FAILED) {
+        stats_page = NULL;
+        return -1;
+    }
+    stats_page->version = STATS_VERSION;
+    stats_page->pid = getpid();
+    snprintf(stats_page->role, sizeof(stats_page->role), "%s", role);
+    /* the magic last, so a reader never sees a half set up page */
+    __atomic_store_n(&stats_page->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int claim(struct session_stats *s, uint32_t from)
+{
+    return __atomic_compare_exchange_n(&s->state, &from, STATS_CLAIMED, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void stats_start_session(const char *image)
+{
+    struct session_stats *s = NULL;
+    const char *name = strrchr(image, '/');
+    int i;
+
+    if (!stats_page) {
+        return;
+    }
+    /* a free slot if there is one, or else one that has finished */
+    for (i = 0; i < STATS_MAX_SESSIONS && !s; i++) {
+        if (claim(&stats_page->sessions[i], STATS_FREE)) {
+            s = &stats_page->sessions[i];
+        }
+    }
+    for (i = 0; i < STATS_MAX_SESSIONS && !s; i++) {
+        if (claim(&stats_page->sessions[i], STATS_FINISHED)) {
+            s = &stats_page->sessions[i];
+        }
+    }
+    if (!s) {
+        return;
+    }
+
+    memset((char *)s + sizeof(s->state), 0, sizeof(*s) - sizeof(s->state));
+    snprintf(s->image, sizeof(s->image), "%s", name ? name + 1 : image);
+    s->pid = getpid();
+    s->start_ns = stats_now();
+    __atomic_store_n(&s->state, STATS_RUNNING, __ATOMIC_RELEASE);
+    session_stats = s;
+}
+
+void stats_end_session(int status)
+{
+    struct session_stats *s = session_stats;
+
+    if (!s) {
+        return;
+    }
+    s->status = status;
+    s->end_ns = stats_now();
+    __atomic_store_n(&s->state, STATS_FINISHED, __ATOMIC_RELEASE);
+    session_stats = NULL;
+}
+
+void stats_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+void stats_checkpoint(uintptr_t pc)
+{
+    struct session_stats *s = session_stats;
+
+    if (!s) {
+        return;
+    }
+    stats_add(&s->checkpoints, 1);
+    __atomic_store_n(&s->pc, pc, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->last_checkpoint_ns, stats_now(), __ATOMIC_RELAXED);
+}
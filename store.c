@@ -0,0 +1,275 @@
+/*******************************************************************************
+ * Copyright (c) 2017 Linaro Limited
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ ******************************************************************************/
+
+/* The trace store (see risu-store): trace streams split into content
+ * defined chunks, each kept once however many streams share it.
+ *   DIR/chunks/<xx>/<chunk hash>   a chunk, gzipped if we have zlib
+ *   DIR/streams/<name>             a stream's manifest
+ * A manifest is a text file: STORE_MAGIC and the version, then a line
+ * with the hash and length of each chunk, in order. trace_open() reads
+ * a manifest as if it were the trace it describes.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "config.h"
+
+#include "risu_trace.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+struct store_chunk {
+    uint8_t hash[HASH_LEN];
+    uint32_t len;
+};
+
+struct store_stream {
+    char *dir;                  /* the store */
+    struct store_chunk *chunks;
+    size_t nchunks;
+    size_t next;                /* the next chunk to load */
+    uint8_t *buf;               /* the current chunk */
+    size_t len, pos;
+};
+
+int store_is_manifest(int fd)
+{
+    char magic[sizeof(STORE_MAGIC) - 1];
+
+    return pread(fd, magic, sizeof(magic), 0) == sizeof(magic)
+        && memcmp(magic, STORE_MAGIC, sizeof(magic)) == 0;
+}
+
+static int parse_hash(const char *s, uint8_t hash[HASH_LEN])
+{
+    int i;
+
+    for (i = 0; i < HASH_LEN; i++) {
+        unsigned int b;
+
+        if (sscanf(s + i * 2, "%2x", &b) != 1) {
+            return -1;
+        }
+        hash[i] = b;
+    }
+    return 0;
+}
+
+char *store_chunk_path(const char *dir, const uint8_t hash[HASH_LEN])
+{
+    char hashstr[HASH_STR_LEN];
+    char *path;
+
+    hash_to_str(hash, hashstr);
+    if (asprintf(&path, "%s/chunks/%.2s/%s", dir, hashstr, hashstr) < 0) {
+        return NULL;
+    }
+    return path;
+}
+
+store_stream *store_open(const char *manifest)
+{
+    store_stream *s;
+    char line[128], hashstr[HASH_STR_LEN];
+    unsigned long len;
+    int version;
+    char *slash;
+    FILE *f;
+
+    f = fopen(manifest, "r");
+    if (!f) {
+        return NULL;
+    }
+    if (!fgets(line, sizeof(line), f)
+        || sscanf(line, STORE_MAGIC "%d", &version) != 1
+        || version != STORE_VERSION) {
+        fclose(f);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* the manifest lives in DIR/streams */
+    s = calloc(1, sizeof(*s));
+    s->dir = strdup(manifest);
+    slash = strrchr(s->dir, '/');
+    if (!slash) {
+        free(s->dir);
+        s->dir = strdup("..");
+    } else {
+        *slash = 0;
+        slash = strrchr(s->dir, '/');
+        if (slash) {
+            *slash = 0;
+        } else {
+            free(s->dir);
+            s->dir = strdup(".");
+        }
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        struct store_chunk *c;
+
+        if (sscanf(line, "%32s %lu", hashstr, &len) != 2
+            || len == 0 || len > STORE_MAX_CHUNK) {
+            goto bad;
+        }
+        s->chunks = realloc(s->chunks, (s->nchunks + 1) * sizeof(*c));
+        c = &s->chunks[s->nchunks++];
+        if (parse_hash(hashstr, c->hash) != 0) {
+            goto bad;
+        }
+        c->len = len;
+    }
+    fclose(f);
+    s->buf = malloc(STORE_MAX_CHUNK);
+    return s;
+
+ bad:
+    fclose(f);
+    store_close(s);
+    errno = EINVAL;
+    return NULL;
+}
+
+/* Read a chunk back, checking it is what the manifest says */
+static int load_chunk(store_stream *s, struct store_chunk *c)
+{
+    uint8_t hash[HASH_LEN];
+    char *path = store_chunk_path(s->dir, c->hash);
+    int r = -1;
+
+    if (!path) {
+        return -1;
+    }
+#ifdef HAVE_ZLIB
+    gzFile gz = gzopen(path, "rb");
+    if (gz) {
+        r = gzread(gz, s->buf, STORE_MAX_CHUNK);
+        gzclose(gz);
+    }
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        r = read(fd, s->buf, STORE_MAX_CHUNK);
+        close(fd);
+    }
+#endif
+    if (r != c->len) {
+        fprintf(stderr, "trace store: chunk %s is missing or the "
+                "wrong size\n", path);
+        free(path);
+        return -1;
+    }
+    hash_buffer(s->buf, r, hash);
+    if (memcmp(hash, c->hash, HASH_LEN) != 0) {
+        fprintf(stderr, "trace store: chunk %s is corrupt\n", path);
+        free(path);
+        return -1;
+    }
+    free(path);
+    s->len = r;
+    s->pos = 0;
+    return 0;
+}
+
+ssize_t store_read(store_stream *s, void *ptr, size_t bytes)
+{
+    size_t len;
+
+    if (s->pos == s->len) {
+        if (s->next == s->nchunks) {
+            return 0;
+        }
+        if (load_chunk(s, &s->chunks[s->next++]) != 0) {
+            return -1;
+        }
+    }
+    len = s->len - s->pos;
+    if (len > bytes) {
+        len = bytes;
+    }
+    memcpy(ptr, s->buf + s->pos, len);
+    s->pos += len;
+    return len;
+}
+
+void store_close(store_stream *s)
+{
+    free(s->buf);
+    free(s->chunks);
+    free(s->dir);
+    free(s);
+}
+
+int store_put_chunk(const char *dir, const void *data, size_t len,
+                    uint8_t hash[HASH_LEN], size_t *stored)
+{
+    char *path, *tmp, *sub;
+    struct stat st;
+    int r = -1;
+
+    hash_buffer(data, len, hash);
+    path = store_chunk_path(dir, hash);
+    if (!path) {
+        return -1;
+    }
+    if (stat(path, &st) == 0) {
+        /* already have it */
+        free(path);
+        *stored = 0;
+        return 0;
+    }
+
+    /* DIR/chunks/xx, then write to a temporary name and rename into
+     * place, so concurrent writers never see a partial chunk
+     */
+    sub = strdup(path);
+    *strrchr(sub, '/') = 0;
+    mkdir(sub, 0777);
+    free(sub);
+    if (asprintf(&tmp, "%s.tmp.%d", path, getpid()) < 0) {
+        free(path);
+        return -1;
+    }
+#ifdef HAVE_ZLIB
+    gzFile gz = gzopen(tmp, "wb9");
+    if (gz) {
+        r = gzwrite(gz, data, len) == len ? 0 : -1;
+        if (gzclose(gz) != Z_OK) {
+            r = -1;
+        }
+    }
+#else
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd >= 0) {
+        r = write(fd, data, len) == len ? 0 : -1;
+        if (close(fd) != 0) {
+            r = -1;
+        }
+    }
+#endif
+    if (r == 0 && (stat(tmp, &st) != 0 || rename(tmp, path) != 0)) {
+        r = -1;
+    }
+    if (r != 0) {
+        unlink(tmp);
+    } else {
+        *stored = st.st_size;
+    }
+    free(tmp);
+    free(path);
+    return r;
+}
@@ -0,0 +1,49 @@
+/*****************************************************************************
+ * Copyright (c) 2017 Linaro Limited
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *****************************************************************************/
+
+/* Initialise the gp regs (not rsp), and the flags */
+xor %eax, %eax
+mov $1, %rcx
+mov $2, %rdx
+mov $3, %rbx
+mov $5, %rbp
+mov $6, %rsi
+mov $7, %rdi
+mov $8, %r8
+mov $9, %r9
+mov $10, %r10
+mov $11, %r11
+mov $12, %r12
+mov $13, %r13
+mov $14, %r14
+mov $15, %r15
+
+/* and the SSE regs */
+pxor %xmm0, %xmm0
+pxor %xmm1, %xmm1
+pxor %xmm2, %xmm2
+pxor %xmm3, %xmm3
+pxor %xmm4, %xmm4
+pxor %xmm5, %xmm5
+pxor %xmm6, %xmm6
+pxor %xmm7, %xmm7
+pxor %xmm8, %xmm8
+pxor %xmm9, %xmm9
+pxor %xmm10, %xmm10
+pxor %xmm11, %xmm11
+pxor %xmm12, %xmm12
+pxor %xmm13, %xmm13
+pxor %xmm14, %xmm14
+pxor %xmm15, %xmm15
+
+/* do compare: UD2 followed by the op */
+ud2
+.byte 0
+/* exit test */
+ud2
+.byte 1
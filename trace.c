@@ -0,0 +1,507 @@
+/*******************************************************************************
+ * Copyright (c) 2017 Linaro Limited
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ ******************************************************************************/
+
+/* Trace files: a file header, then the stream of checkpoint records
+ * (a trace_header_t followed by a reginfo or memory block, depending
+ * on the op) which risu records and plays back; see risu_trace.h.
+ * They are gzip compressed if we have zlib, except that "-" means
+ * plain stdin or stdout. A stream in the trace store can be read back
+ * through its manifest. Nothing here depends on the arch.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/stat.h>
+#include <endian.h>
+
+#include "config.h"
+
+#include "risu_trace.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/* Single producer, single consumer byte ring, for moving trace data
+ * between the SIGILL handler and a helper thread. The handler side
+ * takes no locks: it copies bytes and then publishes them by moving
+ * its index. It only waits (by polling, which is safe in a signal
+ * handler) when the ring is full, or empty when reading.
+ */
+#define RING_SIZE (4 * 1024 * 1024)
+
+struct ring {
+    uint8_t *buf;
+    size_t head;        /* next byte the producer writes */
+    size_t tail;        /* next byte the consumer reads */
+    sem_t wake;         /* wakes the helper thread */
+    int done;           /* producer has finished, or reader should stop */
+};
+
+struct trace_file {
+    int fd;
+#ifdef HAVE_ZLIB
+    gzFile gz;
+#endif
+    store_stream *store;    /* reading a stream from the trace store */
+    struct ring *ring;
+    pthread_t thread;
+    int error;          /* set by the helper thread */
+    uint64_t *bytes, *file_bytes;   /* counters, if set */
+    /* the file header and schema, as read */
+    struct trace_file_header *header;
+    int bad_header;     /* as trace_read_header() returns */
+    /* fingerprint mode, from the header */
+    int mode;
+    int mode_known;
+};
+
+static const struct timespec ring_poll = { 0, 50 * 1000 };
+
+static void ring_put(struct ring *r, const void *ptr, size_t bytes)
+{
+    const uint8_t *p = ptr;
+
+    while (bytes) {
+        size_t head = r->head;
+        size_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        size_t len = RING_SIZE - (head - tail);
+        size_t off = head & (RING_SIZE - 1);
+
+        if (len == 0) {
+            /* full: make sure the consumer is awake, and wait */
+            sem_post(&r->wake);
+            nanosleep(&ring_poll, NULL);
+            continue;
+        }
+        if (len > bytes) {
+            len = bytes;
+        }
+        if (len > RING_SIZE - off) {
+            len = RING_SIZE - off;
+        }
+        memcpy(r->buf + off, p, len);
+        __atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+        p += len;
+        bytes -= len;
+    }
+    sem_post(&r->wake);
+}
+
+/* Returns 1 if the producer finished before we got all the bytes */
+static int ring_get(struct ring *r, void *ptr, size_t bytes)
+{
+    uint8_t *p = ptr;
+
+    while (bytes) {
+        size_t tail = r->tail;
+        size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        size_t len = head - tail;
+        size_t off = tail & (RING_SIZE - 1);
+
+        if (len == 0) {
+            if (__atomic_load_n(&r->done, __ATOMIC_ACQUIRE)) {
+                if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail) {
+                    return 1;
+                }
+                continue;
+            }
+            nanosleep(&ring_poll, NULL);
+            continue;
+        }
+        if (len > bytes) {
+            len = bytes;
+        }
+        if (len > RING_SIZE - off) {
+            len = RING_SIZE - off;
+        }
+        memcpy(p, r->buf + off, len);
+        __atomic_store_n(&r->tail, tail + len, __ATOMIC_RELEASE);
+        p += len;
+        bytes -= len;
+    }
+    /* there is room for the reader thread to fill */
+    sem_post(&r->wake);
+    return 0;
+}
+
+static struct ring *ring_new(void)
+{
+    struct ring *r = calloc(1, sizeof(*r));
+    r->buf = malloc(RING_SIZE);
+    sem_init(&r->wake, 0, 0);
+    return r;
+}
+
+static void ring_free(struct ring *r)
+{
+    sem_destroy(&r->wake);
+    free(r->buf);
+    free(r);
+}
+
+trace_file *trace_open(const char *name, int for_write)
+{
+    trace_file *t = calloc(1, sizeof(*t));
+
+    if (strcmp(name, "-") == 0) {
+        t->fd = for_write ? STDOUT_FILENO : STDIN_FILENO;
+        return t;
+    }
+
+    if (for_write) {
+        t->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    } else {
+        t->fd = open(name, O_RDONLY);
+    }
+    if (t->fd < 0) {
+        free(t);
+        return NULL;
+    }
+    if (!for_write && store_is_manifest(t->fd)) {
+        close(t->fd);
+        t->fd = -1;
+        t->store = store_open(name);
+        if (!t->store) {
+            free(t);
+            return NULL;
+        }
+        return t;
+    }
+#ifdef HAVE_ZLIB
+    t->gz = gzdopen(t->fd, for_write ? "wb9" : "rb");
+    if (!t->gz) {
+        close(t->fd);
+        free(t);
+        return NULL;
+    }
+#endif
+    return t;
+}
+
+/* Read up to bytes, returning how many we got (0 at EOF, -1 on error) */
+static ssize_t raw_read_some(trace_file *t, void *ptr, size_t bytes)
+{
+    if (t->store) {
+        return store_read(t->store, ptr, bytes);
+    }
+#ifdef HAVE_ZLIB
+    if (t->gz) {
+        return gzread(t->gz, ptr, bytes);
+    }
+#endif
+    for (;;) {
+        ssize_t r = read(t->fd, ptr, bytes);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        return r;
+    }
+}
+
+ssize_t trace_read_some(trace_file *t, void *ptr, size_t bytes)
+{
+    return raw_read_some(t, ptr, bytes);
+}
+
+static int raw_read(trace_file *t, void *ptr, size_t bytes)
+{
+    char *p = ptr;
+
+    if (t->ring) {
+        return ring_get(t->ring, ptr, bytes);
+    }
+    /* pipes can give us short reads */
+    while (bytes) {
+        ssize_t r = raw_read_some(t, p, bytes);
+        if (r <= 0) {
+            return 1;
+        }
+        p += r;
+        bytes -= r;
+    }
+    return 0;
+}
+
+/* The largest file header (and schema) we believe */
+#define TRACE_MAX_HEADER (64 * 1024)
+
+/* Read the file header and schema at the start of the trace */
+static void read_header(trace_file *t)
+{
+    struct trace_file_header fh;
+    size_t size;
+
+    t->mode_known = 1;
+    if (raw_read(t, &fh, sizeof(fh))
+        || memcmp(fh.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+        t->bad_header = TRACE_NO_HEADER;
+        return;
+    }
+    size = le32toh(fh.header_size);
+    if (le32toh(fh.version) != TRACE_VERSION || size < sizeof(fh)
+        || size > TRACE_MAX_HEADER
+        || size != sizeof(fh)
+                   + le32toh(fh.nblocks) * sizeof(struct trace_schema_block)
+                   + le32toh(fh.nfields) * sizeof(struct trace_schema_field)) {
+        t->bad_header = TRACE_BAD_HEADER;
+        return;
+    }
+    t->header = malloc(size);
+    memcpy(t->header, &fh, sizeof(fh));
+    if (raw_read(t, t->header + 1, size - sizeof(fh))) {
+        free(t->header);
+        t->header = NULL;
+        t->bad_header = TRACE_BAD_HEADER;
+        return;
+    }
+    t->mode = le32toh(fh.fingerprint);
+}
+
+int trace_read(trace_file *t, void *ptr, size_t bytes)
+{
+    if (!t->mode_known) {
+        read_header(t);
+    }
+    if (t->bad_header) {
+        return 1;
+    }
+    return raw_read(t, ptr, bytes);
+}
+
+int trace_fingerprint_mode(trace_file *t)
+{
+    if (!t->mode_known) {
+        read_header(t);
+    }
+    return t->mode;
+}
+
+int trace_read_header(trace_file *t, const struct trace_file_header **h)
+{
+    if (!t->mode_known) {
+        read_header(t);
+    }
+    *h = t->header;
+    return t->bad_header;
+}
+
+void trace_header_error(const char *name, int r)
+{
+    if (r == TRACE_NO_HEADER) {
+        fprintf(stderr, "%s: unsupported trace format: no file header "
+                "(not a trace, or one from before trace version %d)\n",
+                name, TRACE_VERSION);
+    } else {
+        fprintf(stderr, "%s: bad trace file header\n", name);
+    }
+}
+
+static int raw_write(trace_file *t, void *ptr, size_t bytes)
+{
+    char *p = ptr;
+
+#ifdef HAVE_ZLIB
+    if (t->gz) {
+        if (gzwrite(t->gz, ptr, bytes) != bytes) {
+            return 1;
+        }
+        if (t->file_bytes) {
+            /* as far as zlib has got, which is near enough */
+            __atomic_store_n(t->file_bytes, gzoffset(t->gz),
+                             __ATOMIC_RELAXED);
+        }
+        return 0;
+    }
+#endif
+    if (t->file_bytes) {
+        __atomic_fetch_add(t->file_bytes, bytes, __ATOMIC_RELAXED);
+    }
+    while (bytes) {
+        ssize_t r = write(t->fd, p, bytes);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            return 1;
+        }
+        p += r;
+        bytes -= r;
+    }
+    return 0;
+}
+
+/* The writer thread: compress and write out whatever is in the ring */
+static void *trace_writer(void *opaque)
+{
+    trace_file *t = opaque;
+    struct ring *r = t->ring;
+
+    for (;;) {
+        size_t tail = r->tail;
+        size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        size_t off = tail & (RING_SIZE - 1);
+        size_t len = head - tail;
+
+        if (len == 0) {
+            if (__atomic_load_n(&r->done, __ATOMIC_ACQUIRE)) {
+                /* re-check, the last data came before done */
+                if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail) {
+                    break;
+                }
+                continue;
+            }
+            while (sem_wait(&r->wake) != 0 && errno == EINTR) {
+                continue;
+            }
+            continue;
+        }
+        if (len > RING_SIZE - off) {
+            len = RING_SIZE - off;
+        }
+        if (!t->error && raw_write(t, r->buf + off, len) != 0) {
+            __atomic_store_n(&t->error, 1, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&r->tail, tail + len, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/* The read-ahead thread: keep the ring topped up from the file */
+static void *trace_reader(void *opaque)
+{
+    trace_file *t = opaque;
+    struct ring *r = t->ring;
+
+    for (;;) {
+        size_t head = r->head;
+        size_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        size_t off = head & (RING_SIZE - 1);
+        size_t len = RING_SIZE - (head - tail);
+        ssize_t got;
+
+        if (__atomic_load_n(&r->done, __ATOMIC_ACQUIRE)) {
+            /* the trace is being closed */
+            break;
+        }
+        if (len == 0) {
+            while (sem_wait(&r->wake) != 0 && errno == EINTR) {
+                continue;
+            }
+            continue;
+        }
+        if (len > RING_SIZE - off) {
+            len = RING_SIZE - off;
+        }
+        got = raw_read_some(t, r->buf + off, len);
+        if (got <= 0) {
+            break;
+        }
+        __atomic_store_n(&r->head, head + got, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Run any signal handlers on the calling thread, not our helpers */
+static void start_thread(trace_file *t, void *(*fn)(void *))
+{
+    sigset_t all, old;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&t->thread, NULL, fn, t) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void trace_start_writer(trace_file *t)
+{
+    t->ring = ring_new();
+    start_thread(t, trace_writer);
+}
+
+void trace_start_reader(trace_file *t)
+{
+    t->ring = ring_new();
+    start_thread(t, trace_reader);
+}
+
+int trace_write_header(trace_file *t, const struct trace_file_header *h)
+{
+    t->mode = le32toh(h->fingerprint);
+    t->mode_known = 1;
+    return trace_write(t, (void *)h, le32toh(h->header_size));
+}
+
+void trace_set_counters(trace_file *t, uint64_t *bytes, uint64_t *file_bytes)
+{
+    t->bytes = bytes;
+    t->file_bytes = file_bytes;
+}
+
+int trace_write(trace_file *t, void *ptr, size_t bytes)
+{
+    if (t->bytes) {
+        __atomic_fetch_add(t->bytes, bytes, __ATOMIC_RELAXED);
+    }
+    if (t->ring) {
+        ring_put(t->ring, ptr, bytes);
+        return __atomic_load_n(&t->error, __ATOMIC_ACQUIRE);
+    }
+    return raw_write(t, ptr, bytes);
+}
+
+void trace_close(trace_file *t)
+{
+    if (t->ring) {
+        /* let the writer finish off, or tell the reader to stop */
+        __atomic_store_n(&t->ring->done, 1, __ATOMIC_RELEASE);
+        sem_post(&t->ring->wake);
+        pthread_join(t->thread, NULL);
+        ring_free(t->ring);
+    }
+    free(t->header);
+    if (t->store) {
+        store_close(t->store);
+        free(t);
+        return;
+    }
+#ifdef HAVE_ZLIB
+    if (t->gz) {
+        /* the size on disk is only known once zlib has finished */
+        int fd = t->file_bytes ? dup(t->fd) : -1;
+        struct stat st;
+
+        gzclose(t->gz);
+        if (fd >= 0) {
+            if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+                __atomic_store_n(t->file_bytes, st.st_size,
+                                 __ATOMIC_RELAXED);
+            }
+            close(fd);
+        }
+        free(t);
+        return;
+    }
+#endif
+    if (t->fd != STDIN_FILENO && t->fd != STDOUT_FILENO) {
+        close(t->fd);
+    }
+    free(t);
+}
@@ -0,0 +1,148 @@
+/*******************************************************************************
+ * Copyright (c) 2017 Linaro Limited
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ ******************************************************************************/
+
+/* The trace cache (--trace-cache): traces recorded by live masters,
+ * keyed by the master's CPU and the image hash, which an apprentice
+ * can replay instead of taking up the master again. The layout is
+ *   DIR/<cpu>/<image hash>.trace    a master's state for an image
+ *   DIR/hosts/<host>:<port>         the CPU of the master there
+ * where the hosts entries are written by apprentices, since only they
+ * know which name they reach each master by.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#include "risu.h"
+
+#define STR(X) STR2(X)
+#define STR2(X) #X
+
+/* The /proc/cpuinfo fields which say what the CPU is and does */
+static const char *cpuinfo_keys[] = {
+    /* x86 */
+    "vendor_id", "cpu family", "model", "stepping", "flags",
+    /* arm and aarch64 */
+    "CPU implementer", "CPU architecture", "CPU variant", "CPU part",
+    "CPU revision", "Features",
+    /* ppc64 */
+    "cpu", "revision",
+    NULL
+};
+
+void cpu_identity(char buf[CPU_ID_LEN])
+{
+    uint8_t hash[HASH_LEN];
+    char hashstr[HASH_STR_LEN];
+    char line[4096], *text = NULL;
+    size_t len = 0;
+    struct utsname u;
+    FILE *f;
+
+    /* the first processor will do; we don't run on big.LITTLE masters
+     * whose cores differ in anything we test
+     */
+    f = fopen("/proc/cpuinfo", "r");
+    while (f && fgets(line, sizeof(line), f) && line[0] != '\n') {
+        const char **k;
+        size_t n;
+
+        for (k = cpuinfo_keys; *k; k++) {
+            n = strlen(*k);
+            if (strncmp(line, *k, n) == 0 && strchr(" \t:", line[n])) {
+                break;
+            }
+        }
+        if (*k) {
+            n = strlen(line);
+            text = realloc(text, len + n);
+            memcpy(text + len, line, n);
+            len += n;
+        }
+    }
+    if (f) {
+        fclose(f);
+    }
+    if (!len && uname(&u) == 0) {
+        /* no cpuinfo: the best we can do is the machine */
+        text = strdup(u.machine);
+        len = strlen(text);
+    }
+    hash_buffer(text, len, hash);
+    free(text);
+    hash_to_str(hash, hashstr);
+    snprintf(buf, CPU_ID_LEN, "%s-%.16s", STR(ARCH), hashstr);
+}
+
+char *trace_cache_path(const char *dir, const char *cpu,
+                       const uint8_t hash[HASH_LEN])
+{
+    char hashstr[HASH_STR_LEN];
+    char *path;
+
+    hash_to_str(hash, hashstr);
+    if (asprintf(&path, "%s/%s/%s.trace", dir, cpu, hashstr) < 0) {
+        return NULL;
+    }
+    return path;
+}
+
+static char *host_path(const char *dir, const char *host, int port)
+{
+    char *path;
+
+    if (strchr(host, '/')
+        || asprintf(&path, "%s/hosts/%s:%d", dir, host, port) < 0) {
+        return NULL;
+    }
+    return path;
+}
+
+int trace_cache_host_cpu(const char *dir, const char *host, int port,
+                         char cpu[CPU_ID_LEN])
+{
+    char *path = host_path(dir, host, port);
+    FILE *f = path ? fopen(path, "r") : NULL;
+    int r = 1;
+
+    if (f) {
+        if (fgets(cpu, CPU_ID_LEN, f)) {
+            cpu[strcspn(cpu, "\n")] = 0;
+            r = !cpu[0] || strchr(cpu, '/');
+        }
+        fclose(f);
+    }
+    free(path);
+    return r;
+}
+
+void trace_cache_set_host_cpu(const char *dir, const char *host, int port,
+                              const char *cpu)
+{
+    char *path = host_path(dir, host, port);
+    char *hosts;
+    FILE *f;
+
+    if (!path || asprintf(&hosts, "%s/hosts", dir) < 0) {
+        free(path);
+        return;
+    }
+    mkdir(dir, 0777);
+    mkdir(hosts, 0777);
+    free(hosts);
+    f = fopen(path, "w");
+    if (f) {
+        fprintf(f, "%s\n", cpu);
+        fclose(f);
+    }
+    free(path);
+}
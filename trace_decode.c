@@ -0,0 +1,268 @@
+/*******************************************************************************
+ * Copyright (c) 2017 Linaro Limited
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ ******************************************************************************/
+
+/* The trace decoder: reads the records of a trace using only the
+ * schema in its file header, so it works for a trace from any arch on
+ * any host. This, with trace.c, store.c and hash.c, is librisutrace.a.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+#include "risu_trace.h"
+
+/* The biggest struct reginfo or memory block we believe */
+#define MAX_PAYLOAD (1024 * 1024)
+
+struct trace_decoder {
+    trace_file *t;
+    struct trace_file_header h;         /* in host order */
+    struct trace_schema_block *blocks;
+    struct trace_schema_field *fields;
+    uint8_t *regs;                      /* h.reginfo_size */
+    uint8_t *data;                      /* the largest other payload */
+    size_t data_size;
+};
+
+static size_t pad8(size_t len)
+{
+    return (len + 7) & ~(size_t)7;
+}
+
+/* Take in the header and schema (as they are in a file) */
+static int load_schema(trace_decoder *d, const struct trace_file_header *fh)
+{
+    const struct trace_schema_block *b = (const void *)(fh + 1);
+    const struct trace_schema_field *f;
+    uint32_t i;
+
+    d->h = *fh;
+    d->h.version = le32toh(fh->version);
+    d->h.header_size = le32toh(fh->header_size);
+    d->h.arch[sizeof(d->h.arch) - 1] = 0;
+    d->h.layout = le32toh(fh->layout);
+    d->h.reginfo_size = le32toh(fh->reginfo_size);
+    d->h.memblock_len = le32toh(fh->memblock_len);
+    d->h.fingerprint = le32toh(fh->fingerprint);
+    d->h.nblocks = le32toh(fh->nblocks);
+    d->h.nfields = le32toh(fh->nfields);
+    if (d->h.reginfo_size > MAX_PAYLOAD || d->h.memblock_len > MAX_PAYLOAD) {
+        return -1;
+    }
+
+    d->blocks = calloc(d->h.nblocks + 1, sizeof(*d->blocks));
+    d->fields = calloc(d->h.nfields + 1, sizeof(*d->fields));
+    for (i = 0; i < d->h.nblocks; i++) {
+        struct trace_schema_block *db = &d->blocks[i];
+
+        db->tag = le32toh(b[i].tag);
+        db->offset = le32toh(b[i].offset);
+        db->count = le32toh(b[i].count);
+        db->stride = le32toh(b[i].stride);
+        if (!db->count || db->offset > d->h.reginfo_size
+            || (uint64_t)(db->count - 1) * db->stride
+               > d->h.reginfo_size - db->offset) {
+            return -1;
+        }
+    }
+    f = (const void *)(b + d->h.nblocks);
+    for (i = 0; i < d->h.nfields; i++) {
+        struct trace_schema_field *df = &d->fields[i];
+
+        memcpy(df->name, f[i].name, TRACE_FIELD_NAME_LEN);
+        df->name[TRACE_FIELD_NAME_LEN - 1] = 0;
+        df->offset = le32toh(f[i].offset);
+        df->size = le32toh(f[i].size);
+        df->count = le32toh(f[i].count);
+        if (df->offset > d->h.reginfo_size
+            || (uint64_t)df->size * df->count
+               > d->h.reginfo_size - df->offset) {
+            return -1;
+        }
+    }
+
+    d->regs = calloc(1, d->h.reginfo_size);
+    d->data_size = d->h.memblock_len > HASH_LEN ? d->h.memblock_len
+                                                : HASH_LEN;
+    d->data = malloc(d->data_size);
+    return 0;
+}
+
+trace_decoder *trace_decoder_open(const char *name)
+{
+    const struct trace_file_header *fh;
+    trace_decoder *d;
+    trace_file *t;
+    int r;
+
+    t = trace_open(name, 0);
+    if (!t) {
+        perror(name);
+        return NULL;
+    }
+    d = calloc(1, sizeof(*d));
+    d->t = t;
+    r = trace_read_header(t, &fh);
+    if (r == 0 && load_schema(d, fh) != 0) {
+        r = TRACE_BAD_HEADER;
+    }
+    if (r != 0) {
+        trace_header_error(name, r);
+        trace_decoder_close(d);
+        return NULL;
+    }
+    return d;
+}
+
+void trace_decoder_close(trace_decoder *d)
+{
+    trace_close(d->t);
+    free(d->blocks);
+    free(d->fields);
+    free(d->regs);
+    free(d->data);
+    free(d);
+}
+
+const struct trace_file_header *trace_decoder_header(trace_decoder *d)
+{
+    return &d->h;
+}
+
+const struct trace_schema_field *trace_decoder_fields(trace_decoder *d)
+{
+    return d->fields;
+}
+
+/* Read the register blocks of a record into regs, putting each block's
+ * pieces where its schema block says
+ */
+static int read_regs(trace_decoder *d)
+{
+    struct reginfo_block b;
+    uint32_t i, j;
+
+    memset(d->regs, 0, d->h.reginfo_size);
+    for (;;) {
+        const struct trace_schema_block *sb = NULL;
+        size_t len, piece;
+        uint8_t *p;
+
+        if (trace_read(d->t, &b, sizeof(b)) != 0) {
+            return -1;
+        }
+        b.tag = le32toh(b.tag);
+        b.len = le32toh(b.len);
+        if (b.tag == REGINFO_END) {
+            break;
+        }
+        len = pad8(b.len);
+        if (len > MAX_PAYLOAD) {
+            return -1;
+        }
+        if (len > d->data_size) {
+            d->data = realloc(d->data, len);
+            d->data_size = len;
+        }
+        if (len && trace_read(d->t, d->data, len) != 0) {
+            return -1;
+        }
+        for (i = 0; i < d->h.nblocks; i++) {
+            if (d->blocks[i].tag == b.tag) {
+                sb = &d->blocks[i];
+                break;
+            }
+        }
+        if (!sb) {
+            /* a block the schema doesn't place: skip it */
+            continue;
+        }
+        piece = b.len / sb->count;
+        if (piece * sb->count != b.len
+            || (uint64_t)(sb->count - 1) * sb->stride + piece
+               > d->h.reginfo_size - sb->offset) {
+            return -1;
+        }
+        p = d->data;
+        for (j = 0; j < sb->count; j++) {
+            memcpy(d->regs + sb->offset + j * sb->stride, p, piece);
+            p += piece;
+        }
+    }
+    return 0;
+}
+
+int trace_decoder_next(trace_decoder *d, struct trace_record *rec)
+{
+    trace_header_t h;
+    size_t len = 0;
+
+    if (trace_read(d->t, &h, sizeof(h)) != 0) {
+        return 1;
+    }
+    memset(rec, 0, sizeof(*rec));
+    rec->pc = le64toh(h.pc);
+    rec->op = le32toh(h.risu_op);
+    rec->timestamp = le64toh(h.timestamp);
+
+    switch (rec->op) {
+    case OP_SETMEMBLOCK:
+    case OP_GETMEMBLOCK:
+        return 0;
+    case OP_COMPAREMEM:
+        len = d->h.fingerprint ? HASH_LEN : d->h.memblock_len;
+        break;
+    default:
+        if (!d->h.fingerprint) {
+            if (read_regs(d) != 0) {
+                return -1;
+            }
+            rec->regs = d->regs;
+            return 0;
+        }
+        len = HASH_LEN;
+        break;
+    }
+    if (len > d->data_size) {
+        d->data = realloc(d->data, len);
+        d->data_size = len;
+    }
+    if (trace_read(d->t, d->data, len) != 0) {
+        return -1;
+    }
+    rec->data = d->data;
+    rec->len = len;
+    return 0;
+}
+
+const uint8_t *trace_field_bytes(const struct trace_record *rec,
+                                 const struct trace_schema_field *f, int i)
+{
+    if (!rec->regs || i < 0 || i >= f->count) {
+        return NULL;
+    }
+    return rec->regs + f->offset + i * f->size;
+}
+
+uint64_t trace_field_value(const struct trace_record *rec,
+                           const struct trace_schema_field *f, int i)
+{
+    const uint8_t *p = trace_field_bytes(rec, f, i);
+    uint64_t v = 0;
+    int j;
+
+    if (!p || f->size > 8) {
+        return 0;
+    }
+    for (j = f->size - 1; j >= 0; j--) {
+        v = (v << 8) | p[j];
+    }
+    return v;
+}
@@ -0,0 +1,226 @@
+/*******************************************************************************
+ * Copyright (c) 2017 Linaro Limited
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ ******************************************************************************/
+
+/* Watchdog (--timeout, --session-timeout): each session thread has a
+ * timer for the time to its next checkpoint, pushed back at every
+ * checkpoint, and one for the whole session, armed before it even
+ * connects to its peer. Either sends SIGALRM to that thread alone.
+ *
+ * The handler siglongjmp()s out of whatever it interrupts, so the
+ * thread keeps SIGALRM blocked except while it runs the test code and
+ * while it waits for its peer in watchdog_wait(); a timeout there
+ * makes the wait fail instead, and the session ends through its
+ * usual error path.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "risu.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/* In seconds, 0 for none */
+double checkpoint_timeout, session_timeout;
+
+static __thread timer_t timers[WATCHDOG_SESSION + 1];
+static __thread int armed[WATCHDOG_SESSION + 1];
+static __thread uintptr_t last_pc;
+static __thread int have_pc;
+/* the timer which ran out, if one has */
+static __thread int expired;
+/* SIGALRM is blocked for the session, except in ppoll() if waiting */
+static __thread int blocked, waiting;
+
+static void set_timer(int which, double secs)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = secs;
+    its.it_value.tv_nsec = (secs - (time_t)secs) * 1e9;
+    timer_settime(timers[which], 0, &its, NULL);
+}
+
+static void start_timer(int which, double secs)
+{
+    struct sigevent sev;
+
+    if (secs <= 0) {
+        return;
+    }
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGALRM;
+    sev.sigev_value.sival_int = which;
+    sev.sigev_notify_thread_id = syscall(SYS_gettid);
+    if (timer_create(CLOCK_MONOTONIC, &sev, &timers[which]) != 0) {
+        perror("timer_create");
+        exit(1);
+    }
+    armed[which] = 1;
+    set_timer(which, secs);
+}
+
+static void block_sigalrm(int how)
+{
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGALRM);
+    pthread_sigmask(how, &set, NULL);
+}
+
+void watchdog_start(void (*fn)(int, siginfo_t *, void *))
+{
+    struct sigaction sa;
+
+    expired = 0;
+    if (checkpoint_timeout <= 0 && session_timeout <= 0) {
+        return;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = fn;
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGALRM, &sa, 0) != 0) {
+        perror("sigaction");
+        exit(1);
+    }
+    have_pc = 0;
+    block_sigalrm(SIG_BLOCK);
+    blocked = 1;
+    start_timer(WATCHDOG_CHECKPOINT, checkpoint_timeout);
+    start_timer(WATCHDOG_SESSION, session_timeout);
+}
+
+void watchdog_run_image(void)
+{
+    if (!blocked) {
+        return;
+    }
+    /* the image gets the whole --timeout for its first checkpoint */
+    if (armed[WATCHDOG_CHECKPOINT]) {
+        set_timer(WATCHDOG_CHECKPOINT, checkpoint_timeout);
+    }
+    block_sigalrm(SIG_UNBLOCK);
+}
+
+int watchdog_wait(int fd, int events)
+{
+    struct pollfd pfd;
+    sigset_t mask;
+    int r;
+
+    if (!blocked) {
+        return 0;
+    }
+    pfd.fd = fd;
+    pfd.events = events;
+    pthread_sigmask(SIG_SETMASK, NULL, &mask);
+    sigdelset(&mask, SIGALRM);
+    waiting = 1;
+    do {
+        r = expired ? -1 : ppoll(&pfd, 1, NULL, &mask);
+    } while (r < 0 && errno == EINTR && !expired);
+    waiting = 0;
+    if (r < 0 && !expired) {
+        perror("ppoll");
+    }
+    return r < 0 ? -1 : 0;
+}
+
+int watchdog_running(void)
+{
+    return blocked;
+}
+
+int watchdog_waiting(void)
+{
+    return waiting;
+}
+
+int watchdog_timed_out(void)
+{
+    return expired;
+}
+
+void watchdog_stop(void)
+{
+    int i;
+
+    for (i = WATCHDOG_CHECKPOINT; i <= WATCHDOG_SESSION; i++) {
+        if (armed[i]) {
+            armed[i] = 0;
+            timer_delete(timers[i]);
+        }
+    }
+    if (blocked) {
+        blocked = 0;
+        block_sigalrm(SIG_UNBLOCK);
+    }
+}
+
+void watchdog_kick(uintptr_t pc)
+{
+    last_pc = pc;
+    have_pc = 1;
+    /* timer_settime() is async-signal-safe */
+    if (armed[WATCHDOG_CHECKPOINT]) {
+        set_timer(WATCHDOG_CHECKPOINT, checkpoint_timeout);
+    }
+}
+
+int watchdog_expired(siginfo_t *si)
+{
+    int which = si->si_value.sival_int;
+
+    /* one already on its way when we stopped is ignored */
+    if (si->si_code != SI_TIMER
+        || (which != WATCHDOG_CHECKPOINT && which != WATCHDOG_SESSION)
+        || !armed[which]) {
+        return 0;
+    }
+    expired = which;
+    return which;
+}
+
+void watchdog_report(int which, size_t checkpoints)
+{
+    const char *pattern;
+
+    if (which == WATCHDOG_CHECKPOINT) {
+        fprintf(stderr, "timed out: no checkpoint for %g seconds\n",
+                checkpoint_timeout);
+    } else {
+        fprintf(stderr, "timed out: session ran for %g seconds\n",
+                session_timeout);
+    }
+    if (!have_pc) {
+        fprintf(stderr, "timed out before the first checkpoint\n");
+        return;
+    }
+    /* which we reached, though the peer may not have */
+    fprintf(stderr, "timed out after %zd checkpoints, the last at image "
+            "offset 0x%" PRIxPTR "\n", checkpoints, last_pc);
+    pattern = image_pattern_at(&image_meta, last_pc);
+    if (pattern) {
+        fprintf(stderr, "timed out after test insn of pattern %s\n",
+                pattern);
+    }
+}